@@ -0,0 +1,374 @@
+#include "aggregator.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+
+/**
+ * @brief Read aggregator settings from the "aggregator" object of config.json.
+ *
+ * Recognises "port", "peers" (objects with "address" and "port"), "site",
+ * "interval_ms", "budget_bytes" (per second, to each peer), "max_datagram"
+ * and "site_expiry_ms".
+ *
+ * @throws std::runtime_error If a peer lacks an address or port, or the interval or datagram size is unusable.
+ */
+aggregator_settings aggregator_from_configuration (const json &settings) {
+    aggregator_settings result;
+    if (!settings.is_object ()) {
+        return result;
+    }
+
+    result.port = settings.value ("port", result.port);
+    for (const auto &peer: settings.value ("peers", json::array ())) {
+        aggregator_peer entry {peer.value ("address", ""), peer.value ("port", static_cast<unsigned short> (0))};
+        if (entry.address.empty () || entry.port == 0) {
+            throw std::runtime_error ("Bad aggregator peer: address and port are required");
+        }
+        result.peers.push_back (std::move (entry));
+    }
+    result.site = settings.value ("site", result.site);
+    result.interval = std::chrono::milliseconds (settings.value ("interval_ms", result.interval.count ()));
+    result.budget = settings.value ("budget_bytes", result.budget);
+    result.max_datagram = settings.value ("max_datagram", result.max_datagram);
+    result.site_expiry = std::chrono::milliseconds (settings.value ("site_expiry_ms", result.site_expiry.count ()));
+
+    if (result.interval.count () <= 0 || result.max_datagram < 256) {
+        throw std::runtime_error ("Bad aggregator: interval_ms must be positive and max_datagram at least 256");
+    }
+
+    return result;
+}
+
+site_aggregator::site_aggregator (aggregator_settings settings) : settings (std::move (settings)) {
+    const auto now = clock::now ();
+    for (const auto &peer: this->settings.peers) {
+        peers.push_back ({peer, token_bucket (this->settings.budget, now)});
+    }
+}
+
+/**
+ * @brief Send every peer what changed in our view since it was last sent, within its budget.
+ *
+ * Called once per interval. A peer gets at least the summary's header each
+ * time, which also tells it we are still there.
+ */
+void site_aggregator::summarize (const membership_snapshot &snapshot, transport &channel, const clock::time_point now) {
+    local_view view;
+    membership_digest digest;
+
+    view.descriptors.reserve (snapshot.participants.size ());
+    for (const auto &p: snapshot.participants) {
+        json descriptor = participant_to_json (*p);
+        descriptor.erase ("first_seen");
+        descriptor.erase ("last_seen");
+
+        const auto hash = membership_digest::descriptor_hash (descriptor);
+        digest.toggle (p->get_id (), hash);
+        view.hashes.emplace (p->get_id (), hash);
+        for (const auto &service: p->get_provides ()) {
+            view.services[service] = view.services.value (service, 0) + 1;
+        }
+        view.descriptors.emplace_back (std::move (descriptor), hash);
+    }
+
+    view.digest = digest.root ();
+
+    std::lock_guard lock (aggregator_mutex);
+
+    std::erase_if (sites, [&] (const auto &entry) {
+        if (now - entry.second.heard <= settings.site_expiry) {
+            return false;
+        }
+        sites_expired++;
+        return true;
+    });
+
+    for (auto &state: peers) {
+        summarize_to (state, view, channel, now);
+    }
+}
+
+/**
+ * @brief Send one peer its changes, in as many datagrams as its bucket allows. Called with aggregator_mutex held.
+ *
+ * A change is only recorded as sent once the datagram carrying it has gone.
+ */
+void site_aggregator::summarize_to (peer_state &state, const local_view &view, transport &channel,
+                                    const clock::time_point now) {
+    if (state.reset) {
+        state.sent.clear ();
+    }
+
+    // each change with its encoded size and the hash to record once it is sent; 0 for an id that left
+    struct change {
+        json entry;
+        std::size_t size;
+        std::string id;
+        std::uint64_t hash;
+    };
+
+    std::vector<change> pending;
+    for (const auto &[descriptor, hash]: view.descriptors) {
+        const auto &id = descriptor["id"].get_ref<const std::string &> ();
+        if (const auto it = state.sent.find (id); it == state.sent.end () || it->second != hash) {
+            pending.push_back ({descriptor, descriptor.dump ().size (), id, hash});
+        }
+    }
+    for (const auto &[id, hash]: state.sent) {
+        if (!view.hashes.contains (id)) {
+            json left = {{"id", id}, {"left", true}};
+            const auto size = left.dump ().size ();
+            pending.push_back ({std::move (left), size, id, 0});
+        }
+    }
+
+    const double burst = std::max (settings.budget, static_cast<double> (settings.max_datagram));
+    std::size_t next = 0;
+
+    while (true) {
+        json summary = {
+            {"type", "site_summary"},
+            {"site", settings.site},
+            {"seq", state.sequence + 1},
+            {"digest", view.digest},
+            {"members", view.descriptors.size ()},
+            {"services", view.services},
+            {"more", true}
+        };
+        if (state.reset) {
+            summary["reset"] = true;
+        }
+
+        // room for the header and the changes array around what is added below
+        std::size_t size = summary.dump ().size () + 16;
+
+        // a change too large for any datagram goes alone rather than never
+        json changes = json::array ();
+        const std::size_t first = next;
+        while (next < pending.size ()
+               && (next == first || size + pending[next].size + 1 <= settings.max_datagram)) {
+            changes.push_back (pending[next].entry);
+            size += pending[next].size + 1;
+            next++;
+        }
+
+        const bool more = next < pending.size ();
+        summary["more"] = more;
+        summary["changes"] = std::move (changes);
+
+        const auto payload = summary.dump ();
+        if (!state.bucket.take (settings.budget, burst, now, static_cast<double> (payload.size ()))) {
+            state.deferred++;
+            return;
+        }
+        if (channel.send_to (payload, state.peer.address, state.peer.port) < 0) {
+            perror ("Sending site summary error");
+            return;
+        }
+
+        for (std::size_t i = first; i < next; i++) {
+            if (pending[i].hash == 0) {
+                state.sent.erase (pending[i].id);
+            } else {
+                state.sent[pending[i].id] = pending[i].hash;
+            }
+        }
+        state.reset = false;
+        state.sequence++;
+        state.bytes += payload.size ();
+        state.datagrams++;
+
+        if (!more) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief The configured peer at an address, if any. Called with aggregator_mutex held.
+ */
+site_aggregator::peer_state *site_aggregator::peer_at (const std::string &address) {
+    const auto it = std::find_if (peers.begin (), peers.end (), [&address] (const auto &state) {
+        return state.peer.address == address;
+    });
+    return it == peers.end () ? nullptr : &*it;
+}
+
+/**
+ * @brief Handle one datagram on the aggregator port: a remote site's summary or its request for a resync.
+ */
+void site_aggregator::receive (const char *buffer, const std::size_t length, const std::string &source,
+                               transport &channel, const clock::time_point now) {
+    std::lock_guard lock (aggregator_mutex);
+
+    auto *peer = peer_at (source);
+    if (!peer) {
+        rejected++;
+        return;
+    }
+
+    try {
+        const auto message = json::parse (buffer, buffer + length);
+        const auto type = message.value ("type", "");
+
+        if (type == "site_summary") {
+            apply (message, source, channel, now);
+        } else if (type == "site_resync") {
+            peer->reset = true;
+            peer->resyncs++;
+        }
+    } catch (const json::exception &e) {
+        rejected++;
+        std::cerr << "Ignoring bad site summary from " << source << ": " << e.what () << "\n";
+    }
+}
+
+/**
+ * @brief Apply a remote site's summary to our copy of it. Called with aggregator_mutex held.
+ *
+ * A summary that is not the next in sequence means one went missing, so
+ * the copy is applied to as far as it goes and a resync is asked for.
+ * Every field is read before the copy is touched, so a malformed summary
+ * throws with the copy as it was rather than half applied.
+ */
+void site_aggregator::apply (const json &summary, const std::string &source, transport &channel,
+                             const clock::time_point now) {
+    const auto name = summary.at ("site").get<std::string> ();
+    const auto sequence = summary.at ("seq").get<std::uint64_t> ();
+    const auto sent_digest = summary.at ("digest").get<std::uint64_t> ();
+    const bool reset = summary.value ("reset", false);
+    const bool more = summary.value ("more", false);
+
+    struct member_change {
+        std::string id;
+        bool left;
+        const json &descriptor;
+    };
+    std::vector<member_change> changes;
+    for (const auto &change: summary.at ("changes")) {
+        changes.push_back ({change.at ("id").get<std::string> (), change.value ("left", false), change});
+    }
+
+    auto &site = sites[name];
+    site.address = source;
+    site.heard = now;
+
+    if (reset) {
+        site.members.clear ();
+        site.digest = {};
+        site.services = json::object ();
+    } else if (sequence <= site.sequence) {
+        return;
+    } else if (sequence != site.sequence + 1) {
+        ask_resync (site, channel, now);
+    }
+    site.sequence = sequence;
+
+    for (const auto &change: changes) {
+        if (const auto it = site.members.find (change.id); it != site.members.end ()) {
+            site.digest.toggle (it->second);
+            site.members.erase (it);
+        }
+        if (!change.left) {
+            site.digest.toggle (change.descriptor);
+            site.members.emplace (change.id, change.descriptor);
+        }
+    }
+
+    site.services = summary.value ("services", json::object ());
+
+    site.sent_digest = sent_digest;
+    site.complete = !more;
+    if (site.complete && site.digest.root () != site.sent_digest) {
+        ask_resync (site, channel, now);
+    }
+}
+
+/**
+ * @brief Ask a site's aggregator to send its view again from scratch, at most once per two intervals.
+ */
+void site_aggregator::ask_resync (remote_site &site, transport &channel,
+                                  const clock::time_point now) {
+    if (site.resync_asked != clock::time_point {} && now - site.resync_asked < 2 * settings.interval) {
+        return;
+    }
+
+    const auto *peer = peer_at (site.address);
+    if (!peer) {
+        return;
+    }
+
+    site.resync_asked = now;
+    const json request = {{"type", "site_resync"}, {"site", settings.site}};
+    if (channel.send_to (request.dump (), peer->peer.address, peer->peer.port) < 0) {
+        perror ("Sending site resync error");
+        return;
+    }
+    resyncs_requested++;
+}
+
+/**
+ * @brief Every remote site we hold: its members' descriptors and its providers by service.
+ */
+json site_aggregator::sites_view () const {
+    std::lock_guard lock (aggregator_mutex);
+
+    json view = json::object ();
+    for (const auto &[name, site]: sites) {
+        json members = json::array ();
+        json providers = json::object ();
+        for (const auto &[id, descriptor]: site.members) {
+            // a remote member's descriptor is only as well formed as its site sent it
+            for (const auto &service: descriptor.value ("provides", json::array ())) {
+                if (service.is_string ()) {
+                    providers[service.get<std::string> ()].push_back (id);
+                }
+            }
+            members.push_back (descriptor);
+        }
+        view[name] = {
+            {"address", site.address},
+            {"members", std::move (members)},
+            {"providers", std::move (providers)},
+            {"in_sync", site.complete && site.digest.root () == site.sent_digest}
+        };
+    }
+    return view;
+}
+
+json site_aggregator::statistics () const {
+    const auto now = clock::now ();
+    std::lock_guard lock (aggregator_mutex);
+
+    json sent = json::array ();
+    for (const auto &state: peers) {
+        sent.push_back ({
+            {"peer", state.peer.address + ":" + std::to_string (state.peer.port)},
+            {"bytes", state.bytes},
+            {"datagrams", state.datagrams},
+            {"deferred", state.deferred},
+            {"resyncs", state.resyncs}
+        });
+    }
+
+    json remote = json::object ();
+    for (const auto &[name, site]: sites) {
+        remote[name] = {
+            {"members", site.members.size ()},
+            {"services", site.services},
+            {"in_sync", site.complete && site.digest.root () == site.sent_digest},
+            {"age_ms", std::chrono::duration_cast<std::chrono::milliseconds> (now - site.heard).count ()}
+        };
+    }
+
+    return {
+        {"site", settings.site},
+        {"peers", std::move (sent)},
+        {"sites", std::move (remote)},
+        {"resyncs_requested", resyncs_requested},
+        {"sites_expired", sites_expired},
+        {"rejected", rejected}
+    };
+}
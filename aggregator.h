@@ -0,0 +1,139 @@
+#ifndef HOSTMON_AGGREGATOR_H
+#define HOSTMON_AGGREGATOR_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#include "digest.h"
+#include "monitor.h"
+#include "ratelimit.h"
+#include "transport.h"
+
+using json = nlohmann::json;
+
+/**
+ * @brief A remote site's aggregator, reached over unicast on `port`.
+ */
+struct aggregator_peer {
+    std::string address;
+    unsigned short port = 0;
+};
+
+/**
+ * @brief Where this site's aggregator listens, which remote aggregators it sends to, and how much.
+ *
+ * Without a port there is no aggregator. `site` names this site to the
+ * others and defaults to the engine's id.
+ */
+struct aggregator_settings {
+    unsigned short port = 0;
+    std::vector<aggregator_peer> peers;
+    std::string site;
+
+    std::chrono::milliseconds interval {1000};
+    // bytes per second to each peer, and the most any one datagram may carry
+    double budget = 8192;
+    std::size_t max_datagram = 1200;
+    // a site not heard from for this long is dropped from the view
+    std::chrono::milliseconds site_expiry {10000};
+
+    [[nodiscard]] bool enabled () const {
+        return port != 0;
+    }
+};
+
+aggregator_settings aggregator_from_configuration (const json &settings);
+
+/**
+ * @class site_aggregator
+ * @brief Summarises our view for remote sites and keeps theirs, so WAN traffic grows with sites rather than hosts.
+ *
+ * Once per interval each peer gets a "site_summary": the membership digest
+ * of our view, how many providers each service has, and the descriptors
+ * that joined or changed and the ids that left since what that peer was
+ * last sent. The provider lists themselves are rebuilt by the receiver from
+ * the descriptors, which name their services, so they cost nothing extra
+ * on the wire and the digest covers them. What a peer was sent is
+ * remembered per peer by descriptor hash, so the changes are worked out
+ * against the published snapshot rather than by replaying events. Each peer has a token bucket of `budget` bytes
+ * per second; changes that do not fit wait for the next interval, and the
+ * summary says so ("more"), so the peer knows its copy is not yet complete.
+ *
+ * A receiver applies the changes to its copy of the site and, once a
+ * summary says nothing more is pending, compares the copy's digest with the
+ * one sent. On a mismatch, a lost datagram or a restart, it asks for a
+ * resync; the sender then forgets what it sent and starts again from a
+ * summary marked "reset". Summaries are only accepted from configured peers.
+ */
+class site_aggregator {
+    using clock = std::chrono::steady_clock;
+
+    struct peer_state {
+        aggregator_peer peer;
+        token_bucket bucket;
+        // what the peer was sent, by id: the descriptor hash
+        std::unordered_map<std::string, std::uint64_t> sent {};
+        std::uint64_t sequence = 0;
+        bool reset = true;
+
+        std::uint64_t bytes = 0;
+        std::uint64_t datagrams = 0;
+        std::uint64_t deferred = 0;
+        std::uint64_t resyncs = 0;
+    };
+
+    struct remote_site {
+        std::string address;
+        std::map<std::string, json> members;
+        membership_digest digest;
+        // the providers per service the site last counted, which the copy matches once complete
+        json services = json::object ();
+        std::uint64_t sequence = 0;
+        std::uint64_t sent_digest = 0;
+        bool complete = false;
+        clock::time_point heard;
+        clock::time_point resync_asked;
+    };
+
+    aggregator_settings settings;
+
+    mutable std::mutex aggregator_mutex;
+    std::vector<peer_state> peers;
+    std::map<std::string, remote_site> sites;
+    std::uint64_t resyncs_requested = 0;
+    std::uint64_t sites_expired = 0;
+    std::uint64_t rejected = 0;
+
+    // our view as summarised: each descriptor with its hash, and the hashes by id
+    struct local_view {
+        std::vector<std::pair<json, std::uint64_t>> descriptors;
+        std::unordered_map<std::string, std::uint64_t> hashes;
+        std::uint64_t digest = 0;
+        // how many providers each service has
+        json services = json::object ();
+    };
+
+    void summarize_to (peer_state &state, const local_view &view, transport &channel, clock::time_point now);
+    void apply (const json &summary, const std::string &source, transport &channel, clock::time_point now);
+    void ask_resync (remote_site &site, transport &channel, clock::time_point now);
+    peer_state *peer_at (const std::string &address);
+
+public:
+    explicit site_aggregator (aggregator_settings settings);
+
+    void summarize (const membership_snapshot &snapshot, transport &channel, clock::time_point now = clock::now ());
+    void receive (const char *buffer, std::size_t length, const std::string &source, transport &channel,
+                  clock::time_point now = clock::now ());
+
+    [[nodiscard]] json sites_view () const;
+    [[nodiscard]] json statistics () const;
+};
+
+#endif //HOSTMON_AGGREGATOR_H
@@ -0,0 +1,388 @@
+#include "bridge.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <net/if.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+/**
+ * @brief Read bridge settings from the "bridge" object of config.json.
+ *
+ * Recognises "interfaces" (names), "tunnels" (objects with "listen_port",
+ * "peer" and "peer_port"), "ttl", "dedup_ms", "unsequenced_dedup_ms" and "dedup_entries".
+ */
+bridge_settings bridge_from_configuration (const json &settings) {
+    bridge_settings result;
+    if (!settings.is_object ()) {
+        return result;
+    }
+
+    result.interfaces = settings.value ("interfaces", std::vector<std::string> ());
+    for (const auto &tunnel: settings.value ("tunnels", json::array ())) {
+        result.tunnels.push_back ({
+            tunnel.value ("listen_port", static_cast<unsigned short> (0)),
+            tunnel.value ("peer", ""),
+            tunnel.value ("peer_port", static_cast<unsigned short> (0))
+        });
+    }
+    result.ttl = settings.value ("ttl", result.ttl);
+    result.dedup_window = std::chrono::milliseconds (settings.value ("dedup_ms", result.dedup_window.count ()));
+    result.unsequenced_dedup_window = std::chrono::milliseconds (
+        settings.value ("unsequenced_dedup_ms", result.unsequenced_dedup_window.count ()));
+    result.dedup_entries = settings.value ("dedup_entries", result.dedup_entries);
+
+    return result;
+}
+
+json bridge_counters::describe () const {
+    return {
+        {"forwarded", forwarded.load ()},
+        {"duplicates", duplicates.load ()},
+        {"malformed", malformed.load ()},
+        {"looped", looped.load ()},
+        {"expired", expired.load ()},
+        {"refused", refused.load ()}
+    };
+}
+
+/**
+ * @brief A socket on the group's port that hears and speaks the group on one interface only.
+ *
+ * @throws std::runtime_error If there is no such interface or the socket cannot be set up.
+ */
+static std::unique_ptr<udp_transport> interface_socket (const std::string &interface, const std::string &group_ip,
+                                                        const unsigned short group_port) {
+    const unsigned int index = if_nametoindex (interface.c_str ());
+    if (index == 0) {
+        throw std::runtime_error ("No interface " + interface);
+    }
+
+    const int sock = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        throw std::runtime_error ("Failed to create socket");
+    }
+
+    const auto fail = [sock, &interface] (const char *what) {
+        const std::string reason = strerror (errno);
+        close (sock);
+        throw std::runtime_error (std::string (what) + " on " + interface + ": " + reason);
+    };
+
+    constexpr int yes = 1;
+    constexpr int no = 0;
+    setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl (INADDR_ANY);
+    address.sin_port = htons (group_port);
+    if (bind (sock, reinterpret_cast<sockaddr *> (&address), sizeof (address)) < 0) {
+        fail ("Binding bridge socket error");
+    }
+
+    ip_mreqn membership = {};
+    inet_pton (AF_INET, group_ip.c_str (), &membership.imr_multiaddr);
+    membership.imr_ifindex = static_cast<int> (index);
+    if (setsockopt (sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof (membership)) < 0) {
+        fail ("Joining the group error");
+    }
+    if (setsockopt (sock, IPPROTO_IP, IP_MULTICAST_IF, &membership, sizeof (membership)) < 0) {
+        fail ("Choosing the multicast interface error");
+    }
+
+    // only the group on this interface, and none of our own forwarded copies back
+    setsockopt (sock, IPPROTO_IP, IP_MULTICAST_ALL, &no, sizeof (no));
+    setsockopt (sock, IPPROTO_IP, IP_MULTICAST_LOOP, &no, sizeof (no));
+
+    return std::make_unique<udp_transport> (sock, group_ip.c_str (), group_port);
+}
+
+/**
+ * @brief Open the bridge's ports and take over the home transport.
+ *
+ * `home` is only taken once every port is open; when this throws, it is
+ * left with the caller, as with xdp_transport.
+ *
+ * @param self Our id, as recorded in the "bridges" of what we forward.
+ * @param timeout_ms How long receive() waits for a datagram on any port.
+ * @throws std::runtime_error If an interface, tunnel port or the epoll descriptor cannot be set up.
+ */
+bridge_transport::bridge_transport (std::unique_ptr<transport> &home, const bridge_settings &settings,
+                                    const std::string &group_ip, const unsigned short group_port, std::string self,
+                                    const int timeout_ms, std::shared_ptr<bridge_counters> counters)
+    : self (std::move (self)), settings (settings), counters (std::move (counters)), timeout_ms (timeout_ms) {
+    std::vector<port> opened;
+    auto home_sender = udp_transport::multicast (group_ip.c_str (), group_port, false);
+    constexpr int no = 0;
+    setsockopt (home_sender->descriptor (), IPPROTO_IP, IP_MULTICAST_LOOP, &no, sizeof (no));
+    opened.push_back ({nullptr, std::move (home_sender), {}, 0});
+
+    const auto prepare = [] (udp_transport &socket) {
+        socket.count_drops ();
+        socket.timestamp_arrivals ();
+        fcntl (socket.descriptor (), F_SETFL, fcntl (socket.descriptor (), F_GETFL) | O_NONBLOCK);
+    };
+
+    for (const auto &interface: settings.interfaces) {
+        auto socket = interface_socket (interface, group_ip, group_port);
+        prepare (*socket);
+        opened.push_back ({std::move (socket), nullptr, {}, 0});
+    }
+
+    for (const auto &tunnel: settings.tunnels) {
+        auto socket = udp_transport::bound (tunnel.listen_port);
+        prepare (*socket);
+        opened.push_back ({std::move (socket), nullptr, tunnel.peer, tunnel.peer_port});
+    }
+
+    events = epoll_create1 (EPOLL_CLOEXEC);
+    if (events < 0) {
+        throw std::runtime_error ("Creating bridge epoll error: " + std::string (strerror (errno)));
+    }
+
+    opened.front ().channel = std::move (home);
+    ports = std::move (opened);
+
+    for (std::uint32_t i = 0; i < ports.size (); i++) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        epoll_ctl (events, EPOLL_CTL_ADD, ports[i].channel->descriptor (), &event);
+    }
+}
+
+bridge_transport::~bridge_transport () {
+    close (events);
+}
+
+ssize_t bridge_transport::send (const std::string &) {
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+/**
+ * @brief The next datagram from any domain that is not a copy of one already handed up.
+ *
+ * Forwarding happens here too, so a bridge forwards only as fast as its
+ * engine receives.
+ */
+ssize_t bridge_transport::receive (char *buffer, const std::size_t size, std::string &source) {
+    while (true) {
+        epoll_event ready[8];
+        const int count = epoll_wait (events, ready, 8, timeout_ms);
+        if (count < 0) {
+            return -1;
+        }
+        if (count == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            const auto from = ready[i].data.u32;
+            auto &channel = *ports[from].channel;
+
+            const ssize_t received = channel.receive (buffer, size, source);
+            if (received < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+
+            if (pass (buffer, received, from, source)) {
+                arrival = channel.last_arrival ();
+                return received;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Forward an advertisement to the other domains if it should be, and say whether to hand it up.
+ *
+ * Anything that does not parse as an advertisement is handed up untouched,
+ * for the engine to judge as it would any datagram. So is an advertisement
+ * whose "ttl" is not a count of hops or whose "bridges" is not a list, but it
+ * is not forwarded: the path it claims cannot be extended or trusted. A "ttl"
+ * above our own is lowered to it. Never throws.
+ */
+bool bridge_transport::pass (const char *buffer, const std::size_t length, const std::size_t from,
+                             const std::string &source) {
+    const auto &origin = ports[from];
+    if (!origin.peer.empty () && source != origin.peer) {
+        counters->refused++;
+        return false;
+    }
+
+    json message = json::parse (buffer, buffer + length, nullptr, false);
+    if (!message.is_object () || message.contains ("type") || !message.contains ("id")) {
+        return true;
+    }
+
+    const auto path = message.find ("bridges");
+    const auto ttl = message.find ("ttl");
+    if ((path != message.end () && !path->is_array ()) || (ttl != message.end () && !ttl->is_number_unsigned ())) {
+        counters->malformed++;
+        return true;
+    }
+
+    json bridges = json::array ();
+    if (path != message.end ()) {
+        for (const auto &bridge: *path) {
+            if (bridge == self) {
+                counters->looped++;
+                return false;
+            }
+        }
+        bridges = *path;
+    }
+
+    unsigned int hops = settings.ttl;
+    if (ttl != message.end ()) {
+        hops = static_cast<unsigned int> (std::min<std::uint64_t> (ttl->get<std::uint64_t> (), settings.ttl));
+    }
+
+    message.erase ("digest");
+    message.erase ("solicit");
+    message.erase ("ttl");
+    message.erase ("bridges");
+
+    if (!first_copy (dedup_key (message), clock::now ())) {
+        counters->duplicates++;
+        return false;
+    }
+
+    if (hops == 0) {
+        counters->expired++;
+        return true;
+    }
+
+    message["ttl"] = hops - 1;
+    message["bridges"] = std::move (bridges);
+    message["bridges"].push_back (self);
+
+    std::string tagged;
+    try {
+        tagged = message.dump ();
+    } catch (const json::exception &) {
+        counters->malformed++;
+        return true;
+    }
+
+    forward (tagged, from);
+    return true;
+}
+
+/**
+ * @brief What tells the copies of one advertisement from other advertisements, once its path is stripped.
+ *
+ * A heartbeat is its sender's id, incarnation and sequence number; the
+ * incarnation keeps a restarted sender, whose sequence starts over, from
+ * being taken for its last run. Anything without a sequence number, such as
+ * a solicit answer or a sender older than sequencing, is its payload, which
+ * only copies of it share until the sender next repeats itself (see first_copy()).
+ */
+std::string bridge_transport::dedup_key (const json &message) {
+    if (const auto seq = message.find ("seq"); seq != message.end () && seq->is_number_unsigned ()) {
+        const auto incarnation = message.find ("incarnation");
+        return message["id"].dump () + "/"
+               + (incarnation != message.end () ? incarnation->dump () : std::string ()) + "/"
+               + std::to_string (seq->get<std::uint64_t> ());
+    }
+
+    const auto payload = message.dump (-1, ' ', false, json::error_handler_t::replace);
+    return "#" + std::to_string (std::hash<std::string> {} (payload));
+}
+
+/**
+ * @brief Remember a forwarded advertisement, unless it is already remembered.
+ *
+ * A payload key ("#...") is remembered for unsequenced_dedup_window only:
+ * a sender without sequence numbers repeats the same payload every
+ * heartbeat, and only the copies that came another way are to be dropped.
+ *
+ * @return false for a copy of one forwarded within the dedup window.
+ */
+bool bridge_transport::first_copy (const std::string &key, const clock::time_point now) {
+    while (!seen_order.empty ()
+           && (now - seen_order.front ().first > settings.dedup_window || seen.size () > settings.dedup_entries)) {
+        // a key seen again since has a later entry of its own further back
+        if (const auto it = seen.find (seen_order.front ().second);
+            it != seen.end () && it->second == seen_order.front ().first) {
+            seen.erase (it);
+        }
+        seen_order.pop_front ();
+    }
+
+    const auto window = key.starts_with ("#") ? settings.unsequenced_dedup_window : settings.dedup_window;
+    if (const auto [it, added] = seen.try_emplace (key, now); !added) {
+        if (now - it->second <= window) {
+            return false;
+        }
+        it->second = now;
+    }
+    seen_order.emplace_back (now, key);
+    return true;
+}
+
+/**
+ * @brief Send a tagged advertisement out of every port but the one it came in on.
+ */
+void bridge_transport::forward (const std::string &message, const std::size_t from) {
+    for (std::size_t i = 0; i < ports.size (); i++) {
+        if (i == from) {
+            continue;
+        }
+
+        auto &p = ports[i];
+        const ssize_t sent = !p.peer.empty () ? p.channel->send_to (message, p.peer, p.peer_port)
+                                              : (p.sender ? p.sender : p.channel)->send (message);
+        if (sent < 0) {
+            perror ("Forwarding advertisement error");
+            continue;
+        }
+        counters->forwarded++;
+    }
+}
+
+/**
+ * @brief Drops on every port's socket.
+ */
+std::uint64_t bridge_transport::kernel_drops () const {
+    std::uint64_t drops = 0;
+    for (const auto &p: ports) {
+        drops += p.channel->kernel_drops ();
+    }
+    return drops;
+}
+
+/**
+ * @brief Put a bridge around the home domain's transport when the settings ask for one.
+ *
+ * When a port cannot be opened the engine goes on receiving its own domain alone.
+ */
+std::unique_ptr<transport> with_bridge (std::unique_ptr<transport> home, const bridge_settings &settings,
+                                        const std::string &group_ip, const unsigned short group_port,
+                                        const std::string &self, const int timeout_ms,
+                                        const std::shared_ptr<bridge_counters> &counters) {
+    if (!settings.enabled ()) {
+        return home;
+    }
+
+    try {
+        return std::make_unique<bridge_transport> (home, settings, group_ip, group_port, self, timeout_ms, counters);
+    } catch (const std::runtime_error &e) {
+        std::cerr << "Bridge unavailable, receiving our own domain only: " << e.what () << "\n";
+        return home;
+    }
+}
@@ -0,0 +1,150 @@
+#ifndef HOSTMON_BRIDGE_H
+#define HOSTMON_BRIDGE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#include "transport.h"
+
+using json = nlohmann::json;
+
+/**
+ * @brief A unicast tunnel to a peer bridge: we receive on `listen_port` and send to `peer`:`peer_port`.
+ */
+struct bridge_tunnel {
+    unsigned short listen_port = 0;
+    std::string peer;
+    unsigned short peer_port = 0;
+};
+
+/**
+ * @brief Which domains a bridge joins to ours. Without interfaces or tunnels there is no bridge.
+ *
+ * `interfaces` are the other segments' interfaces, by name; the engine's own
+ * segment is always one of the domains and should not be listed.
+ */
+struct bridge_settings {
+    std::vector<std::string> interfaces;
+    std::vector<bridge_tunnel> tunnels;
+
+    // how many bridges an advertisement may cross
+    unsigned int ttl = 4;
+    // how long, and how many, forwarded advertisements are remembered to drop their copies
+    std::chrono::milliseconds dedup_window {2000};
+    // the same for advertisements without a sequence number, which repeat a payload every heartbeat
+    std::chrono::milliseconds unsequenced_dedup_window {100};
+    std::size_t dedup_entries = 65536;
+
+    [[nodiscard]] bool enabled () const {
+        return !interfaces.empty () || !tunnels.empty ();
+    }
+};
+
+bridge_settings bridge_from_configuration (const json &settings);
+
+/**
+ * @brief What a bridge did with the advertisements it received, shared with the engine for statistics.
+ */
+struct bridge_counters {
+    std::atomic<std::uint64_t> forwarded = 0;
+    std::atomic<std::uint64_t> duplicates = 0;
+    std::atomic<std::uint64_t> looped = 0;
+    std::atomic<std::uint64_t> expired = 0;
+    std::atomic<std::uint64_t> refused = 0;
+    // handed up but not forwarded, for a "ttl" or "bridges" of the wrong type
+    std::atomic<std::uint64_t> malformed = 0;
+
+    [[nodiscard]] json describe () const;
+};
+
+/**
+ * @class bridge_transport
+ * @brief Receives the group from several multicast domains and forwards advertisements between them.
+ *
+ * The transport it is given is the home domain, the engine's own segment.
+ * Each listed interface gets a socket joined to the group on that interface
+ * alone, and each tunnel a socket exchanging datagrams with one peer bridge;
+ * together they are the bridge's ports, waited on through one epoll
+ * descriptor.
+ *
+ * An advertisement received on one port is sent out of every other, tagged
+ * with the bridges it has crossed ("bridges") and the hops it has left
+ * ("ttl"). It is not forwarded when it already names us (a loop), when it
+ * has no hops left, or when it was forwarded within the dedup window (a
+ * copy that came another way; see dedup_key()). Only the first
+ * copy is handed to receive(), so our own table sees each heartbeat once;
+ * a domain joined to another by several bridges gets one copy from each.
+ *
+ * Forwarded copies lose their digest and solicit nonce: anti-entropy and
+ * solicitation stay within a domain, since the sender cannot be reached
+ * from the others by the address the copy comes from. Solicits themselves
+ * are handed up but never forwarded.
+ */
+class bridge_transport : public transport {
+    using clock = std::chrono::steady_clock;
+
+    struct port {
+        std::unique_ptr<transport> channel;
+        // what forwarded datagrams go out on, when not the channel itself
+        std::unique_ptr<transport> sender;
+        // set for a tunnel, which sends with send_to() and accepts datagrams from its peer only
+        std::string peer;
+        unsigned short peer_port = 0;
+    };
+
+    // the home domain first; its sender is a socket of our own, since the home transport may not send
+    std::vector<port> ports;
+
+    std::string self;
+    bridge_settings settings;
+    std::shared_ptr<bridge_counters> counters;
+
+    int events = -1;
+    int timeout_ms;
+    std::uint64_t arrival = 0;
+
+    std::unordered_map<std::string, clock::time_point> seen;
+    std::deque<std::pair<clock::time_point, std::string>> seen_order;
+
+    static std::string dedup_key (const json &message);
+    bool first_copy (const std::string &key, clock::time_point now);
+    bool pass (const char *buffer, std::size_t length, std::size_t from, const std::string &source);
+    void forward (const std::string &message, std::size_t from);
+
+public:
+    bridge_transport (std::unique_ptr<transport> &home, const bridge_settings &settings, const std::string &group_ip,
+                      unsigned short group_port, std::string self, int timeout_ms,
+                      std::shared_ptr<bridge_counters> counters);
+    ~bridge_transport () override;
+
+    bridge_transport (const bridge_transport &) = delete;
+    bridge_transport &operator= (const bridge_transport &) = delete;
+
+    ssize_t send (const std::string &message) override;
+    ssize_t receive (char *buffer, std::size_t size, std::string &source) override;
+
+    [[nodiscard]] int descriptor () const override {
+        return events;
+    }
+
+    [[nodiscard]] std::uint64_t kernel_drops () const override;
+
+    [[nodiscard]] std::uint64_t last_arrival () const override {
+        return arrival;
+    }
+};
+
+std::unique_ptr<transport> with_bridge (std::unique_ptr<transport> home, const bridge_settings &settings,
+                                        const std::string &group_ip, unsigned short group_port,
+                                        const std::string &self, int timeout_ms,
+                                        const std::shared_ptr<bridge_counters> &counters);
+
+#endif //HOSTMON_BRIDGE_H
@@ -1,37 +1,94 @@
 #include "monitor.h"
 #include "comms.h"
+#include "transport.h"
 
-#include <boost/asio.hpp>
+#include <cstdio>
 #include <iostream>
 
-using boost::asio::ip::udp;
-
 #include <nlohmann/json.hpp>
 
-// shortening the namespace for convenience
-using namespace boost::asio::ip;
 using json = nlohmann::json;
 
-void send_update (const std::string& service_ip, const int op, const std::string& arch) {
+std::string encode_update (const std::string& service_ip, const int op, const std::string& arch) {
     json msg = {};
     msg["address"] = service_ip;
     msg["status"] = op;
     msg["provider_architecture"] = arch;
     msg["timestamp"] = get_timestamp();
-    std::string message = msg.dump();
+    return msg.dump();
+}
+
+/**
+ * @brief The aggregate update sent to consumers when a partition is suspected or resolved.
+ */
+std::string encode_partition_update (const partition_event& event) {
+    json msg = {};
+    msg["status"] = event.suspected ? UPDATE_PARTITION_SUSPECTED : UPDATE_PARTITION_RESOLVED;
+    msg["held"] = event.held;
+    if (!event.suspected) {
+        msg["released"] = event.released;
+        msg["retracted"] = event.retracted;
+    }
+    msg["timestamp"] = event.at;
+    return msg.dump();
+}
+
+/**
+ * @brief The update sent to consumers when our own receive path starts or stops dropping datagrams.
+ */
+std::string encode_overload_update (const bool overloaded, const std::uint64_t kernel_drops, const std::uint64_t expiry_ms) {
+    json msg = {};
+    msg["status"] = overloaded ? UPDATE_RECEIVE_OVERLOAD : UPDATE_RECEIVE_RECOVERED;
+    msg["kernel_drops"] = kernel_drops;
+    msg["expiry_ms"] = expiry_ms;
+    msg["timestamp"] = get_timestamp();
+    return msg.dump();
+}
+
+/**
+ * @brief The update sent to consumers when a participant still online changes its descriptor.
+ *
+ * "changed" holds the new value of each changed field, and "previous" the
+ * old one, so a consumer keyed by address can move its state from the old
+ * address to the new. A field the participant record does not carry, or
+ * that one side lacks, is null.
+ */
+std::string encode_attribute_update (const membership_change& change) {
+    const auto fields = [&change] (const participant& p) {
+        const json record = participant_to_json(p);
+        json values = json::object();
+        for (const auto& field: change.changed) {
+            const auto it = record.find(field);
+            values[field] = it == record.end() ? json() : *it;
+        }
+        return values;
+    };
+
+    json msg = {};
+    msg["id"] = change.subject->get_id();
+    msg["address"] = change.subject->get_address();
+    msg["status"] = UPDATE_ATTRIBUTES_CHANGED;
+    msg["provider_architecture"] = change.subject->get_architecture();
+    msg["changed"] = fields(*change.subject);
+    if (change.previous) {
+        msg["previous"] = fields(*change.previous);
+    }
+    msg["timestamp"] = change.at;
+    return msg.dump();
+}
+
+void send_update (const std::string& service_ip, const int op, const std::string& arch) {
+    std::string message = encode_update (service_ip, op, arch);
 
     std::cout << message << std::endl;
 
     try {
-        boost::asio::io_service io_service;
-        udp::socket socket(io_service);
-        udp::endpoint local_endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 10000);
-
-        socket.open(udp::v4());
-        socket.send_to(boost::asio::buffer(message), local_endpoint);
+        // one socket for the life of the process, rather than one per update
+        static const auto channel = udp_transport::unicast ("127.0.0.1", 10000);
 
-        // Clean up
-        socket.close();
+        if (channel->send (message) < 0) {
+            perror ("Sending update error");
+        }
     } catch (const std::exception& e) {
         // Handle exception
         std::cerr << "Error: " << e.what() << "\n";
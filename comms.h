@@ -2,6 +2,17 @@
 #ifndef HOSTMON_COMMS_H
 #define HOSTMON_COMMS_H
 
+#include <cstdint>
+#include <string>
+
+#include "partition.h"
+
+struct membership_change;
+
+std::string encode_update (const std::string& service_ip, int op, const std::string& arch);
+std::string encode_partition_update (const partition_event& event);
+std::string encode_overload_update (bool overloaded, std::uint64_t kernel_drops, std::uint64_t expiry_ms);
+std::string encode_attribute_update (const membership_change& change);
 void send_update (const std::string& service_ip, int op, const std::string& arch);
 
 #endif //HOSTMON_COMMS_H
@@ -0,0 +1,130 @@
+#include "digest.h"
+
+/**
+ * @brief FNV-1a over a string and a terminating separator, continuing from `hash`.
+ */
+static std::uint64_t fnv1a (std::uint64_t hash, const std::string &value) {
+    for (const unsigned char c: value) {
+        hash = (hash ^ c) * 0x100000001b3ULL;
+    }
+    return (hash ^ 0xff) * 0x100000001b3ULL;
+}
+
+/**
+ * @brief Spread the bits of an FNV hash so that XORs of many hashes stay well mixed.
+ */
+static std::uint64_t finalize (std::uint64_t hash) {
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+static constexpr std::uint64_t fnv_offset = 0xcbf29ce484222325ULL;
+
+/**
+ * @brief A string field of an entry, or empty when it is missing or not a string.
+ */
+static std::string string_field (const json &entry, const char *field) {
+    const auto it = entry.find (field);
+    return it != entry.end () && it->is_string () ? it->get<std::string> () : std::string ();
+}
+
+/**
+ * @brief Hash the parts of a table entry that describe the participant.
+ *
+ * Timestamps and anything else that differs between observers are left out,
+ * so every node that heard the same advertisement computes the same hash.
+ * Missing or mistyped fields hash as empty rather than throwing, since the
+ * hash is taken of whatever a peer sent.
+ */
+std::uint64_t membership_digest::descriptor_hash (const json &entry) {
+    std::uint64_t hash = fnv_offset;
+
+    hash = fnv1a (hash, string_field (entry, "id"));
+    hash = fnv1a (hash, string_field (entry, "address"));
+    hash = fnv1a (hash, string_field (entry, "architecture"));
+    hash = fnv1a (hash, entry.value ("active", false) ? "1" : "0");
+
+    if (entry.contains ("provides") && entry["provides"].is_array ()) {
+        for (const auto &service: entry["provides"]) {
+            if (service.is_string ()) {
+                hash = fnv1a (hash, service.get<std::string> ());
+            }
+        }
+    }
+
+    // folded in only when advertised, so entries without priorities hash as they always have
+    if (const auto it = entry.find ("priorities"); it != entry.end () && it->is_object ()) {
+        for (const auto &[service, priority]: it->items ()) {
+            if (priority.is_number_integer ()) {
+                hash = fnv1a (hash, service);
+                hash = fnv1a (hash, std::to_string (priority.get<int> ()));
+            }
+        }
+    }
+
+    // likewise, tagged so that a system without a release cannot hash as one without an operating system
+    for (const char *field: {"operating_system", "release"}) {
+        if (const auto it = entry.find (field); it != entry.end () && it->is_string ()) {
+            hash = fnv1a (hash, field);
+            hash = fnv1a (hash, it->get<std::string> ());
+        }
+    }
+
+    return finalize (hash);
+}
+
+std::size_t membership_digest::bucket_of (const std::string &id) {
+    return finalize (fnv1a (fnv_offset, id)) % bucket_count;
+}
+
+void membership_digest::toggle (const json &entry) {
+    toggle (string_field (entry, "id"), descriptor_hash (entry));
+}
+
+/**
+ * @brief Toggle a descriptor whose hash is already known.
+ */
+void membership_digest::toggle (const std::string &id, const std::uint64_t hash) {
+    hashes[bucket_of (id)] ^= hash;
+}
+
+/**
+ * @brief The digest of the whole table: the XOR of every bucket.
+ */
+std::uint64_t membership_digest::root () const {
+    std::uint64_t root = 0;
+    for (const auto hash: hashes) {
+        root ^= hash;
+    }
+    return root;
+}
+
+/**
+ * @brief The buckets in which a peer's digest disagrees with ours.
+ *
+ * @param remote The peer's buckets as a JSON array of bucket_count numbers.
+ * @return The indexes of the differing buckets; none if the array is malformed,
+ *         so a request that cannot name what it lacks is not answered with everything.
+ */
+std::vector<std::size_t> membership_digest::differing (const json &remote) const {
+    std::vector<std::size_t> result;
+    if (!remote.is_array () || remote.size () != bucket_count) {
+        return result;
+    }
+    for (const auto &bucket: remote) {
+        if (!bucket.is_number_unsigned ()) {
+            return result;
+        }
+    }
+
+    for (std::size_t i = 0; i < bucket_count; i++) {
+        if (remote[i].get<std::uint64_t> () != hashes[i]) {
+            result.push_back (i);
+        }
+    }
+
+    return result;
+}
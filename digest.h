@@ -0,0 +1,51 @@
+#ifndef HOSTMON_DIGEST_H
+#define HOSTMON_DIGEST_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * @class membership_digest
+ * @brief An incrementally maintained summary of a participant table.
+ *
+ * Every participant hashes its descriptor (id, address, architecture, active
+ * flag, services and their priorities, operating system and release) into one
+ * of a fixed number of buckets, chosen by its id;
+ * each bucket is the XOR of the hashes in it. Adding and removing a
+ * participant are the same O(1) operation, and two tables hold the same
+ * descriptors exactly when (barring collisions) their buckets match, so the
+ * root alone tells two nodes whether they agree and the buckets tell them
+ * which ids to exchange when they do not.
+ */
+class membership_digest {
+public:
+    static constexpr std::size_t bucket_count = 32;
+    using buckets = std::array<std::uint64_t, bucket_count>;
+
+private:
+    buckets hashes {};
+
+public:
+    static std::uint64_t descriptor_hash (const json &entry);
+    static std::size_t bucket_of (const std::string &id);
+
+    // add a descriptor to the digest, or remove one that was added before
+    void toggle (const json &entry);
+    void toggle (const std::string &id, std::uint64_t hash);
+
+    [[nodiscard]] std::uint64_t root () const;
+
+    [[nodiscard]] const buckets &get_buckets () const {
+        return hashes;
+    }
+
+    [[nodiscard]] std::vector<std::size_t> differing (const json &remote) const;
+};
+
+#endif //HOSTMON_DIGEST_H
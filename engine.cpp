@@ -0,0 +1,1798 @@
+#include "engine.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "comms.h"
+#include "utilities.h"
+
+/**
+ * @brief Read the low-latency receive profile from the "low_latency" object of config.json.
+ *
+ * Recognises "busy_poll_us", "spin_us" and "cpu"; the profile is enabled
+ * whenever the object is present.
+ */
+low_latency_settings low_latency_from_configuration (const json &settings) {
+    low_latency_settings result;
+    if (!settings.is_object ()) {
+        return result;
+    }
+
+    result.enabled = true;
+    result.busy_poll_us = settings.value ("busy_poll_us", result.busy_poll_us);
+    result.spin = std::chrono::microseconds (settings.value ("spin_us", result.spin.count ()));
+    result.cpu = settings.value ("cpu", result.cpu);
+
+    return result;
+}
+
+/**
+ * @brief Read the real-time sender settings from the "realtime_sender" object of config.json.
+ *
+ * Recognises "priority", "cpu" and "lock_memory"; the sender is real-time
+ * whenever the object is present.
+ */
+realtime_sender_settings realtime_sender_from_configuration (const json &settings) {
+    realtime_sender_settings result;
+    if (!settings.is_object ()) {
+        return result;
+    }
+
+    result.enabled = true;
+    result.priority = settings.value ("priority", result.priority);
+    result.cpu = settings.value ("cpu", result.cpu);
+    result.lock_memory = settings.value ("lock_memory", result.lock_memory);
+
+    return result;
+}
+
+/**
+ * @brief Check the "provides" entries of config.json: objects with a string "service" and, optionally, an integer "priority".
+ *
+ * @throws std::runtime_error Naming the first entry that is not.
+ */
+static json provides_from_configuration (const json &provides) {
+    if (!provides.is_array ()) {
+        throw std::runtime_error ("Bad provides: must be an array of services");
+    }
+
+    for (const auto &entry: provides) {
+        if (!entry.is_object () || !entry.contains ("service") || !entry["service"].is_string ()) {
+            throw std::runtime_error ("Bad provides: every entry needs a service name, not " + entry.dump ());
+        }
+        if (entry.contains ("priority") && !entry["priority"].is_number_integer ()) {
+            throw std::runtime_error ("Bad provides: the priority of " + entry["service"].get<std::string> ()
+                                      + " must be an integer");
+        }
+    }
+
+    return provides;
+}
+
+/**
+ * @brief Build engine options from a loaded config.json.
+ *
+ * Recognises "id" (the host name when absent), "provides", "group_ip",
+ * "group_port", "service_groups" (see service_groups_from_configuration()),
+ * "consumes", "notify_port", "query_socket" (/tmp/hostmon-<id>.sock when absent), "shm_name", "shm_capacity", "ingest"
+ * (see limits_from_configuration()), "history" (see history_from_configuration()),
+ * "partition" (see partition_from_configuration()), "journal" (see journal_from_configuration()), "warm_restart" (see
+ * warm_from_configuration()), "sync_port", "digest_every",
+ * "sync_cooldown_ms", "sync_answer_bytes", "sync_answer_rate", "solicit_responders", "solicit_window_ms",
+ * "expected_participants", "receive_absorb_ms", "receive_buffer_max",
+ * "overload_expiry_factor", "overload_hold_ms", "xdp" (see
+ * xdp_from_configuration()), "bridge" (see bridge_from_configuration(); tunnel
+ * peers are added to the ingest trusted sources), "aggregator" (see
+ * aggregator_from_configuration(); its site defaults to our id), "low_latency" (see low_latency_from_configuration();
+ * it also takes "heartbeat_us", "expiry_tick_us" and "expiry_ms", which default
+ * to 1000, 250 and 5 under the profile, and scales the default ingest budgets
+ * to the faster heartbeat), "realtime_sender" (see
+ * realtime_sender_from_configuration()) and "faults".
+ * The daemon prints transitions, so the result is verbose.
+ */
+engine_options options_from_configuration (const json &configuration) {
+    engine_options options;
+
+    options.id = configuration.contains ("id") ? configuration["id"].get<std::string> () : get_host_name ();
+    options.provides = provides_from_configuration (configuration.value ("provides", json::array ()));
+    options.group_ip = configuration.value ("group_ip", options.group_ip);
+    options.group_port = configuration.value ("group_port", options.group_port);
+    options.notify_port = configuration.value ("notify_port", options.notify_port);
+    options.service_groups = service_groups_from_configuration (configuration.value ("service_groups", json ()));
+    options.consumes = configuration.value ("consumes", std::vector<std::string> ());
+    options.query_socket = configuration.value ("query_socket", "/tmp/hostmon-" + options.id + ".sock");
+    options.shm_name = configuration.value ("shm_name", "");
+    options.shm_capacity = configuration.value ("shm_capacity", options.shm_capacity);
+    options.ingest = limits_from_configuration (configuration.value ("ingest", json ()));
+    options.history = history_from_configuration (configuration.value ("history", json ()));
+    options.partition = partition_from_configuration (configuration.value ("partition", json ()));
+    options.journal = journal_from_configuration (configuration.value ("journal", json ()));
+    options.warm_restart = warm_from_configuration (configuration.value ("warm_restart", json ()));
+    options.sync_port = configuration.value ("sync_port", options.sync_port);
+    options.digest_every = configuration.value ("digest_every", options.digest_every);
+    options.sync_cooldown = std::chrono::milliseconds (
+        configuration.value ("sync_cooldown_ms", options.sync_cooldown.count ()));
+    options.sync_answer_bytes = configuration.value ("sync_answer_bytes", options.sync_answer_bytes);
+    options.sync_answer_rate = configuration.value ("sync_answer_rate", options.sync_answer_rate);
+    options.solicit_responders = configuration.value ("solicit_responders", options.solicit_responders);
+    options.solicit_window = std::chrono::milliseconds (
+        configuration.value ("solicit_window_ms", options.solicit_window.count ()));
+    options.expected_participants = configuration.value ("expected_participants", options.expected_participants);
+    options.receive_absorb = std::chrono::milliseconds (
+        configuration.value ("receive_absorb_ms", options.receive_absorb.count ()));
+    options.receive_buffer_max = configuration.value ("receive_buffer_max", options.receive_buffer_max);
+    options.overload_expiry_factor = configuration.value ("overload_expiry_factor", options.overload_expiry_factor);
+    options.overload_hold = std::chrono::milliseconds (
+        configuration.value ("overload_hold_ms", options.overload_hold.count ()));
+    options.xdp = xdp_from_configuration (configuration.value ("xdp", json ()));
+    options.bridge = bridge_from_configuration (configuration.value ("bridge", json ()));
+    for (const auto &tunnel: options.bridge.tunnels) {
+        options.ingest.trusted_sources.push_back (tunnel.peer);
+    }
+    options.aggregator = aggregator_from_configuration (configuration.value ("aggregator", json ()));
+    if (options.aggregator.site.empty ()) {
+        options.aggregator.site = options.id;
+    }
+
+    options.realtime_sender = realtime_sender_from_configuration (configuration.value ("realtime_sender", json ()));
+    options.low_latency = low_latency_from_configuration (configuration.value ("low_latency", json ()));
+    if (options.low_latency.enabled) {
+        const auto &profile = configuration["low_latency"];
+        options.heartbeat = std::chrono::microseconds (profile.value ("heartbeat_us", 1000));
+        options.expiry_tick = std::chrono::microseconds (profile.value ("expiry_tick_us", 250));
+        options.expiry_ms = profile.value ("expiry_ms", std::uint64_t (5));
+
+        // the default ingest budgets assume the default heartbeat; keep the same headroom at the faster one
+        if (!configuration.contains ("ingest")) {
+            const double faster = 500000.0 / static_cast<double> (std::max<long> (options.heartbeat.count (), 1));
+            options.ingest.per_source_rate *= faster;
+            options.ingest.per_source_burst *= faster;
+            options.ingest.global_rate *= faster;
+            options.ingest.global_burst *= faster;
+        }
+    }
+
+    options.verbose = true;
+
+    if (configuration.contains ("faults")) {
+        options.faults = configuration["faults"];
+    }
+
+    return options;
+}
+
+/**
+ * @brief Build the options of every group in the "groups" array of config.json.
+ *
+ * Each entry is laid over the rest of the configuration, so groups share
+ * whatever they do not set themselves. The settings naming something only
+ * one group can own, "query_socket", "shm_name", "journal", "warm_restart",
+ * "aggregator" and "sync_port", are not shared: a group without its own goes without.
+ * Groups on the same port must differ in "group_ip"; each should have its
+ * own "notify_port" when its listener must tell the groups apart.
+ *
+ * @return One entry per group, empty when there is no "groups" array.
+ */
+std::vector<engine_options> group_options_from_configuration (const json &configuration) {
+    std::vector<engine_options> result;
+
+    if (!configuration.contains ("groups") || !configuration["groups"].is_array ()) {
+        return result;
+    }
+
+    json shared = configuration;
+    shared.erase ("groups");
+    for (const auto *owned: {"query_socket", "shm_name", "journal", "warm_restart", "aggregator"}) {
+        shared.erase (owned);
+    }
+    shared["query_socket"] = "";
+    shared["sync_port"] = 0;
+
+    for (const auto &group: configuration["groups"]) {
+        json merged = shared;
+        merged.merge_patch (group);
+        result.push_back (options_from_configuration (merged));
+    }
+
+    return result;
+}
+
+/**
+ * @brief Set up an engine; nothing is sent or received until start().
+ *
+ * @param options The group to join and how to take part in it.
+ * @throws std::runtime_error If the notification socket cannot be created.
+ */
+engine::engine (engine_options options)
+    : options (std::move (options)),
+      notifications (this->options.notify_udp
+                     ? with_faults (udp_transport::unicast ("127.0.0.1", this->options.notify_port), "127.0.0.1", this->options.faults)
+                     : nullptr),
+      table (get_timestamp,
+             [this] (const std::string &address, const int op, const std::string &architecture) {
+                 if (!notifications) {
+                     return;
+                 }
+
+                 const auto message = encode_update (address, op, architecture);
+                 if (this->options.verbose) {
+                     std::cout << message << std::endl;
+                 }
+                 if (notifications->send (message) < 0) {
+                     perror ("Sending update error");
+                 }
+             },
+             this->options.expiry_ms,
+             this->options.verbose),
+      limiter (this->options.ingest),
+      sync_answer_budget (this->options.sync_answer_rate, std::chrono::steady_clock::now ()) {
+    if (this->options.service_groups.enabled) {
+        this->options.solicit_responders = 0;
+        this->options.sync_port = 0;
+    }
+
+    table.set_history_limits (this->options.history);
+    table.set_partition_settings (this->options.partition);
+    table.set_partition_sink ([this] (const partition_event &event) {
+        if (!notifications) {
+            return;
+        }
+
+        const auto message = encode_partition_update (event);
+        if (this->options.verbose) {
+            std::cout << message << std::endl;
+        }
+        if (notifications->send (message) < 0) {
+            perror ("Sending update error");
+        }
+    });
+
+    // descriptor changes reach the update listener as attribute events, not as an offline and online
+    table.subscribe ([this] (const membership_change &change) {
+        if (change.kind != CHANGE_UPDATED || !notifications) {
+            return;
+        }
+
+        const auto message = encode_attribute_update (change);
+        if (this->options.verbose) {
+            std::cout << message << std::endl;
+        }
+        if (notifications->send (message) < 0) {
+            perror ("Sending update error");
+        }
+    });
+}
+
+engine::~engine () {
+    stop ();
+    wait ();
+}
+
+/**
+ * @brief Create an advertisement JSON object
+ *
+ * This function constructs a JSON object representing an advertisement. The advertisement contains
+ * information about the system, the services it provides, and other system configuration details.
+ *
+ * @return A JSON object representing the advertisement
+ */
+json engine::create_advertisement () const {
+
+    const auto sys_info = std::make_unique<system_info> ();
+    auto address = get_interface_address ();
+
+    json j = {};
+
+    // basic identification
+    j["id"] = options.id;
+    j["address"] = address;
+
+    // role information
+    j["active"] = true;
+
+    // advertise our services, and the priority of each that has one
+    j["provides"] = json::array ();
+
+    // entries are checked by provides_from_configuration(); options built in code may skip that
+    for (auto &element: options.provides.items ()) {
+        auto val = element.value ();
+        if (!val.is_object () || !val.contains ("service") || !val["service"].is_string ()) {
+            continue;
+        }
+        auto service = val["service"];
+        j["provides"].push_back (service);
+
+        if (val.contains ("priority") && val["priority"].is_number_integer ()) {
+            j["priorities"][service.get<std::string> ()] = val["priority"].get<int> ();
+        }
+    }
+
+    // participant information
+    j["operating_system"] = sys_info->sysname;
+    j["release"] = sys_info->release;
+    j["architecture"] = sys_info->machine;
+
+    return j;
+}
+
+/**
+ * @brief The engine's counters, as returned by the stats query.
+ */
+json engine::statistics () {
+    std::lock_guard lock (sync_mutex);
+    std::lock_guard solicit_lock (solicit_mutex);
+
+    return {
+        {"group", options.group_ip + ":" + std::to_string (options.group_port)},
+        {"version", table.get_version ()},
+        {"provisional", table.provisional_count ()},
+        {"ingest", limiter.statistics ()},
+        {"partition", table.partition_statistics ()},
+        {"link", table.link_statistics ()},
+        {"latency", {
+            {"low_latency", options.low_latency.enabled},
+            {"receive_wakeup", receive_wakeup.describe ()},
+            {"expiry_lateness", expiry_lateness.describe ()},
+            {"send_drift", send_drift.describe ()}
+        }},
+        {"receive", {
+            {"path", receiving_xdp ? "xdp" : "socket"},
+            {"buffer_bytes", receive_buffer.load ()},
+            {"kernel_drops", kernel_drops.load ()},
+            {"overloaded", overloaded.load ()},
+            {"overloads", overloads.load ()},
+            {"expiry_ms", table.get_expiry ()}
+        }},
+        {"journal_dropped", journal ? journal->get_dropped () : 0},
+        {"journal_failed", journal ? journal->has_failed () : false},
+        {"sync", {
+            {"digest", table.digest_root ()},
+            {"requests", sync_requests},
+            {"deferred", sync_deferred},
+            {"answers", sync_answers},
+            {"merged", sync_merged},
+            {"refused", sync_refused}
+        }},
+        {"solicit", {
+            {"answered", solicits_answered},
+            {"suppressed", solicits_suppressed}
+        }},
+        {"service_groups", {
+            {"send", send_groups},
+            {"receive", receive_groups},
+            {"foreign_dropped", foreign_dropped.load ()},
+            {"copies_dropped", group_copies.load ()}
+        }},
+        {"event_loop", loop ? loop->statistics () : json ()},
+        {"bridge", options.bridge.enabled () ? bridged->describe () : json ()},
+        {"aggregator", aggregator ? aggregator->statistics () : json ()}
+    };
+}
+
+/**
+ * @brief Start advertising, receiving and expiring, and the query server, shared table and journal if configured.
+ *
+ * @throws std::runtime_error If the sync port, query socket, shared memory segment or journal cannot be set up.
+ */
+void engine::start () {
+    {
+        std::lock_guard lock (state_mutex);
+        if (!threads.empty () || loop) {
+            return;
+        }
+        stopping = false;
+        receiver_settled = false;
+    }
+
+    prepare ();
+
+    if (sync_channel) {
+        threads.emplace_back (&engine::sync_loop, this);
+    }
+
+    if (aggregator_channel) {
+        threads.emplace_back (&engine::aggregate_loop, this);
+    }
+
+    threads.emplace_back (&engine::transmit_loop, this);
+    threads.emplace_back (&engine::receive_loop, this);
+    threads.emplace_back (&engine::expire_loop, this);
+
+    if (options.solicit_responders != 0) {
+        threads.emplace_back (&engine::respond_loop, this);
+    }
+
+    if (!options.warm_restart.path.empty ()) {
+        threads.emplace_back (&engine::persist_loop, this);
+    }
+}
+
+/**
+ * @brief Start as start() does, but on one worker of a shared event loop instead of threads of our own.
+ *
+ * Heartbeats, expiry ticks, overload checks, solicit answers and persisting
+ * are timers on the worker, and the group and sync sockets are read as they
+ * become readable, so apart from a query server this engine adds no
+ * threads. The real-time sender and the low-latency thread tuning apply only
+ * to threads of our own, so a hosted engine ignores them.
+ *
+ * Faults that delay or reorder datagrams are refused: fault_transport holds
+ * delayed incoming datagrams inside receive(), which on a shared worker would
+ * either block every other group or, released only when the socket is next
+ * readable, never be delivered. Loss and duplication work as usual.
+ *
+ * @throws std::runtime_error If a socket cannot be set up, as for start(), or the faults delay datagrams.
+ */
+void engine::start (event_loop &host) {
+    if (!options.faults.is_null () && fault_model (options.faults).delays ()) {
+        throw std::runtime_error ("Group " + options.group_ip + ": delay and reorder faults cannot run on an event loop");
+    }
+
+    {
+        std::lock_guard lock (state_mutex);
+        if (!threads.empty () || loop) {
+            return;
+        }
+        stopping = false;
+        detached = false;
+    }
+
+    loop = &host;
+    loop_worker = host.assign ();
+
+    prepare ();
+
+    group_sender = open_sender ();
+    group_receiver = open_receiver (0);
+    prepare_heartbeat ();
+
+    // everything below runs on the worker, so the sockets are read without blocking it
+    fcntl (receive_fd, F_SETFL, fcntl (receive_fd, F_GETFL) | O_NONBLOCK);
+    loop->watch (loop_worker, group_receiver->descriptor (), this, [this] {
+        drain (*group_receiver, 1024, false);
+    });
+
+    if (sync_channel) {
+        const int fd = sync_channel->descriptor ();
+        fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+        loop->watch (loop_worker, fd, this, [this] {
+            drain (*sync_channel, 65536, true);
+        });
+    }
+
+    if (aggregator_channel) {
+        const int fd = aggregator_channel->descriptor ();
+        fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+        loop->watch (loop_worker, fd, this, [this] {
+            std::vector<char> buffer (65536);
+            std::string source;
+            for (int i = 0; i < 64; i++) {
+                const ssize_t received = aggregator_channel->receive (buffer.data (), buffer.size (), source);
+                if (received < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        perror ("Receiving site summary error");
+                        loop->unwatch (loop_worker, aggregator_channel->descriptor ());
+                    }
+                    return;
+                }
+                aggregator->receive (buffer.data (), received, source, *aggregator_channel);
+            }
+        });
+    }
+
+    const auto now = std::chrono::steady_clock::now ();
+
+    if (options.solicit_responders != 0) {
+        loop->post (loop_worker, [this] {
+            std::uint64_t nonce;
+            {
+                std::lock_guard lock (solicit_mutex);
+                nonce = solicit_random ();
+            }
+            const json solicit = {{"type", "solicit"}, {"id", options.id}, {"nonce", nonce}};
+            if (group_sender->send (solicit.dump ()) < 0) {
+                perror ("Sending solicit error");
+            }
+        });
+    }
+
+    repeat (now, options.heartbeat, std::make_shared<periodic_step> ([this] (const auto due) {
+        if (send_heartbeat (*group_sender) < 0) {
+            perror ("Sending datagram message error");
+            return false;
+        }
+        send_drift.record (std::chrono::duration_cast<std::chrono::microseconds> (
+            std::chrono::steady_clock::now () - due));
+        return true;
+    }));
+
+    repeat (now + options.expiry_tick, options.expiry_tick, std::make_shared<periodic_step> ([this] (const auto due) {
+        expiry_lateness.record (std::chrono::duration_cast<std::chrono::microseconds> (
+            std::chrono::steady_clock::now () - due));
+        return expire_once ();
+    }));
+
+    repeat (now, std::chrono::milliseconds (100), std::make_shared<periodic_step> ([this] (const auto) {
+        check_receiver (*group_receiver);
+        return true;
+    }));
+
+    if (aggregator_channel) {
+        repeat (now, options.aggregator.interval, std::make_shared<periodic_step> ([this] (const auto) {
+            aggregator->summarize (*table.snapshot (), *aggregator_channel);
+            return true;
+        }));
+    }
+
+    if (!options.warm_restart.path.empty ()) {
+        auto saved_version = std::make_shared<std::uint64_t> (UINT64_MAX);
+        repeat (now + options.warm_restart.interval, options.warm_restart.interval,
+                std::make_shared<periodic_step> ([this, saved_version] (const auto) {
+                    persist (*saved_version);
+                    return true;
+                }));
+    }
+}
+
+/**
+ * @brief What start() and start(event_loop &) have in common: everything but the threads or timers.
+ *
+ * The warm restart file is loaded, the shared table, journal, sync and
+ * aggregator sockets and query server set up, and our advertisement built.
+ */
+void engine::prepare () {
+    send_groups = sending_groups (options.service_groups, options.provides, options.group_ip);
+    receive_groups = receiving_groups (options.service_groups, options.consumes, options.group_ip);
+
+    // restored before anything mirrors the table, so the shared table and journal start from the restored view
+    if (!options.warm_restart.path.empty ()) {
+        if (const auto saved = load_warm_snapshot (options.warm_restart.path, get_timestamp (),
+                                                   options.warm_restart.max_age)) {
+            const auto restored = table.restore (*saved);
+            if (options.verbose) {
+                std::cout << "Restored " << restored << " participants from " << options.warm_restart.path << std::endl;
+            }
+        }
+    }
+
+    if (!options.shm_name.empty ()) {
+        shared_table = std::make_unique<shm_publisher> (table, options.shm_name, options.shm_capacity);
+    }
+
+    if (!options.journal.directory.empty ()) {
+        journal = std::make_unique<journal_writer> (table, options.journal);
+    }
+
+    if (options.sync_port != 0 && options.digest_every != 0) {
+        sync_channel = with_faults (udp_transport::bound (options.sync_port), options.group_ip, options.faults);
+    }
+
+    if (options.aggregator.enabled ()) {
+        aggregator_channel = with_faults (udp_transport::bound (options.aggregator.port), options.group_ip,
+                                          options.faults);
+        aggregator = std::make_unique<site_aggregator> (options.aggregator);
+    }
+
+    if (!options.query_socket.empty ()) {
+        queries = std::make_unique<query_server> (table, options.query_socket, [this] { return statistics (); });
+        threads.emplace_back (&query_server::run, queries.get ());
+    }
+
+    advertisement = create_advertisement ();
+    // sets this run's heartbeats apart from the last one's, whose sequence numbers they repeat
+    advertisement["incarnation"] = get_timestamp ();
+    if (sync_channel) {
+        advertisement["sync_port"] = options.sync_port;
+    }
+
+    if (options.verbose) {
+        std::cout << "*****\n" << advertisement.dump (4) << "\n*****" << std::endl;
+    }
+}
+
+/**
+ * @brief Run `step` on our event loop worker at `due` and then every `period` for as long as it returns true.
+ *
+ * Like the threads' loops, runs missed while the worker was held up are
+ * skipped rather than made up back to back.
+ */
+void engine::repeat (const std::chrono::steady_clock::time_point due, const std::chrono::microseconds period,
+                     std::shared_ptr<periodic_step> step) {
+    loop->schedule (loop_worker, due, this, [this, due, period, step] {
+        if ((*step) (due)) {
+            repeat (std::max (due + period, std::chrono::steady_clock::now ()), period, step);
+        }
+    });
+}
+
+/**
+ * @brief Receive what is waiting on a hosted engine's group or sync socket.
+ *
+ * At most 64 datagrams are taken per call, so one busy group cannot keep
+ * the others on its worker waiting; the descriptor stays readable and the
+ * loop comes back for the rest.
+ */
+void engine::drain (transport &channel, const std::size_t size, const bool sync) {
+    std::vector<char> buffer (size);
+    std::string source;
+
+    for (int i = 0; i < 64; i++) {
+        const ssize_t received = channel.receive (buffer.data (), buffer.size () - 1, source);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror (sync ? "Receiving sync message error" : "Receiving datagram message error");
+                loop->unwatch (loop_worker, channel.descriptor ());
+            }
+            return;
+        }
+
+        if (sync) {
+            deliver_sync (buffer.data (), received, source);
+            continue;
+        }
+
+        if (const auto arrived = channel.last_arrival (); arrived != 0) {
+            const auto now = std::chrono::system_clock::now ().time_since_epoch ();
+            receive_wakeup.record (std::chrono::duration_cast<std::chrono::microseconds> (
+                now - std::chrono::nanoseconds (arrived)));
+        }
+        deliver (buffer.data (), received, source);
+    }
+}
+
+/**
+ * @brief Drop everything a hosted engine has registered on its worker. Runs on the worker.
+ */
+void engine::detach () {
+    loop->forget (loop_worker, this);
+
+    {
+        std::lock_guard lock (state_mutex);
+        detached = true;
+    }
+    state_changed.notify_all ();
+}
+
+/**
+ * @brief Ask every thread to finish. Returns at once; use wait() to join them.
+ */
+void engine::stop () {
+    {
+        std::lock_guard lock (state_mutex);
+        stopping = true;
+    }
+    state_changed.notify_all ();
+    solicit_changed.notify_all ();
+
+    if (loop) {
+        loop->post (loop_worker, [this] { detach (); });
+    }
+
+    if (queries) {
+        queries->stop ();
+    }
+}
+
+/**
+ * @brief Block until every thread has finished, either through stop() or an unrecoverable socket error.
+ *
+ * A hosted engine waits until its worker has dropped its timers and
+ * sockets, which happens only after stop(). The view is persisted one last
+ * time so a clean restart is fully up to date.
+ */
+void engine::wait () {
+    if (loop) {
+        std::unique_lock lock (state_mutex);
+        state_changed.wait (lock, [this] { return detached; });
+    }
+
+    for (auto &t: threads) {
+        if (t.joinable ()) {
+            t.join ();
+        }
+    }
+
+    if ((!threads.empty () || loop) && !options.warm_restart.path.empty ()) {
+        std::uint64_t saved_version = UINT64_MAX;
+        persist (saved_version);
+    }
+
+    loop = nullptr;
+    group_sender.reset ();
+    group_receiver.reset ();
+    threads.clear ();
+    sync_channel.reset ();
+    aggregator_channel.reset ();
+    queries.reset ();
+    shared_table.reset ();
+    journal.reset ();
+}
+
+/**
+ * @brief Sleep for up to `timeout`, waking early when stop() is called.
+ *
+ * @return true when the engine is stopping.
+ */
+bool engine::wait_for_stop (const std::chrono::microseconds timeout) {
+    std::unique_lock lock (state_mutex);
+    return state_changed.wait_for (lock, timeout, [this] { return stopping; });
+}
+
+/**
+ * @brief Let a transmitter waiting in wait_for_receiver() go on.
+ */
+void engine::settle_receiver () {
+    {
+        std::lock_guard lock (state_mutex);
+        receiver_settled = true;
+    }
+    state_changed.notify_all ();
+}
+
+/**
+ * @brief Wait until receive_loop has joined the group (or failed to), or stop() is called.
+ *
+ * @return true if the engine is stopping.
+ */
+bool engine::wait_for_receiver () {
+    std::unique_lock lock (state_mutex);
+    state_changed.wait (lock, [this] { return receiver_settled || stopping; });
+    return stopping;
+}
+
+/**
+ * @brief Wait until the deadline or until stop() is called.
+ *
+ * @return true if the engine is stopping.
+ */
+bool engine::wait_until_stop (const std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock lock (state_mutex);
+    return state_changed.wait_until (lock, deadline, [this] { return stopping; });
+}
+
+/**
+ * @brief Apply the low-latency profile to the calling thread.
+ *
+ * The default 50 µs timer slack would stretch sub-millisecond sleeps, so it
+ * is cut to the minimum; the receiving thread is also pinned when a CPU is set.
+ */
+void engine::tune_thread (const bool receiving) const {
+    if (!options.low_latency.enabled) {
+        return;
+    }
+
+    prctl (PR_SET_TIMERSLACK, 1, 0, 0, 0);
+
+    if (receiving && options.low_latency.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO (&cpus);
+        CPU_SET (options.low_latency.cpu, &cpus);
+        if (const int error = pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus); error != 0) {
+            std::cerr << "Cannot pin the receive thread to CPU " << options.low_latency.cpu << ": "
+                      << strerror (error) << "\n";
+        }
+    }
+}
+
+/**
+ * @brief Transmits our advertisement to the multicast group.
+ *
+ * This function creates a multicast transport and sends the advertisement to the
+ * group every heartbeat interval (500 milliseconds by default) until the engine
+ * is stopped. The startup solicit waits until the receive thread has joined
+ * the group, since answers can come back within milliseconds. Each heartbeat carries a sequence number, counting from 0, from
+ * which receivers measure loss, reordering and jitter. Every digest_every-th
+ * advertisement also carries the digest of our table. When fault settings are
+ * given the datagrams go through a fault_transport.
+ *
+ * With a realtime_sender the thread runs SCHED_FIFO, optionally pinned and
+ * with its memory locked, sleeps to absolute deadlines and takes the digest
+ * the expiry thread last cached rather than walking the table itself. Either
+ * way send_drift records how late each heartbeat left.
+ */
+void engine::transmit_loop () {
+    tune_thread (false);
+    if (options.realtime_sender.enabled) {
+        make_realtime ();
+    }
+
+    try {
+        const auto channel = open_sender ();
+
+        if (options.solicit_responders != 0) {
+            if (wait_for_receiver ()) {
+                return;
+            }
+
+            std::uint64_t nonce;
+            {
+                std::lock_guard lock (solicit_mutex);
+                nonce = solicit_random ();
+            }
+            const json solicit = {{"type", "solicit"}, {"id", options.id}, {"nonce", nonce}};
+            if (channel->send (solicit.dump ()) < 0) {
+                perror ("Sending solicit error");
+            }
+        }
+
+        prepare_heartbeat ();
+
+        if (options.realtime_sender.enabled && options.realtime_sender.lock_memory
+            && mlockall (MCL_CURRENT) < 0) {
+            perror ("Locking memory for the heartbeat sender error");
+        }
+
+        auto due = std::chrono::steady_clock::now ();
+
+        do {
+            if (send_heartbeat (*channel) < 0) {
+                perror ("Sending datagram message error");
+                break;
+            }
+
+            const auto now = std::chrono::steady_clock::now ();
+            send_drift.record (std::chrono::duration_cast<std::chrono::microseconds> (now - due));
+
+            // a beat missed while the host was stalled is skipped rather than sent late back to back
+            due = std::max (due + options.heartbeat, now);
+        } while (!sleep_until (due));
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what () << "\n";
+    }
+}
+
+/**
+ * @brief Open the transport our heartbeats and solicit answers go out on, to the first of send_groups.
+ *
+ * @throws std::runtime_error If the socket cannot be created or joined.
+ */
+std::unique_ptr<transport> engine::open_sender () const {
+    return with_faults (udp_transport::multicast (send_groups.front ().c_str (), options.group_port, false),
+                        options.group_ip, options.faults);
+}
+
+/**
+ * @brief Build the heartbeat buffers from our advertisement.
+ *
+ * Each heartbeat is the advertisement with "seq" (and sometimes "digest")
+ * spliced in before its closing brace, into a buffer sized once here, so
+ * sending one never allocates.
+ */
+void engine::prepare_heartbeat () {
+    heartbeat_prefix = advertisement.dump ();
+    heartbeat_prefix.pop_back ();
+    heartbeat_frame.reserve (heartbeat_prefix.size () + 64);
+    heartbeat_sequence = 0;
+}
+
+/**
+ * @brief Send the next heartbeat, with our digest every digest_every-th one, to each of send_groups.
+ *
+ * @return What the transport's send() returned, or the first failure sending to another group.
+ */
+ssize_t engine::send_heartbeat (transport &channel) {
+    const auto append_number = [this] (const std::uint64_t value) {
+        char digits[24];
+        const auto [end, error] = std::to_chars (std::begin (digits), std::end (digits), value);
+        heartbeat_frame.append (digits, end);
+    };
+
+    const bool with_digest = sync_channel && !filters_services () && heartbeat_sequence % options.digest_every == 0;
+
+    heartbeat_frame.assign (heartbeat_prefix);
+    heartbeat_frame.append (",\"seq\":");
+    append_number (heartbeat_sequence++);
+    if (with_digest) {
+        heartbeat_frame.append (",\"digest\":");
+        append_number (options.realtime_sender.enabled ? digest_cache.load () : table.digest_root ());
+    }
+    heartbeat_frame.push_back ('}');
+
+    ssize_t sent = channel.send (heartbeat_frame);
+    for (std::size_t i = 1; sent >= 0 && i < send_groups.size (); i++) {
+        sent = channel.send_to (heartbeat_frame, send_groups[i], options.group_port);
+    }
+    return sent;
+}
+
+/**
+ * @brief Put the calling thread under SCHED_FIFO and, when asked, on its own CPU.
+ *
+ * Either can fail for want of CAP_SYS_NICE or a valid CPU; the sender then
+ * carries on as an ordinary thread and says so.
+ */
+void engine::make_realtime () const {
+    const auto &settings = options.realtime_sender;
+
+    sched_param parameters = {};
+    parameters.sched_priority = settings.priority;
+    if (const int error = pthread_setschedparam (pthread_self (), SCHED_FIFO, &parameters); error != 0) {
+        std::cerr << "Cannot make the heartbeat sender SCHED_FIFO: " << strerror (error) << "\n";
+    }
+
+    if (settings.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO (&cpus);
+        CPU_SET (settings.cpu, &cpus);
+        if (const int error = pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus); error != 0) {
+            std::cerr << "Cannot pin the heartbeat sender to CPU " << settings.cpu << ": " << strerror (error) << "\n";
+        }
+    }
+}
+
+/**
+ * @brief Sleep until an absolute deadline, then report whether the engine is stopping.
+ *
+ * The real-time sender sleeps in clock_nanosleep(), which a stop() does not
+ * interrupt, so stopping can take up to one heartbeat; otherwise this is
+ * wait_until_stop().
+ */
+bool engine::sleep_until (const std::chrono::steady_clock::time_point deadline) {
+    if (!options.realtime_sender.enabled) {
+        return wait_until_stop (deadline);
+    }
+
+    // steady_clock is CLOCK_MONOTONIC
+    const auto since_boot = std::chrono::duration_cast<std::chrono::nanoseconds> (deadline.time_since_epoch ());
+    const timespec wake = {
+        static_cast<time_t> (since_boot.count () / 1000000000),
+        static_cast<long> (since_boot.count () % 1000000000)
+    };
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, nullptr) == EINTR) {
+    }
+
+    std::lock_guard lock (state_mutex);
+    return stopping;
+}
+
+/**
+ * @brief Our advertisement with the current digest of our table.
+ */
+json engine::advertisement_with_digest () {
+    auto message = advertisement;
+    message["digest"] = table.digest_root ();
+    return message;
+}
+
+/**
+ * @brief How long to wait before answering a solicit.
+ *
+ * Drawn uniformly from a window that grows with the number of peers we know,
+ * reaching solicit_window at a thousand, so the first few answers go out
+ * quickly whatever the cluster size and the rest see them in time to stay quiet.
+ */
+std::chrono::microseconds engine::response_backoff () {
+    using std::chrono::microseconds;
+
+    const auto longest = std::chrono::duration_cast<microseconds> (options.solicit_window);
+    const auto window = std::clamp (microseconds (longest.count () * static_cast<long> (table.size ()) / 1000),
+                                    std::min (microseconds (5000), longest), longest);
+
+    std::uniform_int_distribution<long> delay (0, window.count ());
+    return microseconds (delay (solicit_random));
+}
+
+/**
+ * @brief Schedule an answer to a peer's solicit. Called with solicit_mutex unlocked.
+ */
+void engine::on_solicit (const json &solicit) {
+    if (options.solicit_responders == 0 || solicit.value ("id", "") == options.id) {
+        return;
+    }
+
+    const auto it = solicit.find ("nonce");
+    if (it == solicit.end () || !it->is_number_unsigned ()) {
+        return;
+    }
+
+    const auto nonce = it->get<std::uint64_t> ();
+    std::chrono::steady_clock::time_point due;
+    {
+        std::lock_guard lock (solicit_mutex);
+        if (pending_responses.contains (nonce)) {
+            return;
+        }
+        due = std::chrono::steady_clock::now () + response_backoff ();
+        pending_responses[nonce] = {due};
+    }
+
+    if (!loop) {
+        solicit_changed.notify_one ();
+        return;
+    }
+
+    loop->schedule (loop_worker, due, this, [this] {
+        std::unique_lock lock (solicit_mutex);
+        answer_solicits (*group_sender, lock);
+    });
+}
+
+/**
+ * @brief Count another peer's answer to a solicit we are waiting to answer.
+ */
+void engine::on_solicit_response (const std::uint64_t nonce) {
+    std::lock_guard lock (solicit_mutex);
+    if (const auto it = pending_responses.find (nonce); it != pending_responses.end ()) {
+        it->second.answered++;
+    }
+}
+
+/**
+ * @brief Answers solicits as their backoff expires, unless enough others already have.
+ *
+ * An answer is our advertisement, carrying our digest and the solicit's nonce.
+ * The new node learns us from it and, through the digest, syncs the rest of
+ * our view over unicast, so a few answers are enough for the whole view.
+ */
+void engine::respond_loop () {
+    try {
+        const auto channel = open_sender ();
+
+        std::unique_lock lock (solicit_mutex);
+
+        while (true) {
+            {
+                std::lock_guard state (state_mutex);
+                if (stopping) {
+                    break;
+                }
+            }
+
+            // wake at least every 100ms to notice stop()
+            auto wake = std::chrono::steady_clock::now () + std::chrono::milliseconds (100);
+            for (const auto &[nonce, pending]: pending_responses) {
+                wake = std::min (wake, pending.due);
+            }
+            solicit_changed.wait_until (lock, wake);
+
+            answer_solicits (*channel, lock);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what () << "\n";
+    }
+}
+
+/**
+ * @brief Answer, or count as suppressed, every solicit whose backoff has expired.
+ *
+ * @param lock Holds solicit_mutex; released while each answer is sent.
+ * @return When the next pending answer is due, or time_point::max() when none is.
+ */
+std::chrono::steady_clock::time_point engine::answer_solicits (transport &channel, std::unique_lock<std::mutex> &lock) {
+    const auto now = std::chrono::steady_clock::now ();
+    auto next = std::chrono::steady_clock::time_point::max ();
+
+    for (auto it = pending_responses.begin (); it != pending_responses.end ();) {
+        if (it->second.due > now) {
+            next = std::min (next, it->second.due);
+            ++it;
+            continue;
+        }
+
+        if (it->second.answered >= options.solicit_responders) {
+            solicits_suppressed++;
+        } else {
+            auto response = sync_channel && !filters_services () ? advertisement_with_digest () : advertisement;
+            response["solicit"] = it->first;
+
+            lock.unlock ();
+            if (channel.send (response.dump ()) < 0) {
+                perror ("Sending solicit response error");
+            }
+            lock.lock ();
+            solicits_answered++;
+        }
+
+        it = pending_responses.erase (it);
+    }
+
+    return next;
+}
+
+/**
+ * @brief Receives and processes multicast datagrams.
+ *
+ * This function creates a multicast transport bound to the group's port, and then
+ * continuously receives advertisements and reports them to the participant table.
+ * Datagrams over their sender's or the global ingest budget are dropped before
+ * they are parsed. With AF_XDP configured the group arrives through an
+ * xdp_transport in front of the socket, falling back to the socket alone when
+ * AF_XDP cannot be set up. Receives time out shortly so that stop() is
+ * noticed promptly, and every 100ms the loop checks for kernel drops and
+ * whether the receive buffer should grow with the cluster.
+ */
+void engine::receive_loop () {
+    try {
+        tune_thread (true);
+
+        std::unique_ptr<transport> channel;
+        try {
+            channel = open_receiver (100);
+        } catch (...) {
+            settle_receiver ();
+            throw;
+        }
+        settle_receiver ();
+
+        char buffer[1024];
+        std::string source;
+        auto next_check = std::chrono::steady_clock::now ();
+
+        while (true) {
+            {
+                std::lock_guard lock (state_mutex);
+                if (stopping) {
+                    break;
+                }
+            }
+
+            if (const auto now = std::chrono::steady_clock::now (); now >= next_check) {
+                check_receiver (*channel);
+                next_check = now + std::chrono::milliseconds (100);
+            }
+
+            const ssize_t received = channel->receive (buffer, sizeof (buffer) - 1, source);
+            if (received < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    continue;
+                }
+                perror ("Receiving datagram message error");
+                break;
+            }
+
+            if (const auto arrived = channel->last_arrival (); arrived != 0) {
+                const auto now = std::chrono::system_clock::now ().time_since_epoch ();
+                receive_wakeup.record (std::chrono::duration_cast<std::chrono::microseconds> (
+                    now - std::chrono::nanoseconds (arrived)));
+            }
+
+            deliver (buffer, received, source);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what () << "\n";
+    }
+}
+
+/**
+ * @brief Open the group's receive path: the socket, sized and instrumented, behind AF_XDP and faults if configured.
+ *
+ * @param timeout_ms How long a receive() through AF_XDP waits; the socket's own timeout is left to the caller.
+ * @throws std::runtime_error If the socket cannot be created, joined or bound.
+ */
+std::unique_ptr<transport> engine::open_receiver (const int timeout_ms) {
+    auto socket = udp_transport::multicast (receive_groups.front ().c_str (), options.group_port, true);
+    for (std::size_t i = 1; i < receive_groups.size (); i++) {
+        if (!socket->join (receive_groups[i].c_str ())) {
+            perror (("Joining " + receive_groups[i] + " error").c_str ());
+        }
+    }
+
+    timeval tv = {0, 100000};
+    setsockopt (socket->descriptor (), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    if (!socket->count_drops ()) {
+        perror ("Enabling SO_RXQ_OVFL error");
+    }
+    if (!socket->timestamp_arrivals ()) {
+        perror ("Enabling SO_TIMESTAMPNS error");
+    }
+
+    if (options.low_latency.enabled) {
+        if (!socket->busy_poll (options.low_latency.busy_poll_us)) {
+            perror ("Enabling SO_BUSY_POLL error");
+        }
+        // spinning only pays on a core of its own; shared, it starves the threads it waits for
+        if (options.low_latency.cpu >= 0 && !loop) {
+            socket->set_spin (options.low_latency.spin);
+        }
+    }
+
+    receive_fd = socket->descriptor ();
+    sized_for = std::max (options.expected_participants, table.size ());
+    size_receive_buffer (receive_fd, sized_for);
+
+    auto fast = with_xdp (std::move (socket), options.xdp, options.group_port, timeout_ms);
+    receiving_xdp = dynamic_cast<xdp_transport *> (fast.get ()) != nullptr;
+
+    auto bridged_domains = with_bridge (std::move (fast), options.bridge, options.group_ip, options.group_port,
+                                        options.id, timeout_ms, bridged);
+
+    return with_faults (std::move (bridged_domains), options.group_ip, options.faults);
+}
+
+/**
+ * @brief Check for kernel drops, and grow, never shrink, the receive buffer as the cluster grows past what it was sized for.
+ */
+void engine::check_receiver (const transport &channel) {
+    check_overload (channel);
+
+    if (const auto size = table.size (); size > sized_for + sized_for / 4) {
+        sized_for = size;
+        size_receive_buffer (receive_fd, sized_for);
+    }
+}
+
+/**
+ * @brief Whether we keep only the providers of the services we consume.
+ *
+ * Such a table differs from every peer's by design, so its digest is neither
+ * advertised nor compared, and synced entries are filtered as heartbeats are.
+ */
+bool engine::filters_services () const {
+    return options.service_groups.enabled && !options.consumes.empty ();
+}
+
+/**
+ * @brief Handle one datagram received on the group: a solicit, or an advertisement for the table.
+ *
+ * Datagrams over their sender's or the global ingest budget are dropped before they are parsed,
+ * except that a relay's are charged to their origin after (see ingest_limiter).
+ * With service groups, advertisements that reached us only because their
+ * services hash to a group we share are dropped after, and so are the
+ * further copies of a heartbeat sent to several groups we joined (see
+ * first_group_copy()). Anything that parses
+ * but is not a descriptor (see is_descriptor()) is logged and skipped before
+ * its solicit nonce or digest is looked at.
+ *
+ * @param buffer The datagram, with room for a terminating NUL after `length` bytes.
+ */
+void engine::deliver (char *buffer, const ssize_t length, const std::string &source) {
+    if (!limiter.admit (source)) {
+        return;
+    }
+
+    buffer[length] = '\0';
+
+    try {
+        const auto message = json::parse (buffer);
+
+        if (message.is_object () && !limiter.admit_origin (source, message.value ("id", ""))) {
+            return;
+        }
+
+        if (message.value ("type", "") == "solicit") {
+            on_solicit (message);
+            return;
+        }
+
+        if (filters_services () && message.value ("id", "") != options.id && !provides_any (message, options.consumes)) {
+            foreign_dropped++;
+            return;
+        }
+
+        if (receive_groups.size () > 1 && !first_group_copy (message)) {
+            group_copies++;
+            return;
+        }
+
+        if (table.report_participant (message) == PARTICIPANT_IGNORED) {
+            std::cerr << "Ignoring bad advertisement from " << source << ": not a descriptor\n";
+            return;
+        }
+
+        if (message.contains ("solicit")) {
+            on_solicit_response (message["solicit"].get<std::uint64_t> ());
+        }
+        if (message.contains ("digest")) {
+            compare_digest (message, source);
+        }
+    } catch (const json::exception &e) {
+        std::cerr << "Ignoring bad advertisement from " << source << ": " << e.what () << "\n";
+    }
+}
+
+/**
+ * @brief Remember a heartbeat by its sender and sequence number, unless it is already remembered.
+ *
+ * A provider of several services sends each heartbeat, with the same
+ * sequence number, to the group of each; a consumer in more than one of
+ * those groups would count every copy after the first as a duplicate or a
+ * reordering of it. Heartbeats are remembered for two intervals, which
+ * covers copies sent back to back, and at most group_copy_entries at once.
+ *
+ * @return false for a copy of a heartbeat already received; true as well for advertisements without a sequence.
+ */
+bool engine::first_group_copy (const json &message) {
+    const auto id = message.find ("id");
+    const auto seq = message.find ("seq");
+    if (id == message.end () || !id->is_string () || seq == message.end () || !seq->is_number_unsigned ()) {
+        return true;
+    }
+
+    const auto now = std::chrono::steady_clock::now ();
+    const auto window = std::max<std::chrono::steady_clock::duration> (2 * options.heartbeat,
+                                                                      std::chrono::milliseconds (100));
+
+    while (!group_copies_order.empty ()
+           && (now - group_copies_order.front ().first > window || group_copies_seen.size () > group_copy_entries)) {
+        group_copies_seen.erase (group_copies_order.front ().second);
+        group_copies_order.pop_front ();
+    }
+
+    auto key = id->get<std::string> () + "/" + std::to_string (seq->get<std::uint64_t> ());
+    if (!group_copies_seen.try_emplace (key, now).second) {
+        return false;
+    }
+    group_copies_order.emplace_back (now, std::move (key));
+    return true;
+}
+
+/**
+ * @brief Size the receive socket's buffer for the heartbeats of `participants` peers.
+ *
+ * The buffer should hold receive_absorb worth of the whole cluster's
+ * heartbeats, at about 2 KB of buffer per datagram once the kernel's own
+ * overhead is counted. Past net.core.rmem_max only SO_RCVBUFFORCE, which
+ * needs CAP_NET_ADMIN, can grow it; without that the buffer stays at the
+ * limit and check_overload() catches what it cannot absorb.
+ */
+void engine::size_receive_buffer (const int fd, const std::size_t participants) {
+    constexpr double bytes_per_datagram = 2048;
+    constexpr int least = 256 * 1024;
+
+    const double per_second = static_cast<double> (participants) * 1e6
+                              / static_cast<double> (std::max<long> (options.heartbeat.count (), 1));
+    const double wanted = per_second * bytes_per_datagram * static_cast<double> (options.receive_absorb.count ()) / 1000.0;
+    const int size = static_cast<int> (std::clamp (wanted, static_cast<double> (least),
+                                                   static_cast<double> (std::max<std::size_t> (options.receive_buffer_max, least))));
+
+    int actual = 0;
+    socklen_t length = sizeof (actual);
+
+    setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+    // the kernel reports double what was asked for, the rest being its bookkeeping
+    if (getsockopt (fd, SOL_SOCKET, SO_RCVBUF, &actual, &length) == 0 && actual / 2 < size) {
+        setsockopt (fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof (size));
+        getsockopt (fd, SOL_SOCKET, SO_RCVBUF, &actual, &length);
+    }
+
+    receive_buffer = actual;
+}
+
+/**
+ * @brief Widen expiry while the kernel is dropping our datagrams, and restore it once it stops.
+ *
+ * Entering and leaving overload are each reported on stderr and to the
+ * update listener, so an operator sees local overload as what it is.
+ */
+void engine::check_overload (const transport &channel) {
+    const auto now = std::chrono::steady_clock::now ();
+    const auto drops = channel.kernel_drops ();
+
+    if (drops > kernel_drops) {
+        const auto new_drops = drops - kernel_drops;
+        kernel_drops = drops;
+        overload_until = now + options.overload_hold;
+
+        if (overloaded) {
+            return;
+        }
+
+        overloaded = true;
+        overloads++;
+
+        const auto widened = static_cast<std::uint64_t> (static_cast<double> (options.expiry_ms)
+                                                         * std::max (options.overload_expiry_factor, 1.0));
+        table.set_expiry (widened);
+
+        std::cerr << "Receive overload: the kernel dropped " << new_drops << " datagrams, expiry widened to "
+                  << widened << " ms\n";
+        send_overload_update (true, drops, widened);
+        return;
+    }
+
+    if (overloaded && now >= overload_until) {
+        overloaded = false;
+        table.set_expiry (options.expiry_ms);
+
+        std::cerr << "Receive overload over, expiry back to " << options.expiry_ms << " ms\n";
+        send_overload_update (false, drops, options.expiry_ms);
+    }
+}
+
+/**
+ * @brief Tell the update listener that receive overload began or ended.
+ */
+void engine::send_overload_update (const bool overload, const std::uint64_t drops, const std::uint64_t expiry) {
+    if (!notifications) {
+        return;
+    }
+
+    const auto message = encode_overload_update (overload, drops, expiry);
+    if (options.verbose) {
+        std::cout << message << std::endl;
+    }
+    if (notifications->send (message) < 0) {
+        perror ("Sending update error");
+    }
+}
+
+/**
+ * @brief Periodically remove participants that have gone quiet.
+ *
+ * Ticks run against fixed deadlines rather than sleeping a tick after each
+ * pass, and how late each one wakes is recorded in expiry_lateness.
+ */
+void engine::expire_loop () {
+    tune_thread (false);
+
+    auto due = std::chrono::steady_clock::now () + options.expiry_tick;
+
+    while (!wait_until_stop (due)) {
+        const auto now = std::chrono::steady_clock::now ();
+        expiry_lateness.record (std::chrono::duration_cast<std::chrono::microseconds> (now - due));
+
+        if (!expire_once ()) {
+            break;
+        }
+
+        // ticks missed while we were held up are skipped rather than run back to back
+        due = std::max (due + options.expiry_tick, now);
+    }
+}
+
+/**
+ * @brief One expiry tick.
+ *
+ * @return false when the table could not be expired and ticking should stop.
+ */
+bool engine::expire_once () {
+    if (table.expire_participants () != 0) {
+        return false;
+    }
+    if (options.realtime_sender.enabled) {
+        digest_cache = table.digest_root ();
+    }
+
+    return true;
+}
+
+/**
+ * @brief Save the view for a warm restart, or only refresh the file's age if the view has not changed.
+ *
+ * @param saved_version The version last saved, updated when the view is written.
+ */
+void engine::persist (std::uint64_t &saved_version) {
+    const auto snapshot = table.snapshot ();
+    const auto now = get_timestamp ();
+
+    try {
+        if (snapshot->version == saved_version && touch_warm_snapshot (options.warm_restart.path, now)) {
+            return;
+        }
+
+        save_warm_snapshot (options.warm_restart.path, *snapshot, now);
+        saved_version = snapshot->version;
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what () << "\n";
+    }
+}
+
+/**
+ * @brief Periodically persist the view for a warm restart.
+ */
+void engine::persist_loop () {
+    std::uint64_t saved_version = UINT64_MAX;
+
+    while (!wait_for_stop (options.warm_restart.interval)) {
+        persist (saved_version);
+    }
+}
+
+/**
+ * @brief Ask a peer to sync if the digest in its advertisement differs from ours.
+ *
+ * Rate limited by request_sync(), so a view that takes a while to converge
+ * (or never can, such as across an asymmetric link) costs one exchange per
+ * cooldown rather than one per advertisement.
+ *
+ * @param advertisement An advertisement the table accepted, so its id is a string.
+ */
+void engine::compare_digest (const json &advertisement, const std::string &source) {
+    const auto peer = advertisement.at ("id").get<std::string> ();
+    const unsigned short port = advertisement.value ("sync_port", 0);
+
+    if (!sync_channel || port == 0 || peer == options.id || filters_services ()) {
+        return;
+    }
+
+    const auto digest = advertisement.find ("digest");
+    if (digest == advertisement.end () || !digest->is_number_unsigned ()
+        || digest->get<std::uint64_t> () == table.digest_root ()) {
+        return;
+    }
+
+    request_sync (peer, source, port);
+}
+
+/**
+ * @brief Send our digest buckets to a peer, unless we asked anyone within the cooldown.
+ *
+ * During churn, or when we join a large cluster, nearly every peer's digest
+ * differs from ours; asking each would have them all answer at once. So at
+ * most one request is outstanding per cooldown, which is stretched by a
+ * random half either way so that the peer asked is whichever differing one
+ * is heard from first, not the same one each time. Any one peer is still
+ * asked at most once per cooldown. Replies from the peer asked are expected
+ * for one cooldown and are charged to the global ingest budget only.
+ */
+void engine::request_sync (const std::string &peer, const std::string &address, const unsigned short port) {
+    const json request = {
+        {"type", "digest_request"},
+        {"id", options.id},
+        {"sync_port", options.sync_port},
+        {"buckets", table.digest_buckets ()}
+    };
+
+    std::lock_guard lock (sync_mutex);
+
+    const auto now = std::chrono::steady_clock::now ();
+    if (const auto it = last_sync.find (peer); it != last_sync.end () && now - it->second < options.sync_cooldown) {
+        return;
+    }
+    if (now < next_sync) {
+        sync_deferred++;
+        return;
+    }
+
+    std::uniform_real_distribution<double> stretch (0.5, 1.5);
+    next_sync = now + std::chrono::duration_cast<std::chrono::steady_clock::duration> (
+                    options.sync_cooldown * stretch (sync_random));
+    last_sync[peer] = now;
+
+    std::erase_if (awaiting_sync, [&] (const auto &entry) { return entry.second <= now; });
+    awaiting_sync[address] = now + options.sync_cooldown;
+
+    if (sync_channel->send_to (request.dump (), address, port) < 0) {
+        perror ("Sending digest request error");
+        return;
+    }
+    sync_requests++;
+}
+
+/**
+ * @brief Send a peer our entries in every bucket where its digest differs from ours.
+ *
+ * Entries are split across datagrams of about a thousand bytes so a large
+ * difference is not lost to fragmentation; they go out back to back, since
+ * the peer asked for them and charges them to its global budget alone. If
+ * the peer's view differs from ours it probably has something we lack too,
+ * so we ask it in turn, if request_sync() allows and we keep a full table.
+ *
+ * The answer is much larger than the request and goes to whatever address
+ * and port it names, so only a member at the address it advertises, or a
+ * peer we asked ourselves, is answered; a request without a valid bucket
+ * vector is refused; and what is sent is capped at sync_answer_bytes per
+ * request and sync_answer_rate per second, whatever is left over waiting
+ * for the next request.
+ */
+void engine::answer_sync (const json &request, const std::string &source) {
+    const unsigned short port = request.value ("sync_port", 0);
+    const auto id = request.find ("id");
+    if (port == 0 || id == request.end () || !id->is_string ()) {
+        return;
+    }
+    const auto peer = id->get<std::string> ();
+
+    bool asked;
+    {
+        std::lock_guard lock (sync_mutex);
+        const auto it = awaiting_sync.find (source);
+        asked = it != awaiting_sync.end () && std::chrono::steady_clock::now () < it->second;
+    }
+
+    const auto buckets = table.differing_buckets (request.value ("buckets", json ()));
+    if (buckets.empty () || (!asked && !table.member_at (peer, source))) {
+        if (!buckets.empty ()) {
+            std::lock_guard lock (sync_mutex);
+            sync_refused++;
+        }
+        return;
+    }
+
+    constexpr std::size_t datagram_budget = 1024;
+
+    const json header = {{"type", "digest_sync"}, {"id", options.id}};
+    json response = header;
+    response["entries"] = json::array ();
+    std::size_t size = 0;
+    std::size_t sent = 0;
+
+    // false once the global byte budget is spent
+    const auto send_response = [&] {
+        const auto datagram = response.dump ();
+        {
+            std::lock_guard lock (sync_mutex);
+            if (options.sync_answer_rate > 0 && !sync_answer_budget.take (options.sync_answer_rate, options.sync_answer_rate,
+                                          std::chrono::steady_clock::now (), static_cast<double> (datagram.size ()))) {
+                sync_refused++;
+                return false;
+            }
+        }
+        if (sync_channel->send_to (datagram, source, port) < 0) {
+            perror ("Sending digest sync error");
+        }
+        sent += datagram.size ();
+        response["entries"] = json::array ();
+        size = 0;
+        return true;
+    };
+
+    for (auto &entry: table.entries_in (buckets)) {
+        const auto entry_size = entry.dump ().size ();
+        if (sent + size + entry_size > options.sync_answer_bytes) {
+            break;
+        }
+        if (size != 0 && size + entry_size > datagram_budget && !send_response ()) {
+            return;
+        }
+        size += entry_size;
+        response["entries"].push_back (std::move (entry));
+    }
+    if (size != 0 && !send_response ()) {
+        return;
+    }
+
+    {
+        std::lock_guard lock (sync_mutex);
+        sync_answers++;
+    }
+
+    if (!filters_services ()) {
+        request_sync (peer, source, port);
+    }
+}
+
+/**
+ * @brief Merge the entries a peer sent in answer to our digest request.
+ *
+ * Entries that are not descriptors are skipped by merge_participant(), so
+ * one bad entry costs only itself. With service groups, providers of
+ * services we do not consume are skipped too: no heartbeat of theirs would
+ * ever refresh them, so each would only expire and come back.
+ */
+void engine::merge_sync (const json &response) {
+    const auto entries = response.find ("entries");
+    if (entries == response.end () || !entries->is_array ()) {
+        return;
+    }
+
+    std::uint64_t merged = 0;
+    for (const auto &entry: *entries) {
+        if (!entry.is_object () || (entry.contains ("age_ms") && !entry["age_ms"].is_number_unsigned ())) {
+            continue;
+        }
+        if (filters_services () && !provides_any (entry, options.consumes)) {
+            // our own entry is kept whatever we provide; anything else is a foreign service
+            const auto id = entry.find ("id");
+            if (id == entry.end () || *id != options.id) {
+                continue;
+            }
+        }
+
+        const auto status = table.merge_participant (entry, entry.value ("age_ms", std::uint64_t (0)));
+        if (status == PARTICIPANT_ADDED || status == PARTICIPANT_REFRESHED) {
+            merged++;
+        }
+    }
+
+    std::lock_guard lock (sync_mutex);
+    sync_merged += merged;
+}
+
+/**
+ * @brief Receives digest requests and the entries sent back in answer.
+ *
+ * Sync datagrams are charged to the same ingest budgets as advertisements,
+ * except those from a peer we are awaiting a reply from; see request_sync().
+ */
+void engine::sync_loop () {
+    timeval tv = {0, 100000};
+    setsockopt (sync_channel->descriptor (), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    std::vector<char> buffer (65536);
+    std::string source;
+
+    while (true) {
+        {
+            std::lock_guard lock (state_mutex);
+            if (stopping) {
+                break;
+            }
+        }
+
+        const ssize_t received = sync_channel->receive (buffer.data (), buffer.size () - 1, source);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            perror ("Receiving sync message error");
+            break;
+        }
+
+        deliver_sync (buffer.data (), received, source);
+    }
+}
+
+/**
+ * @brief Summarise our view for remote sites once per interval, and take in their summaries.
+ *
+ * Summaries come only from configured peers and are not charged to the
+ * ingest budgets, which are sized for one site's advertisements.
+ */
+void engine::aggregate_loop () {
+    timeval tv = {0, 100000};
+    setsockopt (aggregator_channel->descriptor (), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    std::vector<char> buffer (65536);
+    std::string source;
+    auto due = std::chrono::steady_clock::now ();
+
+    while (true) {
+        {
+            std::lock_guard lock (state_mutex);
+            if (stopping) {
+                break;
+            }
+        }
+
+        if (const auto now = std::chrono::steady_clock::now (); now >= due) {
+            aggregator->summarize (*table.snapshot (), *aggregator_channel, now);
+            due = std::max (due + options.aggregator.interval, now);
+        }
+
+        const ssize_t received = aggregator_channel->receive (buffer.data (), buffer.size (), source);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            perror ("Receiving site summary error");
+            break;
+        }
+
+        aggregator->receive (buffer.data (), received, source, *aggregator_channel);
+    }
+}
+
+/**
+ * @brief Handle one datagram received on the sync port: a digest request or the entries sent back.
+ *
+ * Fields are checked before they are read, so a malformed message is skipped;
+ * one that fails to parse is logged.
+ */
+void engine::deliver_sync (const char *buffer, const ssize_t length, const std::string &source) {
+    bool expected;
+    {
+        std::lock_guard lock (sync_mutex);
+        const auto it = awaiting_sync.find (source);
+        expected = it != awaiting_sync.end () && std::chrono::steady_clock::now () < it->second;
+    }
+
+    if (!(expected ? limiter.admit_expected () : limiter.admit (source))) {
+        return;
+    }
+
+    try {
+        const auto message = json::parse (buffer, buffer + length);
+        const auto type = message.value ("type", "");
+
+        if (type == "digest_request") {
+            answer_sync (message, source);
+        } else if (type == "digest_sync") {
+            merge_sync (message);
+        }
+    } catch (const json::exception &e) {
+        std::cerr << "Ignoring bad sync message from " << source << ": " << e.what () << "\n";
+    }
+}
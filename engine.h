@@ -0,0 +1,389 @@
+#ifndef HOSTMON_ENGINE_H
+#define HOSTMON_ENGINE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#include "aggregator.h"
+#include "bridge.h"
+#include "event_loop.h"
+#include "journal.h"
+#include "latency.h"
+#include "monitor.h"
+#include "query.h"
+#include "ratelimit.h"
+#include "service_groups.h"
+#include "shm_table.h"
+#include "transport.h"
+#include "warm.h"
+#include "xdp.h"
+
+using json = nlohmann::json;
+
+/**
+ * @brief The opt-in low-latency receive profile.
+ *
+ * The kernel busy polls the device for `busy_poll_us` within each blocking
+ * receive, and the receive, transmit and expiry threads run with the minimum
+ * timer slack so sub-millisecond heartbeats and ticks wake on time. When
+ * `cpu` pins the receive thread to a core, it also spins on a non-blocking
+ * socket for `spin` before sleeping.
+ */
+struct low_latency_settings {
+    bool enabled = false;
+    int busy_poll_us = 50;
+    std::chrono::microseconds spin {200};
+    // pin the receive thread to this CPU; -1 leaves it to the scheduler
+    int cpu = -1;
+};
+
+low_latency_settings low_latency_from_configuration (const json &settings);
+
+/**
+ * @brief The opt-in real-time heartbeat sender.
+ *
+ * The transmit thread runs under SCHED_FIFO at `priority`, optionally pinned
+ * to `cpu`, locks the process's memory with mlockall() and sleeps to absolute
+ * deadlines with clock_nanosleep(), so a loaded host still sends on time.
+ */
+struct realtime_sender_settings {
+    bool enabled = false;
+    int priority = 50;
+    // pin the transmit thread to this CPU; -1 leaves it to the scheduler
+    int cpu = -1;
+    bool lock_memory = true;
+};
+
+realtime_sender_settings realtime_sender_from_configuration (const json &settings);
+
+/**
+ * @brief Everything an engine needs to take part in one discovery group.
+ *
+ * `provides` holds the service entries as they appear in config.json; only
+ * their "service" names and, where given, "priority" are advertised. `faults`, when not null, is a
+ * fault_model configuration applied to every transport the engine opens.
+ * `ingest` bounds how many received datagrams per second are parsed.
+ *
+ * Every `digest_every` heartbeats the advertisement carries the digest of our
+ * table; a peer whose digest differs is asked over unicast, on its
+ * `sync_port`, for the entries in the digest buckets where the views differ,
+ * with at most one peer asked per `sync_cooldown`. Requests are answered
+ * only for current members at their advertised address, or peers we asked
+ * ourselves, and with at most `sync_answer_bytes` each and
+ * `sync_answer_rate` bytes per second in all.
+ *
+ * On start the engine multicasts a solicit; each peer answers with its
+ * advertisement after a random backoff of up to `solicit_window` scaled by the
+ * cluster size, unless `solicit_responders` others have answered first.
+ *
+ * The receive buffer is sized to absorb `receive_absorb` worth of heartbeats
+ * from the whole cluster. When the kernel reports datagrams dropped on the
+ * receive socket, expiry is widened by `overload_expiry_factor` until
+ * `overload_hold` passes without another drop, so our own overload is not
+ * taken for peers going offline.
+ *
+ * With `service_groups` on, heartbeats go to the groups of the services we
+ * provide rather than to `group_ip`, and we join only the groups of the
+ * services we `consume` (every group when that is empty). Nodes then see
+ * different parts of the cluster, so anti-entropy and solicitation, which
+ * assume everyone shares one view, are turned off.
+ *
+ * `heartbeat` and `expiry_tick` are in microseconds so the low-latency
+ * profile can run them below a millisecond.
+ */
+struct engine_options {
+    std::string id;
+    json provides = json::array ();
+
+    std::string group_ip = "224.1.1.1";
+    unsigned short group_port = 50000;
+
+    service_group_settings service_groups;
+    // the services we use; with service_groups on, advertisements providing none of them are ignored
+    std::vector<std::string> consumes;
+
+    std::chrono::microseconds heartbeat {500000};
+    std::chrono::microseconds expiry_tick {250000};
+    std::uint64_t expiry_ms = 600;
+
+    low_latency_settings low_latency;
+    realtime_sender_settings realtime_sender;
+
+    // also send each transition to the local UDP listener on 127.0.0.1:notify_port
+    bool notify_udp = true;
+    unsigned short notify_port = 10000;
+    // print advertisements and transitions to stdout
+    bool verbose = false;
+    // serve local queries on this Unix socket; empty for none
+    std::string query_socket;
+    // mirror the table into this shm_open() segment for local readers; empty for none
+    std::string shm_name;
+    std::uint32_t shm_capacity = 4096;
+
+    ingest_limits ingest;
+    history_limits history;
+    // when a mass expiry holds back offline notifications as a suspected partition
+    partition_settings partition;
+    // journal every membership change to this directory; empty for none
+    journal_settings journal;
+    // persist the view here and reload it on start; empty for none
+    warm_settings warm_restart;
+
+    // anti-entropy: 0 for sync_port or digest_every turns it off
+    unsigned short sync_port = 50001;
+    unsigned int digest_every = 4;
+    std::chrono::milliseconds sync_cooldown {2000};
+    // bytes of entries sent in answer to one digest request, and per second over all of them; 0 rate for no limit
+    std::size_t sync_answer_bytes = 64 * 1024;
+    double sync_answer_rate = 256 * 1024;
+
+    // startup solicitation: 0 solicit_responders turns it off
+    unsigned int solicit_responders = 3;
+    std::chrono::milliseconds solicit_window {250};
+
+    // receive buffer sizing; expected_participants is used until the table is larger
+    std::size_t expected_participants = 0;
+    std::chrono::milliseconds receive_absorb {500};
+    std::size_t receive_buffer_max = 64 * 1024 * 1024;
+
+    // a factor of 1 leaves expiry alone under overload
+    double overload_expiry_factor = 3.0;
+    std::chrono::milliseconds overload_hold {5000};
+
+    // receive the group through AF_XDP on this interface; empty for the socket only
+    xdp_settings xdp;
+
+    // join the common group on other segments or through tunnels to ours; see bridge_transport
+    bridge_settings bridge;
+
+    // summarise our view for remote sites' aggregators and keep theirs; see site_aggregator
+    aggregator_settings aggregator;
+
+    json faults;
+};
+
+engine_options options_from_configuration (const json &configuration);
+std::vector<engine_options> group_options_from_configuration (const json &configuration);
+
+/**
+ * @class engine
+ * @brief One hostmon instance: advertising, receiving, expiry and notification.
+ *
+ * This is the core of libhostmon. The daemon runs one; a service can embed one
+ * instead, register listeners for membership changes and read the current
+ * view straight from the published snapshot without any IPC.
+ *
+ * start() gives the engine threads of its own. start(event_loop &) instead
+ * runs its sending, receiving and timers on one worker of a shared
+ * event_loop, so a process can take part in many groups on a few threads;
+ * only a query server, when configured, still has a thread of its own.
+ * A hosted engine must be stopped and waited for before its loop is.
+ */
+class engine {
+    engine_options options;
+
+    std::unique_ptr<transport> notifications;
+    membership table;
+    ingest_limiter limiter;
+    std::unique_ptr<query_server> queries;
+    std::unique_ptr<shm_publisher> shared_table;
+    std::unique_ptr<journal_writer> journal;
+
+    std::unique_ptr<transport> sync_channel;
+    std::mutex sync_mutex;
+    std::map<std::string, std::chrono::steady_clock::time_point> last_sync;
+    // no request of ours is sent before this, whoever it is to
+    std::chrono::steady_clock::time_point next_sync {};
+    // addresses we asked for a sync, until their replies stop being expected
+    std::map<std::string, std::chrono::steady_clock::time_point> awaiting_sync;
+    // bytes we may still send in answer to digest requests
+    token_bucket sync_answer_budget;
+    std::mt19937_64 sync_random {std::random_device {} ()};
+    std::uint64_t sync_requests = 0;
+    std::uint64_t sync_deferred = 0;
+    std::uint64_t sync_answers = 0;
+    std::uint64_t sync_merged = 0;
+    std::uint64_t sync_refused = 0;
+
+    std::unique_ptr<transport> aggregator_channel;
+    std::unique_ptr<site_aggregator> aggregator;
+
+    struct pending_response {
+        std::chrono::steady_clock::time_point due;
+        unsigned int answered = 0;
+    };
+
+    // our advertisement as sent, without the digest
+    json advertisement;
+
+    std::mutex solicit_mutex;
+    std::condition_variable solicit_changed;
+    std::map<std::uint64_t, pending_response> pending_responses;
+    std::mt19937_64 solicit_random {std::random_device {} ()};
+    std::uint64_t solicits_answered = 0;
+    std::uint64_t solicits_suppressed = 0;
+
+    // whether receive_loop got its AF_XDP path
+    std::atomic<bool> receiving_xdp = false;
+
+    // how late datagrams are picked up after the kernel has them, and how late expiry ticks run
+    latency_histogram receive_wakeup;
+    latency_histogram expiry_lateness;
+    // how far after its deadline each heartbeat went out
+    latency_histogram send_drift;
+
+    // the table's digest as of the last expiry tick, for a real-time sender that must not wait on the table
+    std::atomic<std::uint64_t> digest_cache = 0;
+
+    // the advertisement without its closing brace, and the heartbeat built from it; see prepare_heartbeat()
+    std::string heartbeat_prefix;
+    std::string heartbeat_frame;
+    std::uint64_t heartbeat_sequence = 0;
+
+    // the receive socket, for resizing, and the cluster size its buffer was last sized for
+    int receive_fd = -1;
+    std::size_t sized_for = 0;
+
+    // the groups we send heartbeats to and listen on, as service_groups maps them
+    std::vector<std::string> send_groups;
+    std::vector<std::string> receive_groups;
+    // advertisements from groups shared with services we do not consume
+    std::atomic<std::uint64_t> foreign_dropped = 0;
+    // heartbeats already received on another of our groups, by id and sequence number; receive side only
+    static constexpr std::size_t group_copy_entries = 65536;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> group_copies_seen;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>> group_copies_order;
+    std::atomic<std::uint64_t> group_copies = 0;
+    // what the bridge, when configured, forwarded and dropped
+    std::shared_ptr<bridge_counters> bridged = std::make_shared<bridge_counters> ();
+
+    // set while hosted on an event_loop rather than running threads of our own
+    event_loop *loop = nullptr;
+    std::size_t loop_worker = 0;
+    bool detached = false;
+    std::unique_ptr<transport> group_sender;
+    std::unique_ptr<transport> group_receiver;
+
+    // receive overload, written by receive_loop
+    std::atomic<std::uint64_t> kernel_drops = 0;
+    std::atomic<std::uint64_t> overloads = 0;
+    std::atomic<bool> overloaded = false;
+    std::atomic<int> receive_buffer = 0;
+    std::chrono::steady_clock::time_point overload_until;
+
+    std::mutex state_mutex;
+    std::condition_variable state_changed;
+    bool stopping = false;
+    // set once receive_loop has joined the group, or failed to; the solicit waits for it
+    bool receiver_settled = false;
+    std::vector<std::thread> threads;
+
+    bool wait_for_stop (std::chrono::microseconds timeout);
+    void settle_receiver ();
+    bool wait_for_receiver ();
+    bool wait_until_stop (std::chrono::steady_clock::time_point deadline);
+    void tune_thread (bool receiving) const;
+    void make_realtime () const;
+    bool sleep_until (std::chrono::steady_clock::time_point deadline);
+
+    void prepare ();
+    void transmit_loop ();
+    [[nodiscard]] std::unique_ptr<transport> open_sender () const;
+    void prepare_heartbeat ();
+    ssize_t send_heartbeat (transport &channel);
+    void receive_loop ();
+    [[nodiscard]] std::unique_ptr<transport> open_receiver (int timeout_ms);
+    void deliver (char *buffer, ssize_t length, const std::string &source);
+    void check_receiver (const transport &channel);
+    void size_receive_buffer (int fd, std::size_t participants);
+    void check_overload (const transport &channel);
+    void send_overload_update (bool overload, std::uint64_t drops, std::uint64_t expiry);
+    void expire_loop ();
+    bool expire_once ();
+    bool first_group_copy (const json &message);
+    [[nodiscard]] bool filters_services () const;
+    void sync_loop ();
+    void deliver_sync (const char *buffer, ssize_t length, const std::string &source);
+    void aggregate_loop ();
+    void persist_loop ();
+    void persist (std::uint64_t &saved_version);
+    void respond_loop ();
+    std::chrono::steady_clock::time_point answer_solicits (transport &channel, std::unique_lock<std::mutex> &lock);
+
+    using periodic_step = std::function<bool (std::chrono::steady_clock::time_point due)>;
+    void repeat (std::chrono::steady_clock::time_point due, std::chrono::microseconds period,
+                 std::shared_ptr<periodic_step> step);
+    void drain (transport &channel, std::size_t size, bool sync);
+    void detach ();
+
+    [[nodiscard]] json advertisement_with_digest ();
+    [[nodiscard]] std::chrono::microseconds response_backoff ();
+    void on_solicit (const json &solicit);
+    void on_solicit_response (std::uint64_t nonce);
+
+    void compare_digest (const json &advertisement, const std::string &source);
+    void request_sync (const std::string &peer, const std::string &address, unsigned short port);
+    void answer_sync (const json &request, const std::string &source);
+    void merge_sync (const json &response);
+
+public:
+    explicit engine (engine_options options);
+    ~engine ();
+
+    engine (const engine &) = delete;
+    engine &operator= (const engine &) = delete;
+
+    void start ();
+    void start (event_loop &host);
+    void stop ();
+    void wait ();
+
+    [[nodiscard]] json create_advertisement () const;
+
+    int on_change (change_listener listener) {
+        return table.subscribe (std::move (listener));
+    }
+
+    void remove_listener (const int token) {
+        table.unsubscribe (token);
+    }
+
+    [[nodiscard]] std::shared_ptr<const membership_snapshot> snapshot () const {
+        return table.snapshot ();
+    }
+
+    // the providers of a service, by priority and then id, from the index kept with the snapshot
+    [[nodiscard]] provider_list providers_of (const std::string &service) const {
+        return table.snapshot ()->providers_of (service);
+    }
+
+    [[nodiscard]] watch_result watch (const std::uint64_t since, const std::chrono::milliseconds timeout) const {
+        return table.watch (since, timeout);
+    }
+
+    [[nodiscard]] json statistics ();
+
+    // the remote sites an aggregator holds, with their members and providers; null without an aggregator
+    [[nodiscard]] json remote_sites () const {
+        return aggregator ? aggregator->sites_view () : json ();
+    }
+
+    membership &get_membership () {
+        return table;
+    }
+};
+
+#endif //HOSTMON_ENGINE_H
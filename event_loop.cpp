@@ -0,0 +1,281 @@
+#include "event_loop.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/**
+ * @brief Set up the workers; nothing runs until start().
+ *
+ * @param threads The number of worker threads, at least one.
+ * @throws std::runtime_error If an epoll set or wakeup descriptor cannot be created.
+ */
+event_loop::event_loop (const std::size_t threads) {
+    for (std::size_t i = 0; i < std::max<std::size_t> (threads, 1); i++) {
+        auto w = std::make_unique<worker> ();
+
+        w->epoll = epoll_create1 (EPOLL_CLOEXEC);
+        w->wake = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->epoll < 0 || w->wake < 0) {
+            if (w->epoll >= 0) {
+                close (w->epoll);
+            }
+            throw std::runtime_error ("Creating event loop error: " + std::string (strerror (errno)));
+        }
+
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = w->wake;
+        epoll_ctl (w->epoll, EPOLL_CTL_ADD, w->wake, &event);
+
+        workers.push_back (std::move (w));
+    }
+}
+
+event_loop::~event_loop () {
+    stop ();
+    wait ();
+
+    for (const auto &w: workers) {
+        close (w->wake);
+        close (w->epoll);
+    }
+}
+
+/**
+ * @brief Pick the worker for a new group, round robin.
+ */
+std::size_t event_loop::assign () {
+    return next_worker++ % workers.size ();
+}
+
+/**
+ * @brief Call `on_readable` on the worker's thread whenever `fd` has data.
+ *
+ * @throws std::runtime_error If the descriptor cannot be added to the worker's epoll set.
+ */
+void event_loop::watch (const std::size_t worker, const int fd, const void *owner, task on_readable) {
+    auto &w = *workers[worker];
+
+    std::lock_guard lock (w.mutex);
+
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl (w.epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        throw std::runtime_error ("Watching descriptor error: " + std::string (strerror (errno)));
+    }
+
+    w.readable[fd] = {owner, std::make_shared<task> (std::move (on_readable))};
+}
+
+/**
+ * @brief Stop watching a descriptor.
+ */
+void event_loop::unwatch (const std::size_t worker, const int fd) {
+    auto &w = *workers[worker];
+
+    std::lock_guard lock (w.mutex);
+    if (w.readable.erase (fd) != 0) {
+        epoll_ctl (w.epoll, EPOLL_CTL_DEL, fd, nullptr);
+    }
+}
+
+/**
+ * @brief Run `run` once on the worker's thread at `due`, or as soon after as the worker is free.
+ */
+void event_loop::schedule (const std::size_t worker, const clock::time_point due, const void *owner, task run) {
+    auto &w = *workers[worker];
+    bool earliest;
+
+    {
+        std::lock_guard lock (w.mutex);
+        w.timers.push_back ({due, w.sequence++, owner, std::move (run)});
+        std::push_heap (w.timers.begin (), w.timers.end (), std::greater<> ());
+        earliest = w.timers.front ().sequence == w.sequence - 1;
+    }
+
+    // the worker only needs waking when it is sleeping past the new timer
+    if (earliest) {
+        signal (w);
+    }
+}
+
+/**
+ * @brief Run `run` on the worker's thread as soon as it is free. It belongs to no owner, so forget() spares it.
+ */
+void event_loop::post (const std::size_t worker, task run) {
+    schedule (worker, clock::now (), nullptr, std::move (run));
+}
+
+/**
+ * @brief Drop every descriptor and timer registered by `owner` on the worker.
+ */
+void event_loop::forget (const std::size_t worker, const void *owner) {
+    auto &w = *workers[worker];
+
+    std::lock_guard lock (w.mutex);
+
+    std::erase_if (w.timers, [owner] (const timer &t) { return t.owner == owner; });
+    std::make_heap (w.timers.begin (), w.timers.end (), std::greater<> ());
+
+    for (auto it = w.readable.begin (); it != w.readable.end ();) {
+        if (it->second.owner != owner) {
+            ++it;
+            continue;
+        }
+        epoll_ctl (w.epoll, EPOLL_CTL_DEL, it->first, nullptr);
+        it = w.readable.erase (it);
+    }
+}
+
+void event_loop::signal (const worker &w) {
+    const std::uint64_t one = 1;
+    if (write (w.wake, &one, sizeof (one)) < 0 && errno != EAGAIN) {
+        perror ("Waking event loop error");
+    }
+}
+
+/**
+ * @brief Start the worker threads.
+ */
+void event_loop::start () {
+    stopping = false;
+
+    for (const auto &w: workers) {
+        if (!w->thread.joinable ()) {
+            w->thread = std::thread (&event_loop::run, this, std::ref (*w));
+        }
+    }
+}
+
+/**
+ * @brief Ask every worker to finish. Returns at once; use wait() to join them.
+ *
+ * Whatever is still registered stays registered and never runs.
+ */
+void event_loop::stop () {
+    stopping = true;
+
+    for (const auto &w: workers) {
+        signal (*w);
+    }
+}
+
+/**
+ * @brief Block until every worker has finished.
+ */
+void event_loop::wait () {
+    for (const auto &w: workers) {
+        if (w->thread.joinable ()) {
+            w->thread.join ();
+        }
+    }
+}
+
+/**
+ * @brief Wait for the next readable descriptor or due timer and run it, until stop().
+ *
+ * Handlers and timers run without the worker's lock held, so they may
+ * register, schedule and forget freely, on this worker or another.
+ */
+void event_loop::run (worker &w) {
+    epoll_event ready[64];
+
+    while (!stopping) {
+        int timeout = -1;
+        {
+            std::lock_guard lock (w.mutex);
+            if (!w.timers.empty ()) {
+                const auto wait = std::chrono::ceil<std::chrono::milliseconds> (w.timers.front ().due - clock::now ());
+                timeout = static_cast<int> (std::clamp<long long> (wait.count (), 0, INT_MAX));
+            }
+        }
+
+        const int count = epoll_wait (w.epoll, ready, 64, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror ("Waiting for events error");
+            break;
+        }
+        w.wakeups++;
+
+        for (int i = 0; i < count; i++) {
+            const int fd = ready[i].data.fd;
+
+            if (fd == w.wake) {
+                std::uint64_t signals;
+                while (read (w.wake, &signals, sizeof (signals)) > 0) {
+                }
+                continue;
+            }
+
+            std::shared_ptr<task> handle;
+            {
+                std::lock_guard lock (w.mutex);
+                // an earlier handler in this batch may have dropped it
+                if (const auto it = w.readable.find (fd); it != w.readable.end ()) {
+                    handle = it->second.run;
+                }
+            }
+            if (handle) {
+                w.events++;
+                (*handle) ();
+            }
+        }
+
+        // only timers due before this pass began, so one that keeps rescheduling itself cannot starve the descriptors
+        const auto now = clock::now ();
+        while (!stopping) {
+            timer next;
+            {
+                std::lock_guard lock (w.mutex);
+                if (w.timers.empty () || w.timers.front ().due > now) {
+                    break;
+                }
+                std::pop_heap (w.timers.begin (), w.timers.end (), std::greater<> ());
+                next = std::move (w.timers.back ());
+                w.timers.pop_back ();
+            }
+
+            w.timers_run++;
+            next.run ();
+        }
+    }
+}
+
+/**
+ * @brief Per worker: descriptors watched, timers pending, and how often it woke, handled events and ran timers.
+ */
+json event_loop::statistics () const {
+    json result = json::array ();
+
+    for (const auto &w: workers) {
+        std::size_t watched;
+        std::size_t pending;
+        {
+            std::lock_guard lock (w->mutex);
+            watched = w->readable.size ();
+            pending = w->timers.size ();
+        }
+
+        result.push_back ({
+            {"watched", watched},
+            {"timers", pending},
+            {"wakeups", w->wakeups.load ()},
+            {"events", w->events.load ()},
+            {"timers_run", w->timers_run.load ()}
+        });
+    }
+
+    return result;
+}
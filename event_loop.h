@@ -0,0 +1,107 @@
+#ifndef HOSTMON_EVENT_LOOP_H
+#define HOSTMON_EVENT_LOOP_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * @class event_loop
+ * @brief A small pool of threads, each waiting on its own epoll set and timer heap.
+ *
+ * Lets one process take part in many discovery groups without threads of
+ * its own for each: a group is assigned a worker once and then registers the
+ * descriptors it reads and the timers it runs there, so everything the
+ * group does happens on that one thread and its state needs no more locking
+ * than it did with threads of its own.
+ *
+ * Descriptors are watched level-triggered, so a handler may read only part
+ * of what is waiting and be called again on the next pass. Timers are
+ * one-shot; periodic work schedules its next run. Everything registered
+ * carries an owner, and forget() drops all of an owner's descriptors and
+ * timers at once; called on the worker's own thread, nothing of the owner's
+ * can be running at the same time.
+ */
+class event_loop {
+public:
+    using clock = std::chrono::steady_clock;
+    using task = std::function<void ()>;
+
+private:
+    struct timer {
+        clock::time_point due;
+        std::uint64_t sequence;
+        const void *owner;
+        task run;
+
+        bool operator> (const timer &other) const {
+            return due != other.due ? due > other.due : sequence > other.sequence;
+        }
+    };
+
+    struct handler {
+        const void *owner;
+        std::shared_ptr<task> run;
+    };
+
+    struct worker {
+        int epoll = -1;
+        int wake = -1;
+
+        std::mutex mutex;
+        // a min-heap on due, kept with std::push_heap and std::pop_heap
+        std::vector<timer> timers;
+        std::uint64_t sequence = 0;
+        std::map<int, handler> readable;
+
+        std::atomic<std::uint64_t> wakeups = 0;
+        std::atomic<std::uint64_t> events = 0;
+        std::atomic<std::uint64_t> timers_run = 0;
+
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers;
+    std::atomic<std::size_t> next_worker = 0;
+    std::atomic<bool> stopping = false;
+
+    void run (worker &w);
+    void signal (const worker &w);
+
+public:
+    explicit event_loop (std::size_t threads = 1);
+    ~event_loop ();
+
+    event_loop (const event_loop &) = delete;
+    event_loop &operator= (const event_loop &) = delete;
+
+    [[nodiscard]] std::size_t assign ();
+
+    void watch (std::size_t worker, int fd, const void *owner, task on_readable);
+    void unwatch (std::size_t worker, int fd);
+    void schedule (std::size_t worker, clock::time_point due, const void *owner, task run);
+    void post (std::size_t worker, task run);
+    void forget (std::size_t worker, const void *owner);
+
+    void start ();
+    void stop ();
+    void wait ();
+
+    [[nodiscard]] std::size_t size () const {
+        return workers.size ();
+    }
+
+    [[nodiscard]] json statistics () const;
+};
+
+#endif //HOSTMON_EVENT_LOOP_H
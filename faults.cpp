@@ -0,0 +1,150 @@
+#include "faults.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+/**
+ * @brief Read a fault profile from JSON, starting from the given defaults.
+ *
+ * Keys that are absent keep the value from `defaults`, so per-peer entries
+ * only need to mention what differs from the top level profile.
+ *
+ * @throws std::runtime_error If the delay distribution is not recognised.
+ */
+fault_profile parse_fault_profile (const json &j, const fault_profile &defaults) {
+    fault_profile p = defaults;
+
+    p.loss = j.value ("loss", p.loss);
+    p.burst_enter = j.value ("burst_enter", p.burst_enter);
+    p.burst_exit = j.value ("burst_exit", p.burst_exit);
+    p.burst_loss = j.value ("burst_loss", p.burst_loss);
+    p.delay_ms = j.value ("delay_ms", p.delay_ms);
+    p.jitter_ms = j.value ("jitter_ms", p.jitter_ms);
+    p.duplicate = j.value ("duplicate", p.duplicate);
+    p.reorder = j.value ("reorder", p.reorder);
+    p.reorder_delay_ms = j.value ("reorder_delay_ms", p.reorder_delay_ms);
+
+    if (j.contains ("distribution")) {
+        const auto name = j["distribution"].get<std::string> ();
+
+        if (name == "constant") {
+            p.distribution = DELAY_CONSTANT;
+        } else if (name == "uniform") {
+            p.distribution = DELAY_UNIFORM;
+        } else if (name == "normal") {
+            p.distribution = DELAY_NORMAL;
+        } else if (name == "exponential") {
+            p.distribution = DELAY_EXPONENTIAL;
+        } else {
+            throw std::runtime_error ("Unknown delay distribution: " + name);
+        }
+    }
+
+    return p;
+}
+
+fault_model::fault_model (const json &settings)
+    : defaults (parse_fault_profile (settings)),
+      rng (settings.value ("seed", std::uint64_t (1))) {
+
+    if (settings.contains ("peers")) {
+        for (auto &[peer, overrides]: settings["peers"].items ()) {
+            peers[peer] = parse_fault_profile (overrides, defaults);
+        }
+    }
+}
+
+fault_model::fault_model (const fault_profile &defaults, const std::uint64_t seed)
+    : defaults (defaults), rng (seed) {
+}
+
+const fault_profile &fault_model::profile_for (const std::string &peer) const {
+    if (!peers.empty ()) {
+        if (const auto it = peers.find (peer); it != peers.end ()) {
+            return it->second;
+        }
+    }
+    return defaults;
+}
+
+double fault_model::sample_delay (const fault_profile &p) {
+    double delay = p.delay_ms;
+
+    switch (p.distribution) {
+        case DELAY_CONSTANT:
+            break;
+
+        case DELAY_UNIFORM:
+            delay += std::uniform_real_distribution<double> (0.0, p.jitter_ms) (rng);
+            break;
+
+        case DELAY_NORMAL:
+            if (p.jitter_ms > 0.0) {
+                delay = std::normal_distribution<double> (p.delay_ms, p.jitter_ms) (rng);
+            }
+            break;
+
+        case DELAY_EXPONENTIAL:
+            if (p.delay_ms > 0.0) {
+                delay = std::exponential_distribution<double> (1.0 / p.delay_ms) (rng);
+            }
+            break;
+    }
+
+    return std::max (delay, 0.0);
+}
+
+/**
+ * @brief Decide what happens to one datagram exchanged with a peer.
+ *
+ * @param peer The address of the peer the datagram comes from or goes to.
+ * @return The delay in milliseconds of each copy to deliver: empty when the
+ *         datagram is lost, two entries when it is duplicated.
+ */
+std::vector<double> fault_model::apply (const std::string &peer) {
+    std::lock_guard lock (model_mutex);
+
+    const auto &p = profile_for (peer);
+    std::uniform_real_distribution<double> chance (0.0, 1.0);
+
+    double loss = p.loss;
+    if (p.burst_enter > 0.0) {
+        bool &bad = bursting[peer];
+        bad = bad ? chance (rng) >= p.burst_exit : chance (rng) < p.burst_enter;
+        if (bad) {
+            loss = p.burst_loss;
+        }
+    }
+
+    std::vector<double> copies;
+    if (loss > 0.0 && chance (rng) < loss) {
+        return copies;
+    }
+
+    const int count = p.duplicate > 0.0 && chance (rng) < p.duplicate ? 2 : 1;
+    for (int i = 0; i < count; i++) {
+        double delay = sample_delay (p);
+        if (p.reorder > 0.0 && chance (rng) < p.reorder) {
+            delay += p.reorder_delay_ms;
+        }
+        copies.push_back (delay);
+    }
+
+    return copies;
+}
+
+/**
+ * @brief Whether no configured profile would ever alter a datagram.
+ */
+bool fault_model::is_transparent () const {
+    return defaults.is_transparent ()
+           && std::all_of (peers.begin (), peers.end (), [] (const auto &p) { return p.second.is_transparent (); });
+}
+
+/**
+ * @brief Whether any configured profile holds datagrams back.
+ */
+bool fault_model::delays () const {
+    return defaults.delays ()
+           || std::any_of (peers.begin (), peers.end (), [] (const auto &p) { return p.second.delays (); });
+}
@@ -0,0 +1,96 @@
+#ifndef HOSTMON_FAULTS_H
+#define HOSTMON_FAULTS_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+enum DelayDistribution {
+    DELAY_CONSTANT,
+    DELAY_UNIFORM,
+    DELAY_NORMAL,
+    DELAY_EXPONENTIAL
+};
+
+/**
+ * @brief The impairments applied to the datagrams of one peer.
+ *
+ * Burst loss follows a two state (Gilbert-Elliott) model: each datagram moves
+ * the link from good to bad with probability `burst_enter` and back with
+ * `burst_exit`; while bad, datagrams are lost with probability `burst_loss`
+ * instead of `loss`. Delay is `delay_ms`, spread by `jitter_ms` according to
+ * the distribution (the range for uniform, the standard deviation for normal;
+ * exponential uses `delay_ms` as the mean and ignores the jitter).
+ */
+struct fault_profile {
+    double loss = 0.0;
+
+    double burst_enter = 0.0;
+    double burst_exit = 1.0;
+    double burst_loss = 1.0;
+
+    DelayDistribution distribution = DELAY_CONSTANT;
+    double delay_ms = 0.0;
+    double jitter_ms = 0.0;
+
+    double duplicate = 0.0;
+
+    double reorder = 0.0;
+    double reorder_delay_ms = 0.0;
+
+    [[nodiscard]] bool is_transparent () const {
+        return loss == 0.0 && burst_enter == 0.0 && delay_ms == 0.0 && jitter_ms == 0.0
+               && duplicate == 0.0 && reorder == 0.0;
+    }
+
+    // whether any datagram is held back rather than passed on, dropped or duplicated at once
+    [[nodiscard]] bool delays () const {
+        return delay_ms != 0.0 || jitter_ms != 0.0 || (reorder != 0.0 && reorder_delay_ms != 0.0);
+    }
+};
+
+fault_profile parse_fault_profile (const json &j, const fault_profile &defaults = {});
+
+/**
+ * @class fault_model
+ * @brief Decides the fate of each datagram according to per-peer fault profiles.
+ *
+ * Configured from a JSON object such as
+ *
+ *     { "seed": 7, "loss": 0.01, "delay_ms": 2, "distribution": "normal", "jitter_ms": 1,
+ *       "peers": { "10.0.0.5": { "burst_enter": 0.05, "burst_exit": 0.3 } } }
+ *
+ * where the top level keys are the default profile and each entry under
+ * "peers" overrides it for one peer address. Used both by fault_transport on
+ * real sockets and by the simulator's in-memory network.
+ */
+class fault_model {
+    fault_profile defaults;
+    std::map<std::string, fault_profile> peers;
+
+    // whether the link to each peer is currently in its lossy burst state
+    std::map<std::string, bool> bursting;
+
+    std::mt19937_64 rng;
+    std::mutex model_mutex;
+
+    [[nodiscard]] const fault_profile &profile_for (const std::string &peer) const;
+    double sample_delay (const fault_profile &p);
+
+public:
+    explicit fault_model (const json &settings);
+    explicit fault_model (const fault_profile &defaults, std::uint64_t seed = 1);
+
+    std::vector<double> apply (const std::string &peer);
+
+    [[nodiscard]] bool is_transparent () const;
+    [[nodiscard]] bool delays () const;
+};
+
+#endif //HOSTMON_FAULTS_H
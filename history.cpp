@@ -0,0 +1,325 @@
+#include "history.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+/**
+ * @brief Read history limits from the "history" object of config.json.
+ *
+ * Recognises "retention_s" and "max_participants"; a null object gives the defaults.
+ */
+history_limits history_from_configuration (const json &settings) {
+    history_limits limits;
+    if (!settings.is_object ()) {
+        return limits;
+    }
+
+    limits.retention_ms = settings.value ("retention_s", limits.retention_ms / 1000) * 1000;
+    limits.max_participants = settings.value ("max_participants", limits.max_participants);
+
+    return limits;
+}
+
+/**
+ * @brief Record that a participant came online or went offline.
+ *
+ * When the ring is full the oldest transition is dropped and the base moves
+ * forward by the delta of the one after it.
+ */
+void participant_history::transition (const std::string &id, const bool online, const std::uint64_t now) {
+    if (limits.max_participants == 0) {
+        return;
+    }
+
+    if (!records.contains (id) && records.size () >= limits.max_participants) {
+        evict ();
+    }
+
+    auto &r = records[id];
+
+    const auto delta = r.count == 0 ? 0 : std::min<std::uint64_t> (now - std::min (now, r.latest), delta_mask);
+    const std::uint32_t word = (online ? online_bit : 0) | static_cast<std::uint32_t> (delta);
+
+    if (r.count == 0) {
+        r.base = now;
+    } else if (r.count == ring_size) {
+        const auto oldest = r.head;
+        const auto next = (oldest + 1) % ring_size;
+        r.base += r.ring[next] & delta_mask;
+        r.head = next;
+        r.count--;
+    }
+
+    r.ring[(r.head + r.count) % ring_size] = word;
+    r.count++;
+    r.latest = now;
+    r.online = online;
+
+    if (online) {
+        r.joins++;
+        r.last_heartbeat = now;
+    } else {
+        r.leaves++;
+    }
+}
+
+/**
+ * @brief Record an advertisement, adding the gap since the previous one to the summary.
+ *
+ * @param sequence The advertisement's sequence number, when it carries one.
+ */
+void participant_history::heartbeat (const std::string &id, const std::uint64_t now,
+                                     const std::optional<std::uint64_t> sequence) {
+    const auto it = records.find (id);
+    if (it == records.end ()) {
+        return;
+    }
+
+    auto &r = it->second;
+    if (r.last_heartbeat != 0 && now > r.last_heartbeat) {
+        const auto gap = std::min<std::uint64_t> (now - r.last_heartbeat, UINT32_MAX);
+
+        r.gap_count++;
+        r.gap_total_ms += gap;
+        r.gap_max_ms = std::max (r.gap_max_ms, static_cast<std::uint32_t> (gap));
+        r.gap_histogram[std::min<std::size_t> (std::bit_width (gap), gap_buckets - 1)]++;
+    }
+    r.last_heartbeat = now;
+
+    if (sequence) {
+        r.link.arrive (*sequence, now);
+    }
+}
+
+/**
+ * @brief Account for one sequenced heartbeat.
+ *
+ * Senders count from 0, so a 0 after anything else, or a number far behind
+ * the highest, starts a new run rather than counting as late.
+ */
+void link_quality::arrive (const std::uint64_t sequence, const std::uint64_t now) {
+    const bool restarted = started && sequence < highest
+                           && (sequence == 0 || highest - sequence >= restart_distance);
+
+    if (!started || restarted) {
+        if (restarted) {
+            previous_expected += highest - first + 1;
+            previous_received += received;
+            restarts++;
+        }
+        started = true;
+        first = highest = sequence;
+        window = 1;
+        received = 1;
+        last_arrival = now;
+        return;
+    }
+
+    if (sequence > highest) {
+        const auto step = sequence - highest;
+
+        if (now >= last_arrival) {
+            const double gap = static_cast<double> (now - last_arrival) / static_cast<double> (step);
+            if (mean_gap_ms == 0) {
+                mean_gap_ms = gap;
+            } else {
+                jitter_ms += (std::abs (gap - mean_gap_ms) - jitter_ms) / 16;
+                mean_gap_ms += (gap - mean_gap_ms) / 16;
+            }
+        }
+
+        window = step >= window_size ? 1 : window << step | 1;
+        highest = sequence;
+        received++;
+        last_arrival = now;
+        return;
+    }
+
+    const auto behind = highest - sequence;
+    if (behind < window_size) {
+        const auto bit = std::uint64_t (1) << behind;
+        if ((window & bit) != 0) {
+            duplicates++;
+            return;
+        }
+        window |= bit;
+    }
+
+    // late; beyond the window a duplicate cannot be told apart, and lost() never goes below zero
+    reordered++;
+    received++;
+}
+
+/**
+ * @brief The link quality as reported by the history query, or null before any sequenced heartbeat.
+ */
+json link_quality::describe () const {
+    if (!started) {
+        return nullptr;
+    }
+
+    return {
+        {"highest_sequence", highest},
+        {"expected", expected ()},
+        {"received", previous_received + received},
+        {"lost", lost ()},
+        {"loss_rate", static_cast<double> (lost ()) / static_cast<double> (expected ())},
+        {"reordered", reordered},
+        {"duplicates", duplicates},
+        {"restarts", restarts},
+        {"mean_gap_ms", mean_gap_ms},
+        {"jitter_ms", jitter_ms}
+    };
+}
+
+/**
+ * @brief Forget participants that have been offline for longer than the retention period.
+ */
+void participant_history::prune (const std::uint64_t now) {
+    std::erase_if (records, [&] (const auto &entry) {
+        const auto &r = entry.second;
+        return !r.online && now > r.latest && now - r.latest > limits.retention_ms;
+    });
+}
+
+/**
+ * @brief Make room for one more record by dropping the participant offline the longest.
+ *
+ * If every tracked participant is online the oldest record of all goes instead.
+ */
+void participant_history::evict () {
+    auto victim = records.end ();
+
+    for (auto it = records.begin (); it != records.end (); ++it) {
+        if (victim == records.end ()
+            || (!it->second.online && victim->second.online)
+            || (it->second.online == victim->second.online && it->second.latest < victim->second.latest)) {
+            victim = it;
+        }
+    }
+
+    if (victim != records.end ()) {
+        records.erase (victim);
+    }
+}
+
+/**
+ * @brief The full history of one participant, with the ring decoded to absolute times.
+ *
+ * @return The history, or null when the participant is not tracked.
+ */
+json participant_history::describe (const std::string &id) const {
+    const auto it = records.find (id);
+    if (it == records.end ()) {
+        return nullptr;
+    }
+
+    const auto &r = it->second;
+
+    json transitions = json::array ();
+    std::uint64_t at = r.base;
+    for (std::size_t i = 0; i < r.count; i++) {
+        const auto word = r.ring[(r.head + i) % ring_size];
+        if (i != 0) {
+            at += word & delta_mask;
+        }
+        transitions.push_back ({{"at", at}, {"state", (word & online_bit) != 0 ? "online" : "offline"}});
+    }
+
+    // bucket i counts gaps of [2^(i-1), 2^i) ms; the last one everything longer
+    json histogram = json::array ();
+    for (const auto n: r.gap_histogram) {
+        histogram.push_back (n);
+    }
+
+    return {
+        {"id", id},
+        {"online", r.online},
+        {"joins", r.joins},
+        {"leaves", r.leaves},
+        {"transitions", transitions},
+        {"heartbeat_gaps", {
+            {"count", r.gap_count},
+            {"mean_ms", r.gap_count == 0 ? 0.0 : static_cast<double> (r.gap_total_ms) / r.gap_count},
+            {"max_ms", r.gap_max_ms},
+            {"log2_histogram", histogram}
+        }},
+        {"link", r.link.describe ()}
+    };
+}
+
+/**
+ * @brief One line per tracked participant: current state, joins, leaves and the last transition.
+ */
+json participant_history::summary () const {
+    json result = json::object ();
+
+    for (const auto &[id, r]: records) {
+        result[id] = {
+            {"online", r.online},
+            {"joins", r.joins},
+            {"leaves", r.leaves},
+            {"last_transition", r.latest},
+            {"lost", r.link.lost ()}
+        };
+    }
+
+    return result;
+}
+
+/**
+ * @brief Link quality over every participant sending sequenced heartbeats, for the stats query.
+ *
+ * Loss is totalled over all of them; the worst single participant and the
+ * largest jitter are reported alongside, since one bad link hides in a total.
+ */
+json participant_history::link_summary () const {
+    std::size_t senders = 0;
+    std::uint64_t expected = 0;
+    std::uint64_t lost = 0;
+    std::uint64_t reordered = 0;
+    std::uint64_t duplicates = 0;
+    double jitter_total = 0;
+    double jitter_max = 0;
+
+    std::string worst;
+    double worst_rate = -1;
+
+    for (const auto &[id, r]: records) {
+        const auto &link = r.link;
+        if (!link.started) {
+            continue;
+        }
+
+        senders++;
+        expected += link.expected ();
+        lost += link.lost ();
+        reordered += link.reordered;
+        duplicates += link.duplicates;
+        jitter_total += link.jitter_ms;
+        jitter_max = std::max (jitter_max, link.jitter_ms);
+
+        const auto rate = static_cast<double> (link.lost ()) / static_cast<double> (link.expected ());
+        if (rate > worst_rate) {
+            worst = id;
+            worst_rate = rate;
+        }
+    }
+
+    json result = {
+        {"senders", senders},
+        {"expected", expected},
+        {"lost", lost},
+        {"loss_rate", expected == 0 ? 0.0 : static_cast<double> (lost) / static_cast<double> (expected)},
+        {"reordered", reordered},
+        {"duplicates", duplicates},
+        {"mean_jitter_ms", senders == 0 ? 0.0 : jitter_total / static_cast<double> (senders)},
+        {"max_jitter_ms", jitter_max}
+    };
+    if (senders != 0) {
+        result["worst"] = {{"id", worst}, {"loss_rate", worst_rate}};
+    }
+
+    return result;
+}
@@ -0,0 +1,146 @@
+#ifndef HOSTMON_HISTORY_H
+#define HOSTMON_HISTORY_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * @brief Bounds on participant_history. A max_participants of 0 turns history off.
+ */
+struct history_limits {
+    // how long a participant's history is kept after it last went offline
+    std::uint64_t retention_ms = 24 * 60 * 60 * 1000;
+    // participants tracked at once; the longest offline are dropped first
+    std::size_t max_participants = 8192;
+};
+
+history_limits history_from_configuration (const json &settings);
+
+/**
+ * @brief Loss, reordering and jitter of one sender's sequenced heartbeats.
+ *
+ * A 64 bit bitmap of the sequence numbers just below the highest one seen
+ * tells a late packet from a duplicate. Jitter is the smoothed deviation of
+ * the arrival gap per sequence step from its own smoothed mean, so it needs
+ * no sender clock and no knowledge of the sender's heartbeat interval.
+ */
+struct link_quality {
+    // window bit i is set when highest - i has arrived
+    static constexpr std::uint64_t window_size = 64;
+    // a sequence number this far behind the highest means the sender restarted
+    static constexpr std::uint64_t restart_distance = 1024;
+
+    bool started = false;
+    std::uint64_t first = 0;
+    std::uint64_t highest = 0;
+    std::uint64_t window = 0;
+    std::uint64_t last_arrival = 0;
+
+    // this sender's current run of sequence numbers
+    std::uint64_t received = 0;
+    // earlier runs, before the sender restarted
+    std::uint64_t previous_expected = 0;
+    std::uint64_t previous_received = 0;
+
+    std::uint64_t reordered = 0;
+    std::uint64_t duplicates = 0;
+    std::uint64_t restarts = 0;
+
+    double mean_gap_ms = 0;
+    double jitter_ms = 0;
+
+    void arrive (std::uint64_t sequence, std::uint64_t now);
+
+    [[nodiscard]] std::uint64_t expected () const {
+        return previous_expected + (started ? highest - first + 1 : 0);
+    }
+
+    [[nodiscard]] std::uint64_t lost () const {
+        const auto delivered = previous_received + received;
+        return expected () > delivered ? expected () - delivered : 0;
+    }
+
+    [[nodiscard]] json describe () const;
+};
+
+/**
+ * @class participant_history
+ * @brief Recent online/offline transitions and heartbeat gaps per participant.
+ *
+ * Each participant gets one fixed size record, so the whole history fits in
+ * max_participants records whatever the churn. Transitions are kept in a ring
+ * of 32 bit words, each holding the state entered and the milliseconds since
+ * the transition before it; only the oldest retained transition carries a full
+ * timestamp. Heartbeat gaps are summarised as count, total, maximum and a
+ * power-of-two histogram rather than kept individually. Advertisements that
+ * carry a sequence number also feed the participant's link quality.
+ *
+ * Records outlive the table entry: a participant's history is kept for
+ * retention_ms after it last went offline and picks up again if it returns.
+ * Not thread safe; the membership table calls it under its own lock.
+ */
+class participant_history {
+public:
+    static constexpr std::size_t ring_size = 32;
+    static constexpr std::size_t gap_buckets = 16;
+
+private:
+    // a ring word: the top bit is set for online, the rest is the delta in ms
+    static constexpr std::uint32_t online_bit = 0x80000000u;
+    static constexpr std::uint32_t delta_mask = 0x7fffffffu;
+
+    struct record {
+        // the time of the oldest transition in the ring
+        std::uint64_t base = 0;
+        // the time of the newest transition, which the next delta is taken from
+        std::uint64_t latest = 0;
+        std::array<std::uint32_t, ring_size> ring {};
+        std::uint8_t head = 0;
+        std::uint8_t count = 0;
+        bool online = false;
+
+        std::uint32_t joins = 0;
+        std::uint32_t leaves = 0;
+
+        std::uint64_t last_heartbeat = 0;
+        std::uint64_t gap_count = 0;
+        std::uint64_t gap_total_ms = 0;
+        std::uint32_t gap_max_ms = 0;
+        std::array<std::uint32_t, gap_buckets> gap_histogram {};
+
+        link_quality link;
+    };
+
+    history_limits limits;
+    std::unordered_map<std::string, record> records;
+
+    void evict ();
+
+public:
+    explicit participant_history (history_limits limits = {}) : limits (limits) {}
+
+    void set_limits (const history_limits new_limits) {
+        limits = new_limits;
+    }
+
+    void transition (const std::string &id, bool online, std::uint64_t now);
+    void heartbeat (const std::string &id, std::uint64_t now, std::optional<std::uint64_t> sequence = std::nullopt);
+    void prune (std::uint64_t now);
+
+    [[nodiscard]] std::size_t size () const {
+        return records.size ();
+    }
+
+    [[nodiscard]] json describe (const std::string &id) const;
+    [[nodiscard]] json summary () const;
+    [[nodiscard]] json link_summary () const;
+};
+
+#endif //HOSTMON_HISTORY_H
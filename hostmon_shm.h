@@ -0,0 +1,256 @@
+#ifndef HOSTMON_SHM_H
+#define HOSTMON_SHM_H
+
+/*
+ * Header-only reader for the membership table hostmon publishes in shared
+ * memory. Once the segment is mapped, reading it makes no system calls and
+ * takes no locks: every record is guarded by its own sequence lock, and a
+ * global generation counter tells readers whether anything changed at all.
+ *
+ * The layout is shared with the writer (shm_table.cpp), so changing anything
+ * here means bumping HOSTMON_SHM_LAYOUT.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+constexpr std::uint32_t HOSTMON_SHM_MAGIC = 0x484d5348; // "HSMH"
+constexpr std::uint32_t HOSTMON_SHM_LAYOUT = 1;
+
+constexpr std::size_t HOSTMON_SHM_ID_SIZE = 64;
+constexpr std::size_t HOSTMON_SHM_ADDRESS_SIZE = 48;
+constexpr std::size_t HOSTMON_SHM_ARCHITECTURE_SIZE = 32;
+constexpr std::size_t HOSTMON_SHM_SERVICES = 8;
+constexpr std::size_t HOSTMON_SHM_SERVICE_SIZE = 32;
+
+// flags in a record
+constexpr std::uint32_t HOSTMON_SHM_IN_USE = 1;
+constexpr std::uint32_t HOSTMON_SHM_ACTIVE = 2;
+
+// attempts at a consistent copy of one record before a read gives up, as it
+// must if the writer died halfway through a change
+constexpr unsigned int HOSTMON_SHM_READ_ATTEMPTS = 1u << 16;
+
+enum hostmon_shm_status {
+    HOSTMON_SHM_OK = 0,
+    HOSTMON_SHM_NOT_FOUND = 1,
+    // a record stayed mid-change for every attempt; try again, or reopen if hostmon restarted
+    HOSTMON_SHM_UNAVAILABLE = 2
+};
+
+struct hostmon_shm_header {
+    std::uint32_t magic;
+    std::uint32_t layout;
+    std::uint32_t capacity;
+    std::uint32_t record_size;
+
+    // bumped after every record change
+    std::atomic<std::uint64_t> generation;
+    // the membership version the table reflects
+    std::atomic<std::uint64_t> version;
+    // slots at or beyond this index have never been used
+    std::atomic<std::uint32_t> high_water;
+    std::uint32_t reserved;
+};
+
+// strings are NUL terminated and truncated to fit
+struct hostmon_shm_record {
+    // odd while the writer is changing the record
+    std::atomic<std::uint32_t> sequence;
+    std::uint32_t flags;
+
+    std::uint64_t first_seen;
+
+    char id[HOSTMON_SHM_ID_SIZE];
+    char address[HOSTMON_SHM_ADDRESS_SIZE];
+    char architecture[HOSTMON_SHM_ARCHITECTURE_SIZE];
+
+    std::uint32_t service_count;
+    char services[HOSTMON_SHM_SERVICES][HOSTMON_SHM_SERVICE_SIZE];
+};
+
+static_assert (std::atomic<std::uint32_t>::is_always_lock_free && std::atomic<std::uint64_t>::is_always_lock_free,
+               "shared memory atomics must be lock free");
+
+inline std::size_t hostmon_shm_size (const std::uint32_t capacity) {
+    return sizeof (hostmon_shm_header) + capacity * sizeof (hostmon_shm_record);
+}
+
+/**
+ * @brief One participant as read from shared memory.
+ */
+struct hostmon_shm_participant {
+    std::string id;
+    std::string address;
+    std::string architecture;
+    std::vector<std::string> provides;
+    std::uint64_t first_seen = 0;
+    bool active = false;
+};
+
+/**
+ * @class hostmon_shm_reader
+ * @brief Maps hostmon's shared membership table read-only and reads it without locks.
+ */
+class hostmon_shm_reader {
+    const void *base = MAP_FAILED;
+    std::size_t length = 0;
+
+    [[nodiscard]] const hostmon_shm_header *header () const {
+        return static_cast<const hostmon_shm_header *> (base);
+    }
+
+    [[nodiscard]] const hostmon_shm_record *records () const {
+        return reinterpret_cast<const hostmon_shm_record *> (header () + 1);
+    }
+
+    static std::string field (const char *text, const std::size_t size) {
+        return {text, strnlen (text, size)};
+    }
+
+    // copy one record consistently; HOSTMON_SHM_NOT_FOUND if the slot is unused
+    hostmon_shm_status read_record (const hostmon_shm_record &r, hostmon_shm_participant &out) const {
+        hostmon_shm_record copy;
+
+        bool consistent = false;
+        for (unsigned int attempt = 0; !consistent && attempt < HOSTMON_SHM_READ_ATTEMPTS; attempt++) {
+            const auto before = r.sequence.load (std::memory_order_acquire);
+            if (before & 1) {
+                continue;
+            }
+
+            memcpy (reinterpret_cast<char *> (&copy) + sizeof (copy.sequence),
+                    reinterpret_cast<const char *> (&r) + sizeof (r.sequence),
+                    sizeof (r) - sizeof (r.sequence));
+
+            std::atomic_thread_fence (std::memory_order_acquire);
+            consistent = r.sequence.load (std::memory_order_relaxed) == before;
+        }
+
+        if (!consistent) {
+            return HOSTMON_SHM_UNAVAILABLE;
+        }
+        if (!(copy.flags & HOSTMON_SHM_IN_USE)) {
+            return HOSTMON_SHM_NOT_FOUND;
+        }
+
+        out.id = field (copy.id, sizeof (copy.id));
+        out.address = field (copy.address, sizeof (copy.address));
+        out.architecture = field (copy.architecture, sizeof (copy.architecture));
+        out.first_seen = copy.first_seen;
+        out.active = copy.flags & HOSTMON_SHM_ACTIVE;
+
+        out.provides.clear ();
+        for (std::uint32_t i = 0; i < copy.service_count && i < HOSTMON_SHM_SERVICES; i++) {
+            out.provides.push_back (field (copy.services[i], sizeof (copy.services[i])));
+        }
+
+        return HOSTMON_SHM_OK;
+    }
+
+public:
+    /**
+     * @brief Map the table published under a shm_open() name such as "/hostmon".
+     *
+     * @throws std::runtime_error If the segment is missing or has another layout.
+     */
+    explicit hostmon_shm_reader (const std::string &name) {
+        const int fd = shm_open (name.c_str (), O_RDONLY, 0);
+        if (fd < 0) {
+            throw std::runtime_error ("Cannot open shared membership table " + name);
+        }
+
+        struct stat st = {};
+        if (fstat (fd, &st) < 0 || static_cast<std::size_t> (st.st_size) < sizeof (hostmon_shm_header)) {
+            close (fd);
+            throw std::runtime_error ("Shared membership table " + name + " is not initialised");
+        }
+
+        length = st.st_size;
+        base = mmap (nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        close (fd);
+
+        if (base == MAP_FAILED) {
+            throw std::runtime_error ("Cannot map shared membership table " + name);
+        }
+
+        if (header ()->magic != HOSTMON_SHM_MAGIC || header ()->layout != HOSTMON_SHM_LAYOUT
+            || header ()->record_size != sizeof (hostmon_shm_record)
+            || length < hostmon_shm_size (header ()->capacity)) {
+            munmap (const_cast<void *> (base), length);
+            throw std::runtime_error ("Shared membership table " + name + " has an unknown layout");
+        }
+    }
+
+    ~hostmon_shm_reader () {
+        if (base != MAP_FAILED) {
+            munmap (const_cast<void *> (base), length);
+        }
+    }
+
+    hostmon_shm_reader (const hostmon_shm_reader &) = delete;
+    hostmon_shm_reader &operator= (const hostmon_shm_reader &) = delete;
+
+    // changes whenever any record does; compare against a previous value to skip unchanged reads
+    [[nodiscard]] std::uint64_t generation () const {
+        return header ()->generation.load (std::memory_order_acquire);
+    }
+
+    [[nodiscard]] std::uint64_t version () const {
+        return header ()->version.load (std::memory_order_acquire);
+    }
+
+    /**
+     * @brief Every participant in the table.
+     *
+     * Each record is consistent; to get a view consistent across records,
+     * repeat the read until generation() is the same before and after.
+     *
+     * @return HOSTMON_SHM_OK, or HOSTMON_SHM_UNAVAILABLE with `out` incomplete.
+     */
+    hostmon_shm_status read_all (std::vector<hostmon_shm_participant> &out) const {
+        out.clear ();
+        const auto used = header ()->high_water.load (std::memory_order_acquire);
+
+        hostmon_shm_participant p;
+        for (std::uint32_t i = 0; i < used; i++) {
+            const auto status = read_record (records ()[i], p);
+            if (status == HOSTMON_SHM_UNAVAILABLE) {
+                return status;
+            }
+            if (status == HOSTMON_SHM_OK) {
+                out.push_back (p);
+            }
+        }
+
+        return HOSTMON_SHM_OK;
+    }
+
+    /**
+     * @brief The participant with the given id.
+     *
+     * @return HOSTMON_SHM_OK with the participant in `out`, HOSTMON_SHM_NOT_FOUND or HOSTMON_SHM_UNAVAILABLE.
+     */
+    hostmon_shm_status find (const std::string &id, hostmon_shm_participant &out) const {
+        const auto used = header ()->high_water.load (std::memory_order_acquire);
+
+        for (std::uint32_t i = 0; i < used; i++) {
+            const auto status = read_record (records ()[i], out);
+            if (status == HOSTMON_SHM_UNAVAILABLE || (status == HOSTMON_SHM_OK && out.id == id)) {
+                return status;
+            }
+        }
+
+        return HOSTMON_SHM_NOT_FOUND;
+    }
+};
+
+#endif //HOSTMON_SHM_H
@@ -0,0 +1,587 @@
+#include "journal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "query.h"
+#include "utilities.h"
+
+namespace fs = std::filesystem;
+
+static constexpr char journal_magic[4] = {'H', 'M', 'J', '1'};
+
+/**
+ * @brief The sequence number of a journal-<sequence>.seg file name, or 0 for anything else.
+ */
+static std::uint64_t segment_sequence (const fs::path &path) {
+    const auto name = path.filename ().string ();
+    if (path.extension () != ".seg" || !name.starts_with ("journal-")) {
+        return 0;
+    }
+
+    try {
+        return std::stoull (name.substr (8, name.size () - 12));
+    } catch (const std::exception &) {
+        return 0;
+    }
+}
+
+/**
+ * @brief The segment files of a journal directory, oldest first.
+ */
+static std::vector<std::pair<std::uint64_t, fs::path>> list_segments (const std::string &directory) {
+    std::vector<std::pair<std::uint64_t, fs::path>> found;
+
+    std::error_code error;
+    for (const auto &file: fs::directory_iterator (directory, error)) {
+        if (const auto sequence = segment_sequence (file.path ()); sequence != 0) {
+            found.emplace_back (sequence, file.path ());
+        }
+    }
+
+    std::sort (found.begin (), found.end ());
+    return found;
+}
+
+/**
+ * @brief Read journal settings from the "journal" object of config.json.
+ *
+ * Recognises "directory" (no journal when absent), "segment_mb", "segments",
+ * "commit_ms" and "sync".
+ */
+journal_settings journal_from_configuration (const json &settings) {
+    journal_settings result;
+    if (!settings.is_object ()) {
+        return result;
+    }
+
+    result.directory = settings.value ("directory", "");
+    result.segment_bytes = settings.value ("segment_mb", result.segment_bytes >> 20) << 20;
+    result.max_segments = settings.value ("segments", result.max_segments);
+    result.commit_interval = std::chrono::milliseconds (settings.value ("commit_ms", result.commit_interval.count ()));
+    result.sync = settings.value ("sync", result.sync);
+
+    return result;
+}
+
+/**
+ * @brief Open a new segment after the newest one in the directory and start journaling the table.
+ *
+ * Participants already in the table are taken as present without being
+ * journaled, so their next change is recorded as a change, not an addition.
+ *
+ * @throws std::runtime_error If the directory or the first segment cannot be created.
+ */
+journal_writer::journal_writer (membership &table, journal_settings settings)
+    : table (table), settings (std::move (settings)), writer_start (get_timestamp ()) {
+
+    std::error_code error;
+    fs::create_directories (this->settings.directory, error);
+    if (error) {
+        throw std::runtime_error ("Cannot create journal directory " + this->settings.directory + ": " + error.message ());
+    }
+
+    if (const auto existing = list_segments (this->settings.directory); !existing.empty ()) {
+        sequence = existing.back ().first;
+    }
+    open_segment ();
+
+    // as with shm_publisher, changes already in the snapshot are skipped when they reach the listener
+    std::lock_guard lock (queue_mutex);
+    subscription = table.subscribe ([this] (const membership_change &change) {
+        {
+            std::lock_guard guard (queue_mutex);
+            if (failed || pending.size () >= max_pending) {
+                dropped++;
+                return;
+            }
+            pending.push_back (change);
+        }
+        queue_changed.notify_one ();
+    });
+
+    const auto snapshot = table.snapshot ();
+    for (const auto &p: snapshot->participants) {
+        present.insert (p->get_id ());
+    }
+    skip_through = snapshot->version;
+
+    worker = std::thread (&journal_writer::run, this);
+}
+
+journal_writer::~journal_writer () {
+    table.unsubscribe (subscription);
+
+    {
+        std::lock_guard lock (queue_mutex);
+        stopping = true;
+    }
+    queue_changed.notify_one ();
+    worker.join ();
+
+    seal_segment ();
+}
+
+/**
+ * @brief The number of changes dropped because the worker fell too far behind or the journal failed.
+ */
+std::uint64_t journal_writer::get_dropped () {
+    std::lock_guard lock (queue_mutex);
+    return dropped;
+}
+
+/**
+ * @brief Whether journaling stopped because the journal could not be written.
+ */
+bool journal_writer::has_failed () {
+    std::lock_guard lock (queue_mutex);
+    return failed;
+}
+
+std::string journal_writer::segment_path (const std::uint64_t number, const char *extension) const {
+    char name[40];
+    snprintf (name, sizeof (name), "journal-%010llu%s", static_cast<unsigned long long> (number), extension);
+    return (fs::path (settings.directory) / name).string ();
+}
+
+/**
+ * @brief Create, size and map the next segment and its index.
+ *
+ * The segment's blocks are allocated up front, so a full filesystem fails
+ * here, as an exception, instead of as a SIGBUS on a later store into the
+ * mapping.
+ *
+ * @throws std::runtime_error If the files cannot be created, allocated or mapped.
+ */
+void journal_writer::open_segment () {
+    sequence++;
+    const auto path = segment_path (sequence, ".seg");
+
+    segment_fd = open (path.c_str (), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (segment_fd < 0) {
+        throw std::runtime_error ("Cannot create journal segment " + path + ": " + strerror (errno));
+    }
+
+    if (const int error = posix_fallocate (segment_fd, 0, static_cast<off_t> (settings.segment_bytes)); error != 0) {
+        close (segment_fd);
+        unlink (path.c_str ());
+        throw std::runtime_error ("Cannot allocate journal segment " + path + ": " + strerror (error));
+    }
+
+    void *mapped = mmap (nullptr, settings.segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+    if (mapped == MAP_FAILED) {
+        close (segment_fd);
+        throw std::runtime_error ("Cannot map journal segment " + path + ": " + strerror (errno));
+    }
+    base = static_cast<char *> (mapped);
+
+    const auto index_path = segment_path (sequence, ".idx");
+    index_fd = open (index_path.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (index_fd < 0) {
+        munmap (base, settings.segment_bytes);
+        base = nullptr;
+        close (segment_fd);
+        segment_fd = -1;
+        throw std::runtime_error ("Cannot create journal index " + index_path + ": " + strerror (errno));
+    }
+
+    journal_segment_header header = {};
+    memcpy (header.magic, journal_magic, sizeof (header.magic));
+    header.layout = journal_layout;
+    header.sequence = sequence;
+    header.writer_start = writer_start;
+    memcpy (base, &header, sizeof (header));
+
+    used = sizeof (header);
+    synced = 0;
+    records = 0;
+
+    remove_old_segments ();
+}
+
+/**
+ * @brief Commit and unmap the current segment.
+ *
+ * The segment keeps its full size so that readers mapping it while it was
+ * being written never touch pages past the end of the file.
+ */
+void journal_writer::seal_segment () {
+    if (base == nullptr) {
+        return;
+    }
+
+    commit ();
+    munmap (base, settings.segment_bytes);
+    base = nullptr;
+
+    close (segment_fd);
+    close (index_fd);
+    segment_fd = index_fd = -1;
+}
+
+/**
+ * @brief Delete the oldest segments and their indexes beyond max_segments.
+ */
+void journal_writer::remove_old_segments () const {
+    auto existing = list_segments (settings.directory);
+    if (settings.max_segments == 0 || existing.size () <= settings.max_segments) {
+        return;
+    }
+
+    existing.resize (existing.size () - settings.max_segments);
+    for (const auto &[number, path]: existing) {
+        std::error_code error;
+        fs::remove (path, error);
+        fs::remove (segment_path (number, ".idx"), error);
+    }
+}
+
+/**
+ * @brief Encode one change into the current segment, rotating when it is full.
+ */
+void journal_writer::append (const membership_change &change) {
+    const auto id = change.subject->get_id ();
+
+    JournalEvent event;
+    if (change.kind == CHANGE_LEFT) {
+        event = JOURNAL_EXPIRED;
+        present.erase (id);
+    } else if (!present.insert (id).second || change.kind == CHANGE_UPDATED) {
+        event = JOURNAL_CHANGED;
+    } else {
+        event = JOURNAL_ADDED;
+    }
+
+    const std::uint64_t timestamp = change.at;
+    const std::uint8_t kind = event;
+
+    encoded.assign (2 * sizeof (std::uint32_t), '\0');
+    encoded.append (reinterpret_cast<const char *> (&timestamp), sizeof (timestamp));
+    encoded.append (reinterpret_cast<const char *> (&change.version), sizeof (change.version));
+    encoded.append (reinterpret_cast<const char *> (&kind), sizeof (kind));
+    encoded.append (3, '\0');
+    append_participant_record (encoded, *change.subject);
+
+    const std::uint32_t payload = encoded.size () - 2 * sizeof (std::uint32_t);
+    const std::uint32_t checksum = crc32 (encoded.data () + 2 * sizeof (std::uint32_t), payload);
+    memcpy (encoded.data (), &payload, sizeof (payload));
+    memcpy (encoded.data () + sizeof (payload), &checksum, sizeof (checksum));
+
+    if (encoded.size () + sizeof (journal_segment_header) > settings.segment_bytes) {
+        std::cerr << "Journal record for " << id << " is larger than a segment; skipped\n";
+        return;
+    }
+
+    if (used + encoded.size () > settings.segment_bytes) {
+        seal_segment ();
+        open_segment ();
+    }
+
+    if (records == 0) {
+        memcpy (base + offsetof (journal_segment_header, first_timestamp), &timestamp, sizeof (timestamp));
+    }
+
+    if (records % journal_index_stride == 0) {
+        const journal_index_entry entry = {timestamp, static_cast<std::uint32_t> (used), 0};
+        if (write (index_fd, &entry, sizeof (entry)) < 0) {
+            perror ("Writing journal index error");
+        }
+    }
+
+    memcpy (base + used, encoded.data (), encoded.size ());
+    used += encoded.size ();
+    records++;
+}
+
+/**
+ * @brief Make everything appended since the last commit durable, with one msync() for the group.
+ */
+void journal_writer::commit () {
+    if (used == synced) {
+        return;
+    }
+
+    // msync wants a page aligned start
+    const auto page = static_cast<std::size_t> (sysconf (_SC_PAGESIZE));
+    const auto start = synced / page * page;
+
+    if (msync (base + start, used - start, settings.sync ? MS_SYNC : MS_ASYNC) < 0) {
+        perror ("Committing journal error");
+    }
+    if (settings.sync && fdatasync (index_fd) < 0) {
+        perror ("Committing journal index error");
+    }
+
+    synced = used;
+}
+
+/**
+ * @brief Append queued changes in groups until the writer is destroyed or the journal fails.
+ *
+ * A failure to rotate (the next segment cannot be created, allocated or
+ * mapped) ends journaling rather than the process: what was queued is
+ * counted as dropped, and so is every change after it.
+ */
+void journal_writer::run () {
+    try {
+        write_batches ();
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what () << "; journaling stopped\n";
+
+        std::lock_guard lock (queue_mutex);
+        failed = true;
+        dropped += pending.size ();
+        pending.clear ();
+    }
+}
+
+/**
+ * @brief The worker's loop: append queued changes in groups until the writer is destroyed.
+ *
+ * @throws std::runtime_error If a segment cannot be opened on rotation.
+ */
+void journal_writer::write_batches () {
+    std::vector<membership_change> batch;
+
+    while (true) {
+        {
+            std::unique_lock lock (queue_mutex);
+            queue_changed.wait (lock, [this] { return stopping || !pending.empty (); });
+
+            // give a burst a moment to gather so it is committed as one group
+            if (!stopping && pending.size () < max_pending / 2) {
+                queue_changed.wait_for (lock, settings.commit_interval, [this] { return stopping; });
+            }
+
+            batch.swap (pending);
+            if (batch.empty () && stopping) {
+                return;
+            }
+        }
+
+        for (std::size_t i = 0; i < batch.size (); i++) {
+            if (batch[i].version <= skip_through) {
+                continue;
+            }
+
+            try {
+                append (batch[i]);
+            } catch (const std::exception &) {
+                std::lock_guard lock (queue_mutex);
+                dropped += batch.size () - i;
+                throw;
+            }
+        }
+        batch.clear ();
+
+        commit ();
+    }
+}
+
+/**
+ * @brief Open a journal directory for reading, positioned at its first record.
+ */
+journal_reader::journal_reader (std::string directory) : directory (std::move (directory)) {
+    for (const auto &[sequence, path]: list_segments (this->directory)) {
+        segments.push_back ({sequence, path.string ()});
+    }
+    rewind ();
+}
+
+journal_reader::~journal_reader () {
+    unmap_segment ();
+}
+
+void journal_reader::unmap_segment () {
+    if (base != nullptr) {
+        munmap (const_cast<char *> (base), length);
+        base = nullptr;
+    }
+    length = 0;
+}
+
+/**
+ * @brief Map a segment and position at its first record.
+ *
+ * @return false when the segment cannot be read or is not a journal segment.
+ */
+bool journal_reader::map_segment (const std::size_t index) {
+    unmap_segment ();
+    current = index;
+    offset = 0;
+
+    if (index >= segments.size ()) {
+        return false;
+    }
+
+    const int fd = open (segments[index].path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info = {};
+    if (fstat (fd, &info) < 0 || static_cast<std::size_t> (info.st_size) < sizeof (journal_segment_header)) {
+        close (fd);
+        return false;
+    }
+
+    void *mapped = mmap (nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    base = static_cast<const char *> (mapped);
+    length = info.st_size;
+
+    journal_segment_header header;
+    memcpy (&header, base, sizeof (header));
+    if (memcmp (header.magic, journal_magic, sizeof (journal_magic)) != 0 || header.layout != journal_layout) {
+        unmap_segment ();
+        return false;
+    }
+
+    writer_start = header.writer_start;
+    offset = sizeof (header);
+    return true;
+}
+
+void journal_reader::rewind () {
+    map_segment (0);
+}
+
+/**
+ * @brief Position the reader at the first record at or after a time.
+ *
+ * @param timestamp Milliseconds since the epoch.
+ */
+void journal_reader::seek (const std::uint64_t timestamp) {
+    // the last segment whose first record is not after the time
+    std::size_t chosen = 0;
+    for (std::size_t i = 0; i < segments.size (); i++) {
+        if (!map_segment (i)) {
+            continue;
+        }
+
+        std::uint64_t first;
+        memcpy (&first, base + offsetof (journal_segment_header, first_timestamp), sizeof (first));
+        if (first != 0 && first > timestamp) {
+            break;
+        }
+        chosen = i;
+    }
+
+    if (!map_segment (chosen)) {
+        return;
+    }
+
+    // jump to the last indexed record before the time
+    auto index_path = fs::path (segments[chosen].path).replace_extension (".idx");
+    if (const int fd = open (index_path.c_str (), O_RDONLY | O_CLOEXEC); fd >= 0) {
+        std::vector<journal_index_entry> index;
+        journal_index_entry entry;
+        while (read (fd, &entry, sizeof (entry)) == sizeof (entry)) {
+            index.push_back (entry);
+        }
+        close (fd);
+
+        const auto after = std::upper_bound (index.begin (), index.end (), timestamp,
+                                             [] (const std::uint64_t t, const journal_index_entry &e) {
+                                                 return t <= e.timestamp;
+                                             });
+        if (after != index.begin () && std::prev (after)->offset < length) {
+            offset = std::prev (after)->offset;
+        }
+    }
+
+    // then scan to the first record at or after it
+    while (true) {
+        const auto position = std::make_pair (current, offset);
+
+        journal_entry entry;
+        if (!next (entry)) {
+            return;
+        }
+        if (entry.timestamp >= timestamp) {
+            if (current != position.first) {
+                map_segment (position.first);
+            }
+            offset = position.second;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Decode the record at the current offset, if there is a valid one.
+ */
+bool journal_reader::read_record (journal_entry &entry) {
+    if (base == nullptr || offset + 2 * sizeof (std::uint32_t) > length) {
+        return false;
+    }
+
+    std::uint32_t payload;
+    std::uint32_t checksum;
+    memcpy (&payload, base + offset, sizeof (payload));
+    memcpy (&checksum, base + offset + sizeof (payload), sizeof (checksum));
+
+    const auto start = offset + 2 * sizeof (std::uint32_t);
+    if (payload == 0 || start + payload > length || crc32 (base + start, payload) != checksum) {
+        return false;
+    }
+
+    const std::string_view record (base + start, payload);
+    std::size_t at = 0;
+
+    memcpy (&entry.timestamp, record.data (), sizeof (entry.timestamp));
+    memcpy (&entry.version, record.data () + 8, sizeof (entry.version));
+    entry.event = static_cast<JournalEvent> (static_cast<std::uint8_t> (record[16]));
+    entry.writer_start = writer_start;
+    at = 20;
+
+    try {
+        entry.subject = extract_participant_record (record, at);
+    } catch (const std::runtime_error &) {
+        return false;
+    }
+
+    offset = start + payload;
+    return true;
+}
+
+/**
+ * @brief Read the next record, moving on to later segments as each one ends.
+ *
+ * A segment ends at its zero filled tail, at the end of the file, or at a
+ * record torn by a crash.
+ *
+ * @return false when there are no more records.
+ */
+bool journal_reader::next (journal_entry &entry) {
+    while (true) {
+        if (read_record (entry)) {
+            return true;
+        }
+        if (current + 1 >= segments.size ()) {
+            return false;
+        }
+
+        std::size_t following = current + 1;
+        while (following < segments.size () && !map_segment (following)) {
+            following++;
+        }
+        if (following >= segments.size ()) {
+            return false;
+        }
+    }
+}
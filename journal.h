@@ -0,0 +1,188 @@
+#ifndef HOSTMON_JOURNAL_H
+#define HOSTMON_JOURNAL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "monitor.h"
+
+/*
+ * The membership journal: a directory of fixed size segment files, written
+ * through a shared mapping and named journal-<sequence>.seg, with a sparse
+ * time index beside each one in journal-<sequence>.idx. All integers are in
+ * host byte order.
+ *
+ * segment: [header][record]... then zeros to the fixed segment size
+ * header:  [4 byte magic "HMJ1"][u32 layout][u64 sequence][u64 writer start ms][u64 first record ms]
+ * record:  [u32 payload length][u32 CRC-32 of payload][payload]
+ * payload: [u64 timestamp ms][u64 version][u8 event][u8 reserved][u16 reserved]
+ *          [participant record as in the query protocol]
+ * index:   [u64 timestamp ms][u32 record offset][u32 reserved], one per
+ *          journal_index_stride records
+ *
+ * A record is valid only if its CRC matches, so a reader stops cleanly at a
+ * record torn by a crash. Versions restart with every writer, which is why
+ * segments also carry the time their writer started.
+ */
+
+enum JournalEvent : std::uint8_t {
+    JOURNAL_ADDED = 1,
+    JOURNAL_EXPIRED = 2,
+    JOURNAL_CHANGED = 3
+};
+
+constexpr std::uint32_t journal_layout = 1;
+constexpr std::size_t journal_index_stride = 64;
+
+struct journal_segment_header {
+    char magic[4];
+    std::uint32_t layout;
+    std::uint64_t sequence;
+    std::uint64_t writer_start;
+    std::uint64_t first_timestamp;
+};
+
+struct journal_index_entry {
+    std::uint64_t timestamp;
+    std::uint32_t offset;
+    std::uint32_t reserved;
+};
+
+/**
+ * @brief One decoded journal record.
+ */
+struct journal_entry {
+    std::uint64_t timestamp = 0;
+    std::uint64_t version = 0;
+    JournalEvent event = JOURNAL_ADDED;
+    // the writer start time of the segment the record came from
+    std::uint64_t writer_start = 0;
+    participant subject;
+};
+
+/**
+ * @brief Where and how the journal is written.
+ */
+struct journal_settings {
+    std::string directory;
+    std::size_t segment_bytes = 16 * 1024 * 1024;
+    // segments beyond this many are deleted, oldest first
+    std::size_t max_segments = 8;
+    // how long appends may wait to be committed together
+    std::chrono::milliseconds commit_interval {50};
+    // msync(MS_SYNC) each commit; otherwise the kernel writes back in its own time
+    bool sync = true;
+};
+
+journal_settings journal_from_configuration (const json &settings);
+
+/**
+ * @class journal_writer
+ * @brief Appends every membership change to the journal.
+ *
+ * The membership listener only queues the change, so the receive and expiry
+ * paths never wait for the disk. A worker thread takes everything queued,
+ * appends it and commits the whole group with one msync(). If the worker falls
+ * more than max_pending changes behind, further changes are counted and
+ * dropped rather than allowed to grow the queue without bound. If the worker
+ * cannot write at all, say because the disk is full, journaling stops and
+ * every later change is counted as dropped; the monitor carries on.
+ */
+class journal_writer {
+    static constexpr std::size_t max_pending = 65536;
+
+    membership &table;
+    journal_settings settings;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_changed;
+    std::vector<membership_change> pending;
+    std::uint64_t dropped = 0;
+    bool stopping = false;
+    // set once the worker has given up on the journal
+    bool failed = false;
+
+    // only touched by the worker
+    std::set<std::string> present;
+    std::uint64_t writer_start;
+    std::uint64_t sequence = 0;
+    char *base = nullptr;
+    std::size_t used = 0;
+    std::size_t synced = 0;
+    std::size_t records = 0;
+    int segment_fd = -1;
+    int index_fd = -1;
+    std::string encoded;
+
+    std::uint64_t skip_through = 0;
+    int subscription;
+    std::thread worker;
+
+    [[nodiscard]] std::string segment_path (std::uint64_t number, const char *extension) const;
+    void open_segment ();
+    void seal_segment ();
+    void remove_old_segments () const;
+    void append (const membership_change &change);
+    void commit ();
+    void write_batches ();
+    void run ();
+
+public:
+    journal_writer (membership &table, journal_settings settings);
+    ~journal_writer ();
+
+    journal_writer (const journal_writer &) = delete;
+    journal_writer &operator= (const journal_writer &) = delete;
+
+    [[nodiscard]] std::uint64_t get_dropped ();
+    [[nodiscard]] bool has_failed ();
+};
+
+/**
+ * @class journal_reader
+ * @brief Replays a journal directory in order, straight from mapped segments.
+ *
+ * seek() picks the segment by the time of its first record and the position
+ * within it from the segment's index, so only a few records are scanned to
+ * find a starting time. The reader sees whatever has been committed when a
+ * segment is mapped; it is safe to run against a journal that is being written.
+ */
+class journal_reader {
+    struct segment {
+        std::uint64_t sequence;
+        std::string path;
+    };
+
+    std::string directory;
+    std::vector<segment> segments;
+
+    std::size_t current = 0;
+    const char *base = nullptr;
+    std::size_t length = 0;
+    std::size_t offset = 0;
+    std::uint64_t writer_start = 0;
+
+    bool map_segment (std::size_t index);
+    void unmap_segment ();
+    bool read_record (journal_entry &entry);
+
+public:
+    explicit journal_reader (std::string directory);
+    ~journal_reader ();
+
+    journal_reader (const journal_reader &) = delete;
+    journal_reader &operator= (const journal_reader &) = delete;
+
+    void rewind ();
+    void seek (std::uint64_t timestamp);
+    bool next (journal_entry &entry);
+};
+
+#endif //HOSTMON_JOURNAL_H
@@ -0,0 +1,156 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+#include "journal.h"
+
+/**
+ * @brief Print the command line options understood by hostmon-journal.
+ */
+void usage () {
+    std::cerr << "usage: hostmon-journal [options] DIRECTORY\n"
+              << "  --since MS     start at the first record at or after this time (ms since the epoch)\n"
+              << "  --last S       start this many seconds before now\n"
+              << "  --until MS     stop before the first record after this time\n"
+              << "  --id ID        only records about this participant\n"
+              << "  --json         print one JSON object per record\n"
+              << "  --count        print only the number of matching records and the replay rate\n";
+}
+
+static const char *event_name (const JournalEvent event) {
+    switch (event) {
+        case JOURNAL_ADDED:
+            return "online";
+        case JOURNAL_EXPIRED:
+            return "offline";
+        case JOURNAL_CHANGED:
+            return "changed";
+    }
+    return "unknown";
+}
+
+/**
+ * @file journal_tool.cpp
+ * @brief Replays a membership journal, optionally from a point in time.
+ *
+ * Lines are printed in the same "HH:MM:SS.mmm: id online" form the daemon
+ * uses, followed by the address, architecture and services.
+ */
+int main (const int argc, char *argv[]) {
+    std::string directory;
+    std::uint64_t since = 0;
+    std::uint64_t until = UINT64_MAX;
+    std::string only;
+    bool as_json = false;
+    bool count_only = false;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+
+            if (arg == "--json") {
+                as_json = true;
+                continue;
+            }
+            if (arg == "--count") {
+                count_only = true;
+                continue;
+            }
+            if (!arg.starts_with ("--")) {
+                directory = arg;
+                continue;
+            }
+
+            if (i + 1 >= argc) {
+                usage ();
+                return 1;
+            }
+            const std::string value = argv[++i];
+
+            if (arg == "--since") {
+                since = std::stoull (value);
+            } else if (arg == "--last") {
+                since = get_timestamp () - std::stoull (value) * 1000;
+            } else if (arg == "--until") {
+                until = std::stoull (value);
+            } else if (arg == "--id") {
+                only = value;
+            } else {
+                usage ();
+                return 1;
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Bad option value: " << e.what () << "\n";
+        return 1;
+    }
+
+    if (directory.empty ()) {
+        usage ();
+        return 1;
+    }
+
+    const auto started = std::chrono::steady_clock::now ();
+
+    journal_reader reader (directory);
+    if (since != 0) {
+        reader.seek (since);
+    }
+
+    std::uint64_t matched = 0;
+    std::uint64_t read = 0;
+    journal_entry entry;
+
+    while (reader.next (entry)) {
+        read++;
+        if (entry.timestamp > until) {
+            break;
+        }
+        if (!only.empty () && entry.subject.get_id () != only) {
+            continue;
+        }
+        matched++;
+
+        if (count_only) {
+            continue;
+        }
+
+        const auto &p = entry.subject;
+
+        if (as_json) {
+            json j = {
+                {"timestamp", entry.timestamp},
+                {"version", entry.version},
+                {"writer_start", entry.writer_start},
+                {"event", event_name (entry.event)},
+                {"id", p.get_id ()},
+                {"address", p.get_address ()},
+                {"architecture", p.get_architecture ()},
+                {"active", p.is_active ()},
+                {"provides", p.get_provides ()}
+            };
+            std::cout << j.dump () << "\n";
+            continue;
+        }
+
+        print_timestamp (entry.timestamp);
+        std::cout << ": " << p.get_id () << " " << event_name (entry.event) << " "
+                  << p.get_address () << " " << p.get_architecture ();
+        for (const auto &service: p.get_provides ()) {
+            std::cout << " " << service;
+        }
+        std::cout << "\n";
+    }
+
+    if (count_only) {
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now () - started;
+        std::cout << matched << " records";
+        if (elapsed.count () > 0) {
+            std::cout << ", " << static_cast<std::uint64_t> (read / elapsed.count ()) << " records/s replayed";
+        }
+        std::cout << "\n";
+    }
+
+    return 0;
+}
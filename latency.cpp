@@ -0,0 +1,61 @@
+#include "latency.h"
+
+#include <algorithm>
+#include <bit>
+
+/**
+ * @brief Count one latency; negative ones, from clocks stepping, count as zero.
+ */
+void latency_histogram::record (const std::chrono::microseconds latency) {
+    const auto us = static_cast<std::uint64_t> (std::max<std::int64_t> (latency.count (), 0));
+
+    counts[std::min<std::size_t> (std::bit_width (us), buckets - 1)].fetch_add (1, std::memory_order_relaxed);
+    samples.fetch_add (1, std::memory_order_relaxed);
+    total_us.fetch_add (us, std::memory_order_relaxed);
+
+    auto seen = max_us.load (std::memory_order_relaxed);
+    while (us > seen && !max_us.compare_exchange_weak (seen, us, std::memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Count, mean, maximum, bucket-bound percentiles and the buckets themselves.
+ */
+json latency_histogram::describe () const {
+    std::array<std::uint64_t, buckets> snapshot {};
+    std::uint64_t count = 0;
+    for (std::size_t i = 0; i < buckets; i++) {
+        snapshot[i] = counts[i].load (std::memory_order_relaxed);
+        count += snapshot[i];
+    }
+
+    // the upper bound of the bucket holding the given fraction of samples
+    const auto percentile = [&] (const double fraction) -> std::uint64_t {
+        const auto wanted = static_cast<std::uint64_t> (fraction * static_cast<double> (count));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < buckets; i++) {
+            seen += snapshot[i];
+            if (seen > wanted) {
+                return i == 0 ? 0 : std::uint64_t (1) << i;
+            }
+        }
+        return max_us.load (std::memory_order_relaxed);
+    };
+
+    json histogram = json::array ();
+    for (const auto n: snapshot) {
+        histogram.push_back (n);
+    }
+
+    const auto total = samples.load (std::memory_order_relaxed);
+
+    return {
+        {"count", count},
+        {"mean_us", total == 0 ? 0.0 : static_cast<double> (total_us.load (std::memory_order_relaxed)) / total},
+        {"max_us", max_us.load (std::memory_order_relaxed)},
+        {"p50_us", percentile (0.5)},
+        {"p90_us", percentile (0.9)},
+        {"p99_us", percentile (0.99)},
+        {"log2_us", histogram}
+    };
+}
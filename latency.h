@@ -0,0 +1,39 @@
+#ifndef HOSTMON_LATENCY_H
+#define HOSTMON_LATENCY_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * @class latency_histogram
+ * @brief A power-of-two histogram of latencies in microseconds.
+ *
+ * One thread records while any other reads, so every counter is a relaxed
+ * atomic; a reader may see a sample in the count a moment before its bucket.
+ * Percentiles are the upper bound of the bucket they fall in, which is
+ * coarse but enough to tell a 5 µs wakeup from a 500 µs one.
+ */
+class latency_histogram {
+public:
+    // bucket i counts latencies of [2^(i-1), 2^i) µs; the last one everything longer
+    static constexpr std::size_t buckets = 24;
+
+private:
+    std::array<std::atomic<std::uint64_t>, buckets> counts {};
+    std::atomic<std::uint64_t> samples = 0;
+    std::atomic<std::uint64_t> total_us = 0;
+    std::atomic<std::uint64_t> max_us = 0;
+
+public:
+    void record (std::chrono::microseconds latency);
+
+    [[nodiscard]] json describe () const;
+};
+
+#endif //HOSTMON_LATENCY_H
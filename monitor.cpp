@@ -1,6 +1,8 @@
 
+#include <algorithm>
 #include <string>
 #include <chrono>
+#include <iomanip>
 #include <iostream>
 #include <map>
 #include <nlohmann/json.hpp>
@@ -10,9 +12,6 @@
 
 using json = nlohmann::json;
 
-std::map<std::string, json> participant_map;
-std::mutex participant_mutex;
-
 /**
  * @brief Prints the timestamp in hours, minutes, seconds and milliseconds
  *
@@ -56,95 +55,828 @@ void print_timestamp (std::uint64_t timestamp) {
               << std::setw (3) << std::setfill ('0') << milliseconds;
 }
 
+/**
+ * @brief Construct an empty participant table.
+ *
+ * @param clock Source of the current time in milliseconds.
+ * @param notify Sink for online/offline transitions, send_update() when empty.
+ * @param expiry_ms Age in milliseconds after which a silent participant is offline.
+ * @param verbose Whether transitions are also printed to stdout.
+ */
+membership::membership (clock_source clock, update_sink notify, const std::uint64_t expiry_ms, const bool verbose)
+    : clock (std::move (clock)),
+      notify (notify ? std::move (notify) : update_sink (send_update)),
+      expiry_ms (expiry_ms),
+      verbose (verbose),
+      published (std::make_shared<const membership_snapshot> ()) {
+}
+
+/**
+ * @brief Whether a datagram or peer entry is an object naming a participant by id, address and architecture.
+ *
+ * Everything else in a descriptor is optional and read defensively; these
+ * three are read as strings wherever a participant is handled, so anything
+ * lacking them is turned away before it reaches the table.
+ */
+bool is_descriptor (const json &j) {
+    if (!j.is_object ()) {
+        return false;
+    }
+
+    for (const char *field: {"id", "address", "architecture"}) {
+        if (const auto it = j.find (field); it == j.end () || !it->is_string ()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Build a participant record from an advertisement.
+ *
+ * @throws json::exception If `j` is not a descriptor (see is_descriptor()).
+ */
+participant participant_from_json (const json &j) {
+    participant p;
+
+    p.set_id (j.at ("id").get<std::string> ());
+    p.set_address (j.at ("address").get<std::string> ());
+    p.set_architecture (j.at ("architecture").get<std::string> ());
+    if (const auto it = j.find ("operating_system"); it != j.end () && it->is_string ()) {
+        p.set_operating_system (it->get<std::string> ());
+    }
+    if (const auto it = j.find ("release"); it != j.end () && it->is_string ()) {
+        p.set_release (it->get<std::string> ());
+    }
+    p.set_active (j.value ("active", false));
+    p.set_first_seen (j.value ("first_seen", std::uint64_t (0)));
+    p.set_last_seen (j.value ("last_seen", std::uint64_t (0)));
+
+    std::vector<std::string> provides;
+    if (j.contains ("provides") && j["provides"].is_array ()) {
+        for (const auto &service: j["provides"]) {
+            if (service.is_string ()) {
+                provides.push_back (service.get<std::string> ());
+            }
+        }
+    }
+    p.set_provides (provides);
+
+    std::map<std::string, int> priorities;
+    if (j.contains ("priorities") && j["priorities"].is_object ()) {
+        for (const auto &[service, priority]: j["priorities"].items ()) {
+            if (priority.is_number_integer ()) {
+                priorities[service] = priority.get<int> ();
+            }
+        }
+    }
+    p.set_priorities (priorities);
+
+    return p;
+}
+
+/**
+ * @brief The table entry form of a participant record; the inverse of participant_from_json().
+ */
+json participant_to_json (const participant &p) {
+    json j = {
+        {"id", p.get_id ()},
+        {"address", p.get_address ()},
+        {"architecture", p.get_architecture ()},
+        {"active", p.is_active ()},
+        {"provides", p.get_provides ()},
+        {"first_seen", p.get_first_seen ()},
+        {"last_seen", p.get_last_seen ()}
+    };
+    if (!p.get_operating_system ().empty ()) {
+        j["operating_system"] = p.get_operating_system ();
+    }
+    if (!p.get_release ().empty ()) {
+        j["release"] = p.get_release ();
+    }
+    if (!p.get_priorities ().empty ()) {
+        j["priorities"] = p.get_priorities ();
+    }
+    return j;
+}
+
+/**
+ * @brief Find a participant in the snapshot by id.
+ *
+ * @return The participant, or nullptr if it is not in the snapshot.
+ */
+std::shared_ptr<const participant> membership_snapshot::find (const std::string &id) const {
+    const auto it = std::lower_bound (participants.begin (), participants.end (), id,
+                                      [] (const auto &p, const std::string &key) { return p->get_id () < key; });
+
+    if (it == participants.end () || (*it)->get_id () != id) {
+        return nullptr;
+    }
+    return *it;
+}
+
+/**
+ * @brief The participants in the snapshot that provide a service, by priority and then id.
+ */
+const provider_list &membership_snapshot::providers_of (const std::string &service) const {
+    static const provider_list none;
+
+    const auto it = services.find (service);
+    return it == services.end () ? none : *it->second;
+}
+
+/**
+ * @brief Add a participant to, or remove it from, the provider lists of the services it provides.
+ *
+ * Each list touched is copied with the one participant inserted or erased,
+ * so snapshots still holding the old list are unaffected.
+ */
+static void index_provider (membership_snapshot &snapshot, const std::shared_ptr<const participant> &p,
+                            const bool add) {
+    for (const auto &service: p->get_provides ()) {
+        auto &slot = snapshot.services[service];
+        auto list = slot ? std::make_shared<provider_list> (*slot) : std::make_shared<provider_list> ();
+
+        const auto key = std::make_pair (p->get_priority (service), p->get_id ());
+        const auto at = std::lower_bound (list->begin (), list->end (), key, [&service] (const auto &q, const auto &k) {
+            return std::make_pair (q->get_priority (service), q->get_id ()) < k;
+        });
+
+        if (add) {
+            list->insert (at, p);
+        } else if (at != list->end () && (*at)->get_id () == p->get_id ()) {
+            list->erase (at);
+        }
+
+        if (list->empty ()) {
+            snapshot.services.erase (service);
+        } else {
+            slot = std::move (list);
+        }
+    }
+}
+
+/**
+ * @brief Publish a snapshot reflecting one change and append it to the change log.
+ *
+ * Called with participant_mutex held, which orders versions. Watchers are
+ * woken here; listeners are told by dispatch() once the lock is released.
+ *
+ * @param kind What happened to the participant.
+ * @param entry The participant's table entry.
+ * @param changed For CHANGE_UPDATED, the fields that differ.
+ * @return The change, or nothing when publishing is turned off.
+ */
+std::optional<membership_change> membership::publish_change (const ChangeKind kind, const json &entry,
+                                                             std::vector<std::string> changed) {
+    if (!publishing) {
+        return std::nullopt;
+    }
+
+    const auto id = entry["id"].get<std::string> ();
+    const auto next_version = version.load () + 1;
+
+    auto next = std::make_shared<membership_snapshot> (*published.load ());
+    next->version = next_version;
+
+    auto &list = next->participants;
+    const auto at = std::lower_bound (list.begin (), list.end (), id,
+                                      [] (const auto &p, const std::string &key) { return p->get_id () < key; });
+    const bool found = at != list.end () && (*at)->get_id () == id;
+
+    std::shared_ptr<const participant> subject;
+    std::shared_ptr<const participant> previous;
+    if (kind == CHANGE_LEFT) {
+        if (!found) {
+            return std::nullopt;
+        }
+        subject = *at;
+        list.erase (at);
+        index_provider (*next, subject, false);
+    } else {
+        subject = std::make_shared<const participant> (participant_from_json (entry));
+        if (found) {
+            previous = *at;
+            *at = subject;
+            index_provider (*next, previous, false);
+        } else {
+            list.insert (at, subject);
+        }
+        index_provider (*next, subject, true);
+    }
+
+    published.store (std::move (next));
+
+    membership_change change {next_version, kind, std::move (subject), clock (), std::move (changed), std::move (previous)};
+    {
+        std::lock_guard lock (watch_mutex);
+        version.store (next_version);
+        change_log.push_back (change);
+        if (change_log.size () > change_log_limit) {
+            change_log.pop_front ();
+        }
+    }
+    watch_changed.notify_all ();
+
+    return change;
+}
+
+/**
+ * @brief Release the table's lock and tell every listener about changes.
+ *
+ * The listener lock is taken before the table lock is released, so listeners
+ * see changes in version order even when several threads change the table.
+ *
+ * @param table_lock The held lock on participant_mutex.
+ * @param changes The changes made under that lock.
+ */
+void membership::dispatch (std::unique_lock<std::mutex> &table_lock, const std::vector<membership_change> &changes) {
+    if (changes.empty ()) {
+        table_lock.unlock ();
+        return;
+    }
+
+    std::lock_guard lock (listener_mutex);
+    table_lock.unlock ();
+
+    for (const auto &change: changes) {
+        for (const auto &[token, listener]: listeners) {
+            listener (change);
+        }
+    }
+}
+
+/**
+ * @brief Register a function to be told about every membership change.
+ *
+ * Listeners run on the thread that made the change, after the table's lock is
+ * released, so they may query the table but should return quickly and must
+ * not subscribe or unsubscribe from within the callback.
+ *
+ * @return A token for unsubscribe().
+ */
+int membership::subscribe (change_listener listener) {
+    std::lock_guard lock (listener_mutex);
+    listeners[next_listener] = std::move (listener);
+    return next_listener++;
+}
+
+void membership::unsubscribe (const int token) {
+    std::lock_guard lock (listener_mutex);
+    listeners.erase (token);
+}
+
+/**
+ * @brief Wait for the membership to move past a version and return what changed.
+ *
+ * Returns as soon as the version exceeds `since`, or when the timeout passes
+ * (with no changes). All watchers share one condition variable, so a single
+ * change wakes every one of them with one notification.
+ *
+ * @param since The last version the caller has seen; 0 for none.
+ * @param timeout How long to wait for a change.
+ */
+watch_result membership::watch (const std::uint64_t since, const std::chrono::milliseconds timeout) const {
+    std::unique_lock lock (watch_mutex);
+    watch_changed.wait_for (lock, timeout, [&] { return version.load () > since; });
+
+    watch_result result;
+    result.version = version.load ();
+
+    if (result.version <= since) {
+        return result;
+    }
+
+    if (change_log.empty () || change_log.front ().version > since + 1) {
+        result.reset = true;
+        return result;
+    }
+
+    const auto first = std::lower_bound (change_log.begin (), change_log.end (), since + 1,
+                                         [] (const membership_change &c, const std::uint64_t v) { return c.version < v; });
+    result.changes.assign (first, change_log.end ());
+
+    return result;
+}
+
+/**
+ * @brief The table entry for an advertisement: the advertisement without its gossip.
+ *
+ * A digest describes the sender's view, not the sender, so it is not kept; the
+ * sequence number only matters to link quality, whether an entry is
+ * provisional is our own business, the path a bridged copy took and the
+ * incarnation that tells a restarted sender apart are the bridges', and a
+ * solicit nonce belongs to the one answer that carried it.
+ */
+static json descriptor_of (const json &j) {
+    json entry = j;
+    entry.erase ("digest");
+    entry.erase ("age_ms");
+    entry.erase ("provisional");
+    entry.erase ("seq");
+    entry.erase ("bridges");
+    entry.erase ("ttl");
+    entry.erase ("solicit");
+    entry.erase ("incarnation");
+    return entry;
+}
+
+/**
+ * @brief Add a participant to the table. Called with participant_mutex held.
+ */
+void membership::add_entry (const json &descriptor, const std::uint64_t first_seen, const std::uint64_t last_seen,
+                            std::vector<membership_change> &changes) {
+    const std::string id = descriptor["id"].get<std::string> ();
+    const std::string address = descriptor["address"].get<std::string> ();
+    const std::string architecture = descriptor["architecture"].get<std::string> ();
+
+    json &entry = participant_map[id] = descriptor;
+    entry["first_seen"] = first_seen;
+    entry["last_seen"] = last_seen;
+
+    const auto hash = membership_digest::descriptor_hash (entry);
+    descriptor_hashes[id] = hash;
+    digest.toggle (id, hash);
+    history.transition (id, true, first_seen);
+
+    if (auto change = publish_change (CHANGE_JOINED, entry)) {
+        changes.push_back (std::move (*change));
+    }
+
+    if (verbose) {
+        print_timestamp (first_seen);
+        std::cout << ": " << id << " online " << std::endl;
+    }
+
+    // back before its held offline was sent: consumers never saw it leave
+    if (!partitions.retract (id)) {
+        notify (address, UPDATE_ONLINE, architecture);
+    }
+}
+
+/**
+ * @brief Replace an entry's descriptor if it differs, keeping its timestamps. Called with participant_mutex held.
+ *
+ * Whether it differs is decided by the descriptor hash alone, against the
+ * hash kept for the entry, so an unchanged heartbeat costs one hash and no
+ * copy; a field the hash leaves out changes only along with one it covers.
+ * A change is published as CHANGE_UPDATED naming the fields that differ.
+ *
+ * @param advertisement The advertisement or peer entry; its gossip is stripped here.
+ * @return true when the descriptor changed.
+ */
+bool membership::refresh_entry (json &entry, const json &advertisement, std::vector<membership_change> &changes) {
+    const auto id = entry["id"].get<std::string> ();
+    const auto hash = membership_digest::descriptor_hash (advertisement);
+
+    auto &known = descriptor_hashes[id];
+    if (hash == known) {
+        return false;
+    }
+
+    const json descriptor = descriptor_of (advertisement);
+
+    std::vector<std::string> changed;
+    for (const auto &field: descriptor.items ()) {
+        if (const auto it = entry.find (field.key ()); it == entry.end () || *it != field.value ()) {
+            changed.push_back (field.key ());
+        }
+    }
+    for (const auto &field: entry.items ()) {
+        const auto &key = field.key ();
+        if (key != "first_seen" && key != "last_seen" && key != "provisional" && !descriptor.contains (key)) {
+            changed.push_back (key);
+        }
+    }
+
+    const auto first_seen = entry["first_seen"];
+    const auto last_seen = entry["last_seen"];
+    const bool provisional = entry.contains ("provisional");
+
+    digest.toggle (id, known);
+    entry = descriptor;
+    entry["first_seen"] = first_seen;
+    entry["last_seen"] = last_seen;
+    if (provisional) {
+        entry["provisional"] = true;
+    }
+    digest.toggle (id, hash);
+    known = hash;
+
+    if (auto change = publish_change (CHANGE_UPDATED, entry, changed)) {
+        changes.push_back (std::move (*change));
+    }
+
+    if (verbose) {
+        print_timestamp (clock ());
+        std::cout << ": " << id << " updated";
+        for (const auto &field: changed) {
+            std::cout << " " << field;
+        }
+        std::cout << std::endl;
+    }
+
+    return true;
+}
+
 /**
  * @brief Reports the participant to the monitoring system.
  *
  * This function is used to report a participant to the monitoring system. It updates
  * the participant's last seen timestamp and adds a new participant if it doesn't exist
- * in the participant map. The function also prints debugging information to the console.
+ * in the participant map. An advertisement is the participant speaking for itself, so
+ * a descriptor that differs from the one in the table replaces it in place, as a
+ * CHANGE_UPDATED rather than a departure and return. The function also
+ * prints debugging information to the console.
  *
  * @param j The JSON object representing the participant.
- * @return The status of the participant after reporting (PARTICIPANT_EXISTS or PARTICIPANT_ADDED).
+ * @return The status of the participant after reporting (PARTICIPANT_EXISTS, PARTICIPANT_ADDED
+ *         or PARTICIPANT_REFRESHED), or PARTICIPANT_IGNORED when `j` is not a descriptor.
  */
-ParticipantStatus report_participant (json &j) {
-    auto ts = get_timestamp ();
+ParticipantStatus membership::report_participant (const json &j) {
+    if (!is_descriptor (j)) {
+        return PARTICIPANT_IGNORED;
+    }
+
+    auto ts = clock ();
     auto status = PARTICIPANT_EXISTS;
 
     const std::string id = j["id"].get<std::string> ();
-    const std::string address = j["address"].get<std::string> ();
-    const std::string architecture = j["architecture"].get<std::string> ();
 
-    std::lock_guard lock (participant_mutex);
+    std::optional<std::uint64_t> sequence;
+    if (const auto seq = j.find ("seq"); seq != j.end () && seq->is_number_unsigned ()) {
+        sequence = seq->get<std::uint64_t> ();
+    }
 
-    if (participant_map.contains (id)) {
+    std::vector<membership_change> changes;
+    std::unique_lock lock (participant_mutex);
+
+    if (const auto it = participant_map.find (id); it != participant_map.end ()) {
         // updating existing entry
 
-        auto w = participant_map[id];
+        it->second["last_seen"] = ts;
+        history.heartbeat (id, ts, sequence);
+
+        // a participant restored at startup is confirmed, quietly, by its first advertisement
+        it->second.erase ("provisional");
 
-        w["last_seen"] = ts;
-        participant_map[id] = w;
+        if (refresh_entry (it->second, j, changes)) {
+            status = PARTICIPANT_REFRESHED;
+        }
 
     } else {
         // adding new entry
 
-        j["first_seen"] = ts;
-        j["last_seen"] = ts;
-        participant_map[id] = j;
+        add_entry (descriptor_of (j), ts, ts, changes);
 
-        print_timestamp (ts);
-        std::cout << ": " << id << " online " << std::endl;
+        status = PARTICIPANT_ADDED;
+    }
+
+    dispatch (lock, changes);
+
+    return status;
+}
+
+/**
+ * @brief Merge a participant learned from a peer's table during an anti-entropy sync.
+ *
+ * Second hand information never extends a participant's life: an entry we do
+ * not have is added as last seen `age_ms` ago (and only when that is well within
+ * the expiry, so a peer that has not yet expired a departed participant cannot
+ * bring it back), and an entry we do have takes the peer's descriptor only when
+ * the peer heard from the participant more recently than we did.
+ *
+ * @param j The peer's table entry.
+ * @param age_ms How long ago the peer last heard from the participant.
+ * @return PARTICIPANT_ADDED, PARTICIPANT_REFRESHED, PARTICIPANT_EXISTS, or PARTICIPANT_IGNORED when too
+ *         old or not a descriptor.
+ */
+ParticipantStatus membership::merge_participant (const json &j, const std::uint64_t age_ms) {
+    const auto ts = clock ();
+    if (!is_descriptor (j) || age_ms > expiry_ms / 2 || age_ms > ts) {
+        return PARTICIPANT_IGNORED;
+    }
 
-        send_update (address, 1, architecture);
+    const std::string id = j["id"].get<std::string> ();
+    json descriptor = descriptor_of (j);
+    descriptor.erase ("first_seen");
+    descriptor.erase ("last_seen");
+
+    auto status = PARTICIPANT_EXISTS;
+    std::vector<membership_change> changes;
+    std::unique_lock lock (participant_mutex);
 
+    if (const auto it = participant_map.find (id); it != participant_map.end ()) {
+        const auto last_seen = it->second["last_seen"].get<std::uint64_t> ();
+
+        if (ts - age_ms > last_seen && refresh_entry (it->second, descriptor, changes)) {
+            status = PARTICIPANT_REFRESHED;
+        }
+    } else {
+        add_entry (descriptor, ts, ts - age_ms, changes);
         status = PARTICIPANT_ADDED;
     }
 
+    dispatch (lock, changes);
+
     return status;
 }
 
+/**
+ * @brief Fill an empty table with the participants saved before a restart.
+ *
+ * Restored participants are provisional: they are published to snapshot
+ * readers but the update sink is not told, since downstream consumers were
+ * already told they were online before the restart. Each one is last seen
+ * now, so it has one expiry window to advertise; one that does is confirmed
+ * without any notification, and one that does not is expired as usual, which
+ * does tell the sink it went offline.
+ *
+ * @param participants The participants saved by save_warm_snapshot().
+ * @return The number restored; participants already in the table are skipped.
+ */
+std::size_t membership::restore (const std::vector<participant> &participants) {
+    const auto ts = clock ();
+    std::size_t restored = 0;
+
+    std::vector<membership_change> changes;
+    std::unique_lock lock (participant_mutex);
+
+    for (const auto &p: participants) {
+        if (participant_map.contains (p.get_id ())) {
+            continue;
+        }
+
+        json &entry = participant_map[p.get_id ()] = participant_to_json (p);
+        entry["last_seen"] = ts;
+        entry["provisional"] = true;
+
+        const auto hash = membership_digest::descriptor_hash (entry);
+        descriptor_hashes[p.get_id ()] = hash;
+        digest.toggle (p.get_id (), hash);
+        history.transition (p.get_id (), true, ts);
+
+        if (auto change = publish_change (CHANGE_JOINED, entry)) {
+            changes.push_back (std::move (*change));
+        }
+
+        if (verbose) {
+            print_timestamp (ts);
+            std::cout << ": " << p.get_id () << " restored " << std::endl;
+        }
+
+        restored++;
+    }
+
+    dispatch (lock, changes);
+
+    return restored;
+}
+
+/**
+ * @brief The digest of the whole table, cheap enough to put in every advertisement.
+ */
+std::uint64_t membership::digest_root () const {
+    std::lock_guard lock (participant_mutex);
+    return digest.root ();
+}
+
+membership_digest::buckets membership::digest_buckets () const {
+    std::lock_guard lock (participant_mutex);
+    return digest.get_buckets ();
+}
+
+/**
+ * @brief The digest buckets in which a peer's table differs from ours.
+ */
+std::vector<std::size_t> membership::differing_buckets (const json &remote) const {
+    std::lock_guard lock (participant_mutex);
+    return digest.differing (remote);
+}
+
+/**
+ * @brief Every entry that falls in the given digest buckets, for sending to a peer.
+ *
+ * Each entry carries its descriptor and "age_ms", how long ago we last heard
+ * from the participant; our own timestamps mean nothing to the peer.
+ */
+json membership::entries_in (const std::vector<std::size_t> &buckets) const {
+    std::vector<bool> wanted (membership_digest::bucket_count, false);
+    for (const auto bucket: buckets) {
+        if (bucket < wanted.size ()) {
+            wanted[bucket] = true;
+        }
+    }
+
+    const auto ts = clock ();
+    json entries = json::array ();
+
+    std::lock_guard lock (participant_mutex);
+    for (const auto &[id, entry]: participant_map) {
+        if (!wanted[membership_digest::bucket_of (id)]) {
+            continue;
+        }
+
+        json e = entry;
+        const auto last_seen = e["last_seen"].get<std::uint64_t> ();
+        e.erase ("first_seen");
+        e.erase ("last_seen");
+        e["age_ms"] = ts > last_seen ? ts - last_seen : 0;
+        entries.push_back (std::move (e));
+    }
+
+    return entries;
+}
+
 /**
  * @brief Check the participants for stale entries and remove them.
  *
  * This function iterates over the participant_map and checks the age
  * of each participant based on the current timestamp obtained from
- * the get_timestamp() function. If a participant's age is greater than
- * 1000 milliseconds, it is considered stale and removed from the map.
- * The details of the stale entry are printed to the console.
- *
- * @note This method assumes the existence of a participant_map, which is a
- *       std::map<std::string, json> used to store participant details.
- *
- * @note This method assumes the existence of the
+ * the clock. If a participant's age is greater than the expiry time
+ * (600 milliseconds by default), it is considered stale and removed
+ * from the map. The details of the stale entry are printed to the console.
+ * While a partition is suspected, offline notifications are held back by
+ * the partition guard and released or retracted when it resolves.
  */
-int expire_participants () {
-    const auto current_timestamp = get_timestamp ();
+int membership::expire_participants () {
+    const auto current_timestamp = clock ();
 
-    for (auto it = participant_map.begin (); it != participant_map.end ();) {
+    std::vector<membership_change> changes;
+    std::unique_lock lock (participant_mutex);
 
-        json p = it->second;
+    std::vector<std::map<std::string, json>::iterator> stale;
+    for (auto it = participant_map.begin (); it != participant_map.end (); ++it) {
+        const auto last_seen = it->second["last_seen"].get<std::uint64_t> ();
 
-        std::lock_guard lock (participant_mutex);
+        if (current_timestamp > last_seen && current_timestamp - last_seen > expiry_ms) {
+            stale.push_back (it);
+        }
+    }
 
-        const auto last_seen = p["last_seen"].get<std::uint64_t> ();
+    if (const auto event = partitions.observe (current_timestamp, stale.size (), participant_map.size ())) {
+        announce_partition (*event);
+    }
 
-        if (const std::uint64_t age = current_timestamp - last_seen; age > 600) {
+    for (const auto it: stale) {
+        const json &p = it->second;
 
-            std::string id = p["id"].get<std::string> ();
-            std::string address = p["address"].get<std::string> ();
-            std::string architecture = p["architecture"].get<std::string> ();
+        std::string id = p["id"].get<std::string> ();
+        std::string address = p["address"].get<std::string> ();
+        std::string architecture = p["architecture"].get<std::string> ();
 
+        // a held expiry is not a departure until it is released; see the cluster harness
+        const bool held = partitions.is_suspected ();
+        if (verbose) {
             print_timestamp (current_timestamp);
-            std::cout  << ": " << id << " offline " << std::endl;
+            std::cout << ": " << id << (held ? " held offline " : " offline ") << std::endl;
+        }
 
-            send_update (address, 1, architecture);
-            
-            it = participant_map.erase (it);
+        if (held) {
+            partitions.hold (id, address, architecture);
         } else {
-            ++it;
+            notify (address, UPDATE_OFFLINE, architecture);
+        }
+
+        digest.toggle (id, descriptor_hashes[id]);
+        descriptor_hashes.erase (id);
+        history.transition (id, false, current_timestamp);
+
+        if (auto change = publish_change (CHANGE_LEFT, p)) {
+            changes.push_back (std::move (*change));
+        }
+
+        participant_map.erase (it);
+    }
+
+    std::vector<partition_guard::held_offline> release;
+    if (const auto event = partitions.resolve (current_timestamp, release)) {
+        for (const auto &offline: release) {
+            if (verbose) {
+                print_timestamp (current_timestamp);
+                std::cout << ": " << offline.id << " offline " << std::endl;
+            }
+            notify (offline.address, UPDATE_OFFLINE, offline.architecture);
         }
+        announce_partition (*event);
     }
 
+    history.prune (current_timestamp);
+
+    dispatch (lock, changes);
+
     return 0;
 }
 
+/**
+ * @brief Print and send a partition event. Called with participant_mutex held.
+ */
+void membership::announce_partition (const partition_event &event) const {
+    if (verbose) {
+        print_timestamp (event.at);
+        if (event.suspected) {
+            std::cout << ": partition suspected, holding " << event.held << " offline" << std::endl;
+        } else {
+            std::cout << ": partition resolved, " << event.retracted << " returned, "
+                      << event.released << " offline released" << std::endl;
+        }
+    }
+
+    if (partition_notify) {
+        partition_notify (event);
+    }
+}
+
+/**
+ * @brief Counters describing suspected partitions, for the stats query.
+ */
+json membership::partition_statistics () const {
+    std::lock_guard lock (participant_mutex);
+    return partitions.statistics ();
+}
+
+/**
+ * @brief Change when mass expiry is taken for a partition.
+ */
+void membership::set_partition_settings (const partition_settings settings) {
+    std::lock_guard lock (participant_mutex);
+    partitions.set_settings (settings);
+}
+
+/**
+ * @brief Set where suspected and resolved partitions are announced; by default they are only printed.
+ */
+void membership::set_partition_sink (partition_sink sink) {
+    std::lock_guard lock (participant_mutex);
+    partition_notify = std::move (sink);
+}
+
+/**
+ * @brief The number of participants currently in the table.
+ */
+std::size_t membership::size () const {
+    std::lock_guard lock (participant_mutex);
+    return participant_map.size ();
+}
+
+/**
+ * @brief The number of restored participants that have not advertised since the restart.
+ */
+std::size_t membership::provisional_count () const {
+    std::lock_guard lock (participant_mutex);
+    return std::count_if (participant_map.begin (), participant_map.end (),
+                          [] (const auto &entry) { return entry.second.contains ("provisional"); });
+}
+
+/**
+ * @brief Whether a participant with the given id is currently in the table.
+ */
+bool membership::contains (const std::string &id) const {
+    std::lock_guard lock (participant_mutex);
+    return participant_map.contains (id);
+}
+
+/**
+ * @brief Whether a participant with the given id is in the table and advertises the given address.
+ */
+bool membership::member_at (const std::string &id, const std::string &address) const {
+    std::lock_guard lock (participant_mutex);
+    const auto it = participant_map.find (id);
+    if (it == participant_map.end ()) {
+        return false;
+    }
+    const auto advertised = it->second.find ("address");
+    return advertised != it->second.end () && *advertised == address;
+}
 
+/**
+ * @brief The recorded transitions and heartbeat gaps of one participant, online or not.
+ *
+ * @return The history as described by participant_history::describe(), or null if there is none.
+ */
+json membership::history_of (const std::string &id) const {
+    std::lock_guard lock (participant_mutex);
+    return history.describe (id);
+}
+
+/**
+ * @brief A one line history of every participant tracked.
+ */
+json membership::history_summary () const {
+    std::lock_guard lock (participant_mutex);
+    return history.summary ();
+}
+
+/**
+ * @brief Loss, reordering and jitter over every participant, as participant_history::link_summary().
+ */
+json membership::link_statistics () const {
+    std::lock_guard lock (participant_mutex);
+    return history.link_summary ();
+}
+
+void membership::set_history_limits (const history_limits limits) {
+    std::lock_guard lock (participant_mutex);
+    history.set_limits (limits);
+}
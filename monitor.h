@@ -2,15 +2,45 @@
 #ifndef HOSTMON_MONITOR_H
 #define HOSTMON_MONITOR_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <nlohmann/json.hpp>
 
+#include "digest.h"
+#include "history.h"
+#include "partition.h"
+
 using json = nlohmann::json;
 
 enum ParticipantStatus {
     PARTICIPANT_EXISTS,
-    PARTICIPANT_ADDED
+    PARTICIPANT_ADDED,
+    PARTICIPANT_REFRESHED,
+    PARTICIPANT_IGNORED
+};
+
+// the op codes carried in the "status" field of an update notification
+enum UpdateOperation {
+    UPDATE_OFFLINE = 0,
+    UPDATE_ONLINE = 1,
+    // aggregate notifications about a suspected partition (see partition_guard)
+    UPDATE_PARTITION_SUSPECTED = 2,
+    UPDATE_PARTITION_RESOLVED = 3,
+    // our own receive path is dropping datagrams, and expiry is widened meanwhile
+    UPDATE_RECEIVE_OVERLOAD = 4,
+    UPDATE_RECEIVE_RECOVERED = 5,
+    // a participant still online changed its address, architecture, operating system, release, active flag, services or priorities
+    UPDATE_ATTRIBUTES_CHANGED = 6
 };
 
 class participant {
@@ -30,8 +60,13 @@ class participant {
     bool active;
     // the participants reported CPU architecture
     std::string architecture;
+    // the participants reported operating system and its release; empty when not advertised
+    std::string operating_system;
+    std::string release;
     // list of services provided by this participant
     std::vector<std::string> provides;
+    // the advertised priority of each service that has one; lower is preferred
+    std::map<std::string, int> priorities;
 
 public:
     participant() : first_seen(0), last_seen(0), active(false) {}
@@ -69,6 +104,22 @@ public:
         architecture = new_architecture;
     }
 
+    [[nodiscard]] std::string get_operating_system () const {
+        return operating_system;
+    }
+
+    void set_operating_system (const std::string &new_operating_system) {
+        operating_system = new_operating_system;
+    }
+
+    [[nodiscard]] std::string get_release () const {
+        return release;
+    }
+
+    void set_release (const std::string &new_release) {
+        release = new_release;
+    }
+
     [[nodiscard]] std::vector<std::string> get_provides () const {
         return provides;
     }
@@ -77,6 +128,20 @@ public:
         provides = new_provides;
     }
 
+    [[nodiscard]] const std::map<std::string, int> &get_priorities () const {
+        return priorities;
+    }
+
+    // 0 for a service advertised without a priority
+    [[nodiscard]] int get_priority (const std::string &service) const {
+        const auto it = priorities.find (service);
+        return it == priorities.end () ? 0 : it->second;
+    }
+
+    void set_priorities (const std::map<std::string, int> &new_priorities) {
+        priorities = new_priorities;
+    }
+
     [[nodiscard]] uint64_t get_first_seen () const {
         return first_seen;
     }
@@ -94,8 +159,189 @@ public:
     }
 };
 
+using provider_list = std::vector<std::shared_ptr<const participant>>;
+
+/**
+ * @brief An immutable view of the participant table at one point in time.
+ *
+ * Participants are sorted by id. Snapshots are published atomically whenever a
+ * participant joins or leaves, so readers never take the table's lock.
+ *
+ * `services` indexes the providers of each service, ordered by advertised
+ * priority and then id. A change rebuilds only the lists of the services the
+ * participant provided or provides, and the others are shared with the
+ * previous snapshot, so finding a service's providers never scans the table.
+ */
+struct membership_snapshot {
+    // the membership version this snapshot reflects
+    std::uint64_t version = 0;
+    std::vector<std::shared_ptr<const participant>> participants;
+    std::unordered_map<std::string, std::shared_ptr<const provider_list>> services;
+
+    [[nodiscard]] std::shared_ptr<const participant> find (const std::string &id) const;
+    [[nodiscard]] const provider_list &providers_of (const std::string &service) const;
+};
+
+bool is_descriptor (const json &j);
+participant participant_from_json (const json &j);
+json participant_to_json (const participant &p);
+
+enum ChangeKind {
+    CHANGE_JOINED = 1,
+    CHANGE_LEFT = 2,
+    // a participant in the view advertised a different descriptor; see membership_change::changed
+    CHANGE_UPDATED = 3
+};
+
+/**
+ * @brief One change to the membership view, numbered by the version it produced.
+ *
+ * An update names the descriptor fields that changed and carries the
+ * participant as it was before; neither is carried by the query protocol.
+ */
+struct membership_change {
+    std::uint64_t version;
+    ChangeKind kind;
+    std::shared_ptr<const participant> subject;
+    // when the change was made, by the table's clock; not carried by the query protocol
+    std::uint64_t at = 0;
+    std::vector<std::string> changed {};
+    std::shared_ptr<const participant> previous {};
+};
+
+/**
+ * @brief The outcome of membership::watch().
+ *
+ * When `reset` is set the caller's version is older than the retained change
+ * log; `changes` is then empty and the caller should re-read the snapshot.
+ */
+struct watch_result {
+    std::uint64_t version = 0;
+    bool reset = false;
+    std::vector<membership_change> changes;
+};
+
+// told about every change to the membership view, outside the table's lock
+using change_listener = std::function<void (const membership_change &)>;
+
 std::uint64_t get_timestamp ();
-ParticipantStatus report_participant (json &j);
-int expire_participants();
+void print_timestamp (std::uint64_t timestamp);
+
+// source of "now" in milliseconds, swapped for a virtual clock when simulating
+using clock_source = std::function<std::uint64_t ()>;
+
+// receives online/offline transitions (address, op, architecture)
+using update_sink = std::function<void (const std::string &, int, const std::string &)>;
+
+/**
+ * @class membership
+ * @brief The participant table of one hostmon instance.
+ *
+ * Holds every participant we have heard from, keyed by id, along with the
+ * clock used to stamp them and the sink that is told about transitions. Each
+ * engine owns one; the simulator runs one per simulated node. A digest of the
+ * table is kept up to date with it so peers can compare views cheaply, and
+ * every participant's transitions are recorded in a history that outlives
+ * its table entry. Offline notifications are held back while a mass expiry
+ * looks like a partition rather than a real departure.
+ */
+class membership {
+    std::map<std::string, json> participant_map;
+    mutable std::mutex participant_mutex;
+    membership_digest digest;
+    // each entry's descriptor hash, so a heartbeat is checked for changes by hashing it alone
+    std::unordered_map<std::string, std::uint64_t> descriptor_hashes;
+    participant_history history;
+    partition_guard partitions;
+
+    clock_source clock;
+    update_sink notify;
+    partition_sink partition_notify;
+
+    // a participant not heard from in this many milliseconds is offline; widened while the engine is overloaded
+    std::atomic<std::uint64_t> expiry_ms;
+
+    // whether transitions are also printed to stdout
+    bool verbose;
+
+    // the latest published view, replaced (never modified) under participant_mutex
+    std::atomic<std::shared_ptr<const membership_snapshot>> published;
+    std::atomic<std::uint64_t> version = 0;
+    bool publishing = true;
+
+    // the most recent changes, for watchers catching up from an older version
+    static constexpr std::size_t change_log_limit = 4096;
+    std::deque<membership_change> change_log;
+    mutable std::mutex watch_mutex;
+    mutable std::condition_variable watch_changed;
+
+    std::map<int, change_listener> listeners;
+    int next_listener = 0;
+    std::mutex listener_mutex;
+
+    std::optional<membership_change> publish_change (ChangeKind kind, const json &entry,
+                                                     std::vector<std::string> changed = {});
+    void dispatch (std::unique_lock<std::mutex> &table_lock, const std::vector<membership_change> &changes);
+    void add_entry (const json &descriptor, std::uint64_t first_seen, std::uint64_t last_seen,
+                    std::vector<membership_change> &changes);
+    bool refresh_entry (json &entry, const json &advertisement, std::vector<membership_change> &changes);
+    void announce_partition (const partition_event &event) const;
+
+public:
+    explicit membership (clock_source clock = get_timestamp,
+                         update_sink notify = nullptr,
+                         std::uint64_t expiry_ms = 600,
+                         bool verbose = true);
+
+    ParticipantStatus report_participant (const json &j);
+    ParticipantStatus merge_participant (const json &j, std::uint64_t age_ms);
+    std::size_t restore (const std::vector<participant> &participants);
+    int expire_participants ();
+
+    [[nodiscard]] std::uint64_t digest_root () const;
+    [[nodiscard]] membership_digest::buckets digest_buckets () const;
+    [[nodiscard]] std::vector<std::size_t> differing_buckets (const json &remote) const;
+    [[nodiscard]] json entries_in (const std::vector<std::size_t> &buckets) const;
+
+    [[nodiscard]] std::size_t size () const;
+    [[nodiscard]] std::size_t provisional_count () const;
+    [[nodiscard]] bool contains (const std::string &id) const;
+    [[nodiscard]] bool member_at (const std::string &id, const std::string &address) const;
+
+    [[nodiscard]] json history_of (const std::string &id) const;
+    [[nodiscard]] json history_summary () const;
+    [[nodiscard]] json link_statistics () const;
+    void set_history_limits (history_limits limits);
+
+    [[nodiscard]] json partition_statistics () const;
+    void set_partition_settings (partition_settings settings);
+    void set_partition_sink (partition_sink sink);
+
+    [[nodiscard]] std::uint64_t get_expiry () const {
+        return expiry_ms;
+    }
+
+    void set_expiry (const std::uint64_t new_expiry_ms) {
+        expiry_ms = new_expiry_ms;
+    }
+
+    [[nodiscard]] std::shared_ptr<const membership_snapshot> snapshot () const {
+        return published.load ();
+    }
+
+    [[nodiscard]] std::uint64_t get_version () const {
+        return version.load ();
+    }
+
+    // snapshots and the change log cost O(n) per join or leave, which large simulations can do without
+    void set_publishing (const bool new_publishing) {
+        publishing = new_publishing;
+    }
+
+    watch_result watch (std::uint64_t since, std::chrono::milliseconds timeout) const;
+
+    int subscribe (change_listener listener);
+    void unsubscribe (int token);
+};
 
 #endif //HOSTMON_MONITOR_H
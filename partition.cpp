@@ -0,0 +1,133 @@
+#include "partition.h"
+
+/**
+ * @brief Read partition detection settings from the "partition" object of config.json.
+ *
+ * Recognises "threshold", "window_ms", "min_participants" and "hold_ms"; a
+ * null object gives the defaults.
+ */
+partition_settings partition_from_configuration (const json &settings) {
+    partition_settings result;
+    if (!settings.is_object ()) {
+        return result;
+    }
+
+    result.threshold = settings.value ("threshold", result.threshold);
+    result.window_ms = settings.value ("window_ms", result.window_ms);
+    result.min_participants = settings.value ("min_participants", result.min_participants);
+    result.hold_ms = settings.value ("hold_ms", result.hold_ms);
+
+    return result;
+}
+
+/**
+ * @brief Account for one expiry pass, before its offline notifications are sent.
+ *
+ * @param now The time of the pass.
+ * @param expiring How many participants this pass is about to expire.
+ * @param table_size The size of the table before they are removed.
+ * @return The suspicion event, when this pass is the one that starts a suspicion.
+ */
+std::optional<partition_event> partition_guard::observe (const std::uint64_t now, const std::size_t expiring,
+                                                         const std::size_t table_size) {
+    while (!recent.empty () && now - recent.front ().first > settings.window_ms) {
+        recent_count -= recent.front ().second;
+        recent.pop_front ();
+    }
+
+    if (settings.threshold <= 0 || expiring == 0) {
+        return std::nullopt;
+    }
+
+    // what the table held at the start of the window
+    const auto population = table_size + recent_count;
+
+    recent.emplace_back (now, expiring);
+    recent_count += expiring;
+
+    if (suspected) {
+        last_expiry = now;
+        return std::nullopt;
+    }
+
+    if (population < settings.min_participants
+        || static_cast<double> (recent_count) < settings.threshold * static_cast<double> (population)) {
+        return std::nullopt;
+    }
+
+    suspected = true;
+    last_expiry = now;
+    partitions++;
+
+    return partition_event {.suspected = true, .at = now, .held = expiring};
+}
+
+/**
+ * @brief Hold a participant's offline notification while a partition is suspected.
+ */
+void partition_guard::hold (const std::string &id, const std::string &address, const std::string &architecture) {
+    held[id] = {id, address, architecture};
+    held_total++;
+}
+
+/**
+ * @brief Withdraw a held offline notification because its participant is back.
+ *
+ * @return true when one was held, in which case the return is not notified either.
+ */
+bool partition_guard::retract (const std::string &id) {
+    if (held.erase (id) == 0) {
+        return false;
+    }
+
+    retracted++;
+    retracted_total++;
+    return true;
+}
+
+/**
+ * @brief End the suspicion once its participants are all back or the hold has run out.
+ *
+ * @param now The current time.
+ * @param release Receives the offline notifications still held, to be sent now.
+ * @return The resolution event, when the suspicion ends on this call.
+ */
+std::optional<partition_event> partition_guard::resolve (const std::uint64_t now,
+                                                         std::vector<held_offline> &release) {
+    if (!suspected || (!held.empty () && now - last_expiry < settings.hold_ms)) {
+        return std::nullopt;
+    }
+
+    const partition_event event {
+        .suspected = false, .at = now, .held = held.size () + retracted, .released = held.size (), .retracted = retracted
+    };
+
+    for (auto &[id, offline]: held) {
+        release.push_back (std::move (offline));
+    }
+    released_total += held.size ();
+
+    held.clear ();
+    retracted = 0;
+    suspected = false;
+
+    // a fresh window, so the expiries just released cannot start another suspicion
+    recent.clear ();
+    recent_count = 0;
+
+    return event;
+}
+
+/**
+ * @brief Counters for the stats query.
+ */
+json partition_guard::statistics () const {
+    return {
+        {"suspected", suspected},
+        {"holding", held.size ()},
+        {"partitions", partitions},
+        {"held", held_total},
+        {"released", released_total},
+        {"retracted", retracted_total}
+    };
+}
@@ -0,0 +1,109 @@
+#ifndef HOSTMON_PARTITION_H
+#define HOSTMON_PARTITION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * @brief When mass expiry is taken for a partition. A threshold of 0 turns detection off.
+ */
+struct partition_settings {
+    // the fraction of the table that must expire within window_ms
+    double threshold = 0.3;
+    std::uint64_t window_ms = 2000;
+    // tables smaller than this never suspect a partition
+    std::size_t min_participants = 8;
+    // held offline notifications are released once this long passes without another expiry
+    std::uint64_t hold_ms = 10000;
+};
+
+partition_settings partition_from_configuration (const json &settings);
+
+/**
+ * @brief The aggregate notification sent when a partition is suspected or resolved.
+ *
+ * On suspicion `held` is the number of offline notifications being held. On
+ * resolution it is the number that were held in all, of which `released` were
+ * delivered late and `retracted` were never delivered because the participant
+ * came back.
+ */
+struct partition_event {
+    bool suspected = false;
+    std::uint64_t at = 0;
+    std::size_t held = 0;
+    std::size_t released = 0;
+    std::size_t retracted = 0;
+};
+
+using partition_sink = std::function<void (const partition_event &)>;
+
+/**
+ * @class partition_guard
+ * @brief Holds back offline notifications while a mass expiry looks like a partition.
+ *
+ * When more than `threshold` of the table expires within `window_ms`, the
+ * guard suspects a partition. Until it is resolved, every expiry is held
+ * rather than notified. A held participant that comes back is retracted: its
+ * consumers never hear that it left, nor that it returned. The suspicion is
+ * resolved when every held participant has returned, or when hold_ms passes
+ * without another expiry, and whatever is still held is then released.
+ *
+ * Only notifications are held; the table, its snapshots, watchers and the
+ * journal always show the membership as it is. Not thread safe; the
+ * membership table calls it under its own lock.
+ */
+class partition_guard {
+public:
+    struct held_offline {
+        std::string id;
+        std::string address;
+        std::string architecture;
+    };
+
+private:
+    partition_settings settings;
+
+    // expiries within the window, as (time, count) per expiry pass
+    std::deque<std::pair<std::uint64_t, std::size_t>> recent;
+    std::size_t recent_count = 0;
+
+    bool suspected = false;
+    std::uint64_t last_expiry = 0;
+    std::map<std::string, held_offline> held;
+    std::size_t retracted = 0;
+
+    std::uint64_t partitions = 0;
+    std::uint64_t held_total = 0;
+    std::uint64_t released_total = 0;
+    std::uint64_t retracted_total = 0;
+
+public:
+    explicit partition_guard (const partition_settings settings = {}) : settings (settings) {}
+
+    void set_settings (const partition_settings new_settings) {
+        settings = new_settings;
+    }
+
+    [[nodiscard]] bool is_suspected () const {
+        return suspected;
+    }
+
+    std::optional<partition_event> observe (std::uint64_t now, std::size_t expiring, std::size_t table_size);
+    void hold (const std::string &id, const std::string &address, const std::string &architecture);
+    bool retract (const std::string &id);
+    std::optional<partition_event> resolve (std::uint64_t now, std::vector<held_offline> &release);
+
+    [[nodiscard]] json statistics () const;
+};
+
+#endif //HOSTMON_PARTITION_H
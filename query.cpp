@@ -0,0 +1,740 @@
+#include "query.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// why the server thread is being woken through its pipe
+enum WakeReason : char {
+    WAKE_STOP = 0,
+    WAKE_CHANGED = 1
+};
+
+template<typename T>
+static void append (std::string &out, const T value) {
+    out.append (reinterpret_cast<const char *> (&value), sizeof (value));
+}
+
+template<typename T>
+static T extract (const std::string_view in, std::size_t &offset) {
+    if (offset + sizeof (T) > in.size ()) {
+        throw std::runtime_error ("Truncated query message");
+    }
+
+    T value;
+    memcpy (&value, in.data () + offset, sizeof (T));
+    offset += sizeof (T);
+    return value;
+}
+
+static std::string extract_string (const std::string_view in, std::size_t &offset, const std::size_t length) {
+    if (offset + length > in.size ()) {
+        throw std::runtime_error ("Truncated query message");
+    }
+
+    std::string value (in.substr (offset, length));
+    offset += length;
+    return value;
+}
+
+/**
+ * @brief Append the wire form of a participant, as used by query responses and the journal.
+ */
+void append_participant_record (std::string &out, const participant &p) {
+    const auto id = p.get_id ();
+    const auto address = p.get_address ();
+    const auto architecture = p.get_architecture ();
+    const auto provides = p.get_provides ();
+
+    append<std::uint64_t> (out, p.get_first_seen ());
+    append<std::uint8_t> (out, p.is_active () ? 1 : 0);
+    append<std::uint8_t> (out, 0);
+    append<std::uint16_t> (out, id.size ());
+    append<std::uint16_t> (out, address.size ());
+    append<std::uint16_t> (out, architecture.size ());
+    append<std::uint16_t> (out, provides.size ());
+
+    out += id;
+    out += address;
+    out += architecture;
+
+    for (const auto &service: provides) {
+        append<std::uint16_t> (out, service.size ());
+        out += service;
+    }
+}
+
+static std::string encode_response (const QueryStatus status,
+                                    const std::vector<std::shared_ptr<const participant>> &records) {
+    std::string body;
+    append<std::uint8_t> (body, status);
+    append<std::uint8_t> (body, 0);
+    append<std::uint16_t> (body, 0);
+    append<std::uint32_t> (body, records.size ());
+
+    for (const auto &p: records) {
+        append_participant_record (body, *p);
+    }
+
+    std::string out;
+    out.reserve (sizeof (std::uint32_t) + body.size ());
+    append<std::uint32_t> (out, body.size ());
+    out += body;
+    return out;
+}
+
+/**
+ * @brief Encode a query request.
+ *
+ * @param op What to ask for.
+ * @param argument The participant id or service name the operation needs.
+ */
+std::string encode_query_request (const QueryOperation op, const std::string &argument) {
+    std::string out;
+    append<std::uint8_t> (out, op);
+    append<std::uint8_t> (out, 0);
+    append<std::uint16_t> (out, argument.size ());
+    out += argument;
+    return out;
+}
+
+/**
+ * @brief Encode a watch request.
+ *
+ * @param since The last membership version the caller has seen.
+ * @param timeout How long the server may hold the request before answering with no changes.
+ */
+std::string encode_watch_request (const std::uint64_t since, const std::chrono::milliseconds timeout) {
+    std::string argument;
+    append<std::uint64_t> (argument, since);
+    append<std::uint32_t> (argument, static_cast<std::uint32_t> (timeout.count ()));
+    return encode_query_request (QUERY_WATCH, argument);
+}
+
+/**
+ * @brief Encode the changes returned by membership::watch().
+ *
+ * @return The framed response.
+ */
+std::string answer_watch (const watch_result &result) {
+    std::string body;
+    append<std::uint8_t> (body, result.reset ? QUERY_RESET : QUERY_OK);
+    append<std::uint8_t> (body, 0);
+    append<std::uint16_t> (body, 0);
+    append<std::uint32_t> (body, result.changes.size ());
+    append<std::uint64_t> (body, result.version);
+
+    for (const auto &change: result.changes) {
+        append<std::uint64_t> (body, change.version);
+        append<std::uint8_t> (body, change.kind);
+        append<std::uint8_t> (body, 0);
+        append_participant_record (body, *change.subject);
+    }
+
+    std::string out;
+    append<std::uint32_t> (out, body.size ());
+    out += body;
+    return out;
+}
+
+/**
+ * @brief Frame a response whose body is a JSON document, as stats and history responses are.
+ */
+std::string answer_json (const QueryStatus status, const json &document) {
+    const auto text = document.dump ();
+
+    std::string body;
+    append<std::uint8_t> (body, status);
+    append<std::uint8_t> (body, 0);
+    append<std::uint16_t> (body, 0);
+    append<std::uint32_t> (body, text.size ());
+    body += text;
+
+    std::string out;
+    append<std::uint32_t> (out, body.size ());
+    out += body;
+    return out;
+}
+
+/**
+ * @brief Answer one complete request from a snapshot.
+ *
+ * @param snapshot The membership view to answer from.
+ * @param request A request as produced by encode_query_request().
+ * @return The framed response.
+ */
+std::string answer_query (const membership_snapshot &snapshot, const std::string &request) {
+    std::size_t offset = 0;
+    const auto op = extract<std::uint8_t> (request, offset);
+    extract<std::uint8_t> (request, offset);
+    const auto length = extract<std::uint16_t> (request, offset);
+    const auto argument = extract_string (request, offset, length);
+
+    switch (op) {
+        case QUERY_LIST_ALL:
+            return encode_response (QUERY_OK, snapshot.participants);
+
+        case QUERY_GET_BY_ID:
+            if (auto p = snapshot.find (argument)) {
+                return encode_response (QUERY_OK, {p});
+            }
+            return encode_response (QUERY_NOT_FOUND, {});
+
+        case QUERY_PROVIDERS_OF:
+            return encode_response (QUERY_OK, snapshot.providers_of (argument));
+
+        // watches are parked by the server, not answered from a snapshot
+        default:
+            return encode_response (QUERY_BAD_REQUEST, {});
+    }
+}
+
+/**
+ * @brief Listen for queries on a Unix socket.
+ *
+ * A stale socket file at the path is replaced, but one another server is
+ * still listening on is left alone.
+ *
+ * @param table The participant table to answer from.
+ * @param path The filesystem path of the socket.
+ * @param statistics Produces the answer to stats queries; without it they are refused.
+ * @throws std::runtime_error If the socket cannot be created, bound or listened on, or is in use.
+ */
+query_server::query_server (membership &table, std::string path, statistics_source statistics)
+    : table (table), path (std::move (path)), wakeup {-1, -1}, statistics (std::move (statistics)) {
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (this->path.size () >= sizeof (addr.sun_path)) {
+        throw std::runtime_error ("Query socket path too long: " + this->path);
+    }
+    strncpy (addr.sun_path, this->path.c_str (), sizeof (addr.sun_path) - 1);
+
+    listener = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        throw std::runtime_error ("Failed to create query socket");
+    }
+
+    // only a socket nobody answers on is stale; taking over a live one would orphan its server
+    const int probe = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+        close (listener);
+        throw std::runtime_error ("Failed to create query socket");
+    }
+    const bool live = connect (probe, reinterpret_cast<sockaddr *>(&addr), sizeof (addr)) == 0;
+    const int probe_error = errno;
+    close (probe);
+    if (live) {
+        close (listener);
+        throw std::runtime_error ("Query socket already in use: " + this->path);
+    }
+    if (probe_error == ECONNREFUSED) {
+        unlink (this->path.c_str ());
+    }
+
+    if (bind (listener, reinterpret_cast<sockaddr *>(&addr), sizeof (addr)) < 0 || ::listen (listener, 64) < 0) {
+        close (listener);
+        throw std::runtime_error ("Binding query socket error: " + std::string (strerror (errno)));
+    }
+
+    if (pipe2 (wakeup, O_NONBLOCK | O_CLOEXEC) < 0) {
+        close (listener);
+        throw std::runtime_error ("Failed to create query wakeup pipe");
+    }
+
+    subscription = table.subscribe ([this] (const membership_change &) { signal (WAKE_CHANGED); });
+}
+
+query_server::~query_server () {
+    table.unsubscribe (subscription);
+
+    for (const auto &c: clients) {
+        close (c.fd);
+    }
+    close (listener);
+    close (wakeup[0]);
+    close (wakeup[1]);
+    unlink (path.c_str ());
+}
+
+void query_server::signal (const char reason) {
+    // a full pipe already guarantees a wakeup, so EAGAIN is fine
+    if (write (wakeup[1], &reason, 1) < 0 && errno != EAGAIN) {
+        perror ("Waking query server error");
+    }
+}
+
+/**
+ * @brief Make run() return. Safe to call from any thread.
+ */
+void query_server::stop () {
+    signal (WAKE_STOP);
+}
+
+/**
+ * @brief Read what a client sent and queue answers for every complete request.
+ *
+ * A parked watch stops requests from being processed, so a client that keeps
+ * writing meanwhile is dropped once it has more than max_pending_input unread.
+ *
+ * @return false when the client should be dropped.
+ */
+bool query_server::read_client (client &c) {
+    // room for one request of the largest size and then some
+    constexpr std::size_t max_pending_input = 2 * (4 + 65535);
+
+    char buffer[4096];
+
+    while (true) {
+        const ssize_t received = read (c.fd, buffer, sizeof (buffer));
+        if (received == 0) {
+            return false;
+        }
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        c.in.append (buffer, received);
+
+        process_requests (c);
+        if (c.in.size () > max_pending_input) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Answer the complete requests a client has sent, in order.
+ *
+ * Stops at a watch that cannot be answered yet; the requests behind it are
+ * processed once the watch completes, so answers keep their order.
+ */
+void query_server::process_requests (client &c) {
+    // one snapshot answers every request in this batch
+    const auto snapshot = table.snapshot ();
+
+    std::size_t offset = 0;
+    while (!c.watching && c.in.size () - offset >= 4) {
+        std::uint16_t length;
+        memcpy (&length, c.in.data () + offset + 2, sizeof (length));
+
+        if (c.in.size () - offset < 4u + length) {
+            break;
+        }
+
+        const auto request = c.in.substr (offset, 4u + length);
+        offset += 4u + length;
+
+        const auto op = static_cast<std::uint8_t> (request[0]);
+
+        if (op == QUERY_STATS) {
+            c.out += statistics ? answer_json (QUERY_OK, statistics ()) : encode_response (QUERY_BAD_REQUEST, {});
+            continue;
+        }
+
+        if (op == QUERY_HISTORY) {
+            if (length == 0) {
+                c.out += answer_json (QUERY_OK, table.history_summary ());
+            } else if (const auto history = table.history_of (request.substr (4)); !history.is_null ()) {
+                c.out += answer_json (QUERY_OK, history);
+            } else {
+                c.out += answer_json (QUERY_NOT_FOUND, nullptr);
+            }
+            continue;
+        }
+
+        if (op != QUERY_WATCH) {
+            c.out += answer_query (*snapshot, request);
+            continue;
+        }
+
+        if (length != sizeof (std::uint64_t) + sizeof (std::uint32_t)) {
+            c.out += encode_response (QUERY_BAD_REQUEST, {});
+            continue;
+        }
+
+        std::uint64_t since;
+        std::uint32_t timeout_ms;
+        memcpy (&since, request.data () + 4, sizeof (since));
+        memcpy (&timeout_ms, request.data () + 4 + sizeof (since), sizeof (timeout_ms));
+
+        if (table.get_version () > since || timeout_ms == 0) {
+            c.out += answer_watch (table.watch (since, std::chrono::milliseconds (0)));
+        } else {
+            c.watching = pending_watch {since, clock::now () + std::chrono::milliseconds (timeout_ms)};
+        }
+    }
+    c.in.erase (0, offset);
+}
+
+/**
+ * @brief Send as much of a client's pending answers as the socket takes.
+ *
+ * @return false when the client should be dropped.
+ */
+bool query_server::write_client (client &c) {
+    while (!c.out.empty ()) {
+        const ssize_t sent = ::send (c.fd, c.out.data (), c.out.size (), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        c.out.erase (0, sent);
+    }
+    return true;
+}
+
+/**
+ * @brief Serve clients until stop() is called.
+ */
+void query_server::run () {
+    std::vector<pollfd> fds;
+
+    while (true) {
+        fds.clear ();
+        fds.push_back ({wakeup[0], POLLIN, 0});
+        fds.push_back ({listener, POLLIN, 0});
+        for (const auto &c: clients) {
+            fds.push_back ({c.fd, static_cast<short> (POLLIN | (c.out.empty () ? 0 : POLLOUT)), 0});
+        }
+
+        // sleep no longer than the earliest parked watch may wait
+        int timeout = -1;
+        const auto now = clock::now ();
+        for (const auto &c: clients) {
+            if (c.watching) {
+                const auto wait = std::chrono::ceil<std::chrono::milliseconds> (c.watching->deadline - now).count ();
+                timeout = static_cast<int> (std::max<long long> (0, timeout < 0 ? wait : std::min<long long> (timeout, wait)));
+            }
+        }
+
+        if (poll (fds.data (), fds.size (), timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror ("Polling query sockets error");
+            return;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            char reasons[256];
+            ssize_t n;
+            while ((n = read (wakeup[0], reasons, sizeof (reasons))) > 0) {
+                if (std::find (reasons, reasons + n, WAKE_STOP) != reasons + n) {
+                    return;
+                }
+            }
+        }
+
+        // answer parked watches whose version moved on or whose time ran out
+        const auto version = table.get_version ();
+        const auto woken = clock::now ();
+        for (auto &c: clients) {
+            if (c.watching && (version > c.watching->since || woken >= c.watching->deadline)) {
+                c.out += answer_watch (table.watch (c.watching->since, std::chrono::milliseconds (0)));
+                c.watching.reset ();
+                process_requests (c);
+            }
+        }
+
+        // clients accepted below are polled from the next pass on
+        const std::size_t polled = clients.size ();
+
+        if (fds[1].revents & POLLIN) {
+            while (true) {
+                const int fd = accept4 (listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                    break;
+                }
+                clients.push_back ({fd, {}, {}, std::nullopt});
+            }
+        }
+
+        for (std::size_t i = polled; i-- > 0;) {
+            const auto revents = fds[i + 2].revents;
+            auto &c = clients[i];
+
+            bool keep = true;
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                // a client whose watch is parked still gets its input read, so hangups are seen
+                keep = read_client (c);
+            }
+            if (keep && !c.out.empty ()) {
+                keep = write_client (c);
+            }
+
+            if (!keep) {
+                close (c.fd);
+                clients.erase (clients.begin () + static_cast<std::ptrdiff_t> (i));
+            }
+        }
+    }
+}
+
+/**
+ * @brief Connect to a query server.
+ *
+ * @throws std::runtime_error If the server cannot be reached.
+ */
+query_client::query_client (const std::string &path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, path.c_str (), sizeof (addr.sun_path) - 1);
+
+    sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        throw std::runtime_error ("Failed to create query socket");
+    }
+
+    if (connect (sock, reinterpret_cast<sockaddr *>(&addr), sizeof (addr)) < 0) {
+        close (sock);
+        throw std::runtime_error ("Connecting to query socket error: " + std::string (strerror (errno)));
+    }
+}
+
+query_client::~query_client () {
+    close (sock);
+}
+
+static void read_exactly (const int sock, char *buffer, std::size_t length) {
+    while (length > 0) {
+        const ssize_t received = read (sock, buffer, length);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            throw std::runtime_error ("Query connection closed");
+        }
+        buffer += received;
+        length -= received;
+    }
+}
+
+/**
+ * @brief Send one request and wait for its response.
+ *
+ * @return The response body after the status header.
+ */
+std::string query_client::exchange (const std::string &request, QueryStatus &status) {
+    std::size_t offset = 0;
+    while (offset < request.size ()) {
+        const ssize_t sent = ::send (sock, request.data () + offset, request.size () - offset, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            throw std::runtime_error ("Sending query error: " + std::string (strerror (errno)));
+        }
+        offset += sent;
+    }
+
+    std::uint32_t length;
+    read_exactly (sock, reinterpret_cast<char *> (&length), sizeof (length));
+
+    std::string body (length, '\0');
+    read_exactly (sock, body.data (), length);
+
+    offset = 0;
+    status = static_cast<QueryStatus> (extract<std::uint8_t> (body, offset));
+    return body.substr (4);
+}
+
+/**
+ * @brief Decode one participant written by append_participant_record(). last_seen is not carried.
+ *
+ * @throws std::runtime_error If the record runs past the end of the input.
+ */
+participant extract_participant_record (const std::string_view body, std::size_t &offset) {
+    participant p;
+    p.set_first_seen (extract<std::uint64_t> (body, offset));
+    p.set_active (extract<std::uint8_t> (body, offset) != 0);
+    extract<std::uint8_t> (body, offset);
+
+    const auto id_length = extract<std::uint16_t> (body, offset);
+    const auto address_length = extract<std::uint16_t> (body, offset);
+    const auto architecture_length = extract<std::uint16_t> (body, offset);
+    const auto provides_count = extract<std::uint16_t> (body, offset);
+
+    p.set_id (extract_string (body, offset, id_length));
+    p.set_address (extract_string (body, offset, address_length));
+    p.set_architecture (extract_string (body, offset, architecture_length));
+
+    std::vector<std::string> provides;
+    for (std::uint16_t j = 0; j < provides_count; j++) {
+        const auto length = extract<std::uint16_t> (body, offset);
+        provides.push_back (extract_string (body, offset, length));
+    }
+    p.set_provides (provides);
+
+    return p;
+}
+
+/**
+ * @brief Append what a participant record leaves out, for the warm restart file.
+ */
+void append_participant_details (std::string &out, const participant &p) {
+    const auto operating_system = p.get_operating_system ();
+    const auto release = p.get_release ();
+    const auto &priorities = p.get_priorities ();
+
+    append<std::uint16_t> (out, operating_system.size ());
+    out += operating_system;
+    append<std::uint16_t> (out, release.size ());
+    out += release;
+
+    append<std::uint16_t> (out, priorities.size ());
+    for (const auto &[service, priority]: priorities) {
+        append<std::uint16_t> (out, service.size ());
+        out += service;
+        append<std::int32_t> (out, priority);
+    }
+}
+
+/**
+ * @brief Decode what append_participant_details() wrote into a participant taken from its record.
+ *
+ * @throws std::runtime_error If the details run past the end of the input.
+ */
+void extract_participant_details (const std::string_view body, std::size_t &offset, participant &p) {
+    const auto operating_system_length = extract<std::uint16_t> (body, offset);
+    p.set_operating_system (extract_string (body, offset, operating_system_length));
+    const auto release_length = extract<std::uint16_t> (body, offset);
+    p.set_release (extract_string (body, offset, release_length));
+
+    const auto count = extract<std::uint16_t> (body, offset);
+
+    std::map<std::string, int> priorities;
+    for (std::uint16_t i = 0; i < count; i++) {
+        const auto length = extract<std::uint16_t> (body, offset);
+        auto service = extract_string (body, offset, length);
+        priorities[std::move (service)] = extract<std::int32_t> (body, offset);
+    }
+    p.set_priorities (priorities);
+}
+
+std::vector<participant> query_client::decode_records (const std::string &body) {
+    std::size_t offset = 0;
+    const auto count = extract<std::uint32_t> (body, offset);
+
+    std::vector<participant> records;
+    records.reserve (count);
+
+    for (std::uint32_t i = 0; i < count; i++) {
+        records.push_back (extract_participant_record (body, offset));
+    }
+
+    return records;
+}
+
+std::vector<participant> query_client::list_all () {
+    QueryStatus status;
+    return decode_records (exchange (encode_query_request (QUERY_LIST_ALL), status));
+}
+
+std::optional<participant> query_client::get_by_id (const std::string &id) {
+    QueryStatus status;
+    auto records = decode_records (exchange (encode_query_request (QUERY_GET_BY_ID, id), status));
+
+    if (status != QUERY_OK || records.empty ()) {
+        return std::nullopt;
+    }
+    return records.front ();
+}
+
+std::vector<participant> query_client::providers_of (const std::string &service) {
+    QueryStatus status;
+    return decode_records (exchange (encode_query_request (QUERY_PROVIDERS_OF, service), status));
+}
+
+/**
+ * @brief Wait for the membership to move past a version and return what changed.
+ *
+ * @see membership::watch()
+ */
+watch_result query_client::watch (const std::uint64_t since, const std::chrono::milliseconds timeout) {
+    QueryStatus status;
+    const auto body = exchange (encode_watch_request (since, timeout), status);
+
+    std::size_t offset = 0;
+    const auto count = extract<std::uint32_t> (body, offset);
+
+    watch_result result;
+    result.version = extract<std::uint64_t> (body, offset);
+    result.reset = status == QUERY_RESET;
+
+    for (std::uint32_t i = 0; i < count; i++) {
+        const auto version = extract<std::uint64_t> (body, offset);
+        const auto kind = static_cast<ChangeKind> (extract<std::uint8_t> (body, offset));
+        extract<std::uint8_t> (body, offset);
+
+        result.changes.push_back ({version, kind, std::make_shared<const participant> (extract_participant_record (body, offset))});
+    }
+
+    return result;
+}
+
+/**
+ * @brief Decode the JSON document of a stats or history response body.
+ */
+static json decode_json (const std::string &body) {
+    std::size_t offset = 0;
+    const auto length = extract<std::uint32_t> (body, offset);
+    return json::parse (extract_string (body, offset, length));
+}
+
+/**
+ * @brief Fetch the server's counters.
+ *
+ * @throws std::runtime_error If the server has no statistics to offer.
+ */
+json query_client::statistics () {
+    QueryStatus status;
+    const auto body = exchange (encode_query_request (QUERY_STATS), status);
+
+    if (status != QUERY_OK) {
+        throw std::runtime_error ("Query server does not provide statistics");
+    }
+
+    return decode_json (body);
+}
+
+/**
+ * @brief Fetch the transitions and heartbeat gaps of one participant, even one that has left.
+ *
+ * @return The history, or nothing when the server has none for that id.
+ */
+std::optional<json> query_client::history (const std::string &id) {
+    QueryStatus status;
+    const auto body = exchange (encode_query_request (QUERY_HISTORY, id), status);
+
+    if (status != QUERY_OK) {
+        return std::nullopt;
+    }
+    return decode_json (body);
+}
+
+/**
+ * @brief Fetch the joins, leaves and current state of every participant with a history.
+ */
+json query_client::history_summary () {
+    QueryStatus status;
+    return decode_json (exchange (encode_query_request (QUERY_HISTORY), status));
+}
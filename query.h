@@ -0,0 +1,157 @@
+#ifndef HOSTMON_QUERY_H
+#define HOSTMON_QUERY_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#include "monitor.h"
+
+using json = nlohmann::json;
+
+// produces the counters returned by a stats query
+using statistics_source = std::function<json ()>;
+
+/*
+ * The local query protocol, spoken over a Unix stream socket. All integers are
+ * in host byte order since both ends are on the same machine.
+ *
+ * request:  [u8 op][u8 reserved][u16 argument length][argument]
+ * response: [u32 body length] then a body of
+ *           [u8 status][u8 reserved][u16 reserved][u32 record count][records]
+ * record:   [u64 first seen][u8 active][u8 reserved]
+ *           [u16 id length][u16 address length][u16 architecture length][u16 provides count]
+ *           [id][address][architecture] then per service [u16 length][name]
+ *
+ * A providers request's argument is a service name; its records come in
+ * order of the providers' advertised priority for it, then id.
+ *
+ * A watch request's argument is [u64 since][u32 timeout ms]. Its response body
+ * is [u8 status][u8 reserved][u16 reserved][u32 change count][u64 version]
+ * followed by one [u64 version][u8 kind][u8 reserved][record] per change, the
+ * kind being a ChangeKind and an update's record the participant as it now
+ * is; the status is QUERY_RESET when the caller fell behind the server's change log.
+ *
+ * Stats and history requests are answered in JSON: the response body is
+ * [u8 status][u8 reserved][u16 reserved][u32 length] and then that many bytes
+ * of JSON. A stats request takes no argument and returns the engine's
+ * counters. A history request takes a participant id and returns its
+ * transitions and heartbeat gaps, or with an empty argument a summary of
+ * every participant with a history.
+ *
+ * The warm restart file follows each record with the details the protocol
+ * leaves out: [u16 operating system length][operating system][u16 release length][release]
+ * [u16 priority count] then per priority [u16 length][service][i32 priority].
+ */
+
+enum QueryOperation : std::uint8_t {
+    QUERY_LIST_ALL = 1,
+    QUERY_GET_BY_ID = 2,
+    QUERY_PROVIDERS_OF = 3,
+    QUERY_WATCH = 4,
+    QUERY_STATS = 5,
+    QUERY_HISTORY = 6
+};
+
+enum QueryStatus : std::uint8_t {
+    QUERY_OK = 0,
+    QUERY_NOT_FOUND = 1,
+    QUERY_BAD_REQUEST = 2,
+    QUERY_RESET = 3
+};
+
+std::string encode_query_request (QueryOperation op, const std::string &argument = "");
+std::string encode_watch_request (std::uint64_t since, std::chrono::milliseconds timeout);
+std::string answer_query (const membership_snapshot &snapshot, const std::string &request);
+std::string answer_watch (const watch_result &result);
+std::string answer_json (QueryStatus status, const json &body);
+
+void append_participant_record (std::string &out, const participant &p);
+participant extract_participant_record (std::string_view body, std::size_t &offset);
+void append_participant_details (std::string &out, const participant &p);
+void extract_participant_details (std::string_view body, std::size_t &offset, participant &p);
+
+/**
+ * @class query_server
+ * @brief Answers membership queries from local processes over a Unix socket.
+ *
+ * Every answer is built from the table's published snapshot, so any amount
+ * of querying never contends with report_participant() for the table's lock.
+ * A single thread serves all clients with poll(). Watch requests that cannot
+ * be answered yet are parked; one membership change wakes the thread once and
+ * answers every parked watcher.
+ */
+class query_server {
+    using clock = std::chrono::steady_clock;
+
+    struct pending_watch {
+        std::uint64_t since;
+        clock::time_point deadline;
+    };
+
+    struct client {
+        int fd;
+        std::string in;
+        std::string out;
+        std::optional<pending_watch> watching;
+    };
+
+    membership &table;
+    std::string path;
+    int listener;
+    int wakeup[2];
+    int subscription;
+    statistics_source statistics;
+
+    std::vector<client> clients;
+
+    bool read_client (client &c);
+    void process_requests (client &c);
+    bool write_client (client &c);
+    void signal (char reason);
+
+public:
+    query_server (membership &table, std::string path, statistics_source statistics = nullptr);
+    ~query_server ();
+
+    query_server (const query_server &) = delete;
+    query_server &operator= (const query_server &) = delete;
+
+    void run ();
+    void stop ();
+};
+
+/**
+ * @class query_client
+ * @brief A blocking client for the local query protocol.
+ *
+ * Records come back as participant objects; last_seen is not carried.
+ */
+class query_client {
+    int sock;
+
+    std::string exchange (const std::string &request, QueryStatus &status);
+    static std::vector<participant> decode_records (const std::string &body);
+
+public:
+    explicit query_client (const std::string &path);
+    ~query_client ();
+
+    query_client (const query_client &) = delete;
+    query_client &operator= (const query_client &) = delete;
+
+    std::vector<participant> list_all ();
+    std::optional<participant> get_by_id (const std::string &id);
+    std::vector<participant> providers_of (const std::string &service);
+    watch_result watch (std::uint64_t since, std::chrono::milliseconds timeout);
+    json statistics ();
+    std::optional<json> history (const std::string &id);
+    json history_summary ();
+};
+
+#endif //HOSTMON_QUERY_H
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "monitor.h"
+#include "query.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+/**
+ * @brief Print the command line options understood by hostmon-query-bench.
+ */
+void usage () {
+    std::cerr << "usage: hostmon-query-bench [options]\n"
+              << "  --participants N   participants in the table (1000)\n"
+              << "  --clients N        concurrent query clients (4)\n"
+              << "  --seconds N        length of each phase (3)\n"
+              << "  --op NAME          list, get or providers (get)\n"
+              << "  --watchers N       parked watchers woken by a single change (0)\n";
+}
+
+/**
+ * @brief Park watchers on the server, make one change and time how long until every one is answered.
+ *
+ * @return The time in microseconds from the change until the last watcher had its answer.
+ */
+double watch_fanout (membership &table, const std::string &path, const std::size_t watchers) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, path.c_str (), sizeof (addr.sun_path) - 1);
+
+    const auto request = encode_watch_request (table.get_version (), std::chrono::seconds (30));
+
+    std::vector<pollfd> fds;
+    for (std::size_t i = 0; i < watchers; i++) {
+        const int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect (fd, reinterpret_cast<sockaddr *>(&addr), sizeof (addr)) < 0
+            || write (fd, request.data (), request.size ()) != static_cast<ssize_t> (request.size ())) {
+            throw std::runtime_error ("Failed to park watcher " + std::to_string (i));
+        }
+        fds.push_back ({fd, POLLIN, 0});
+    }
+
+    // give the server time to park them all
+    std::this_thread::sleep_for (std::chrono::milliseconds (200));
+
+    json j = {};
+    j["id"] = "watch-trigger";
+    j["address"] = "10.255.255.255";
+    j["architecture"] = "x86_64";
+
+    const auto start = bench_clock::now ();
+    table.report_participant (j);
+
+    std::size_t answered = 0;
+    char buffer[4096];
+    while (answered < watchers) {
+        poll (fds.data (), fds.size (), 1000);
+        for (auto &pfd: fds) {
+            if (pfd.fd >= 0 && (pfd.revents & POLLIN) && read (pfd.fd, buffer, sizeof (buffer)) > 0) {
+                close (pfd.fd);
+                pfd.fd = -1;
+                answered++;
+            }
+        }
+    }
+
+    return std::chrono::duration<double, std::micro> (bench_clock::now () - start).count ();
+}
+
+/**
+ * @brief Refresh participants as fast as possible and count how many reports were handled.
+ */
+std::uint64_t report_loop (membership &table, const std::vector<json> &adverts, const std::atomic<bool> &running) {
+    std::uint64_t reports = 0;
+
+    while (running.load (std::memory_order_relaxed)) {
+        for (const auto &j: adverts) {
+            table.report_participant (j);
+        }
+        reports += adverts.size ();
+    }
+
+    return reports;
+}
+
+/**
+ * @file query_bench.cpp
+ * @brief Measures query latency and throughput, and whether querying slows report_participant().
+ *
+ * Runs two phases of equal length against an in-process table served on a
+ * private socket: first report_participant() alone, then report_participant()
+ * while the clients query as fast as they can. With --watchers, finally times
+ * how long one change takes to answer that many parked watch requests.
+ */
+int main (const int argc, char *argv[]) {
+    std::size_t participants = 1000;
+    std::size_t clients = 4;
+    std::size_t watchers = 0;
+    int seconds = 3;
+    std::string op_name = "get";
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string arg = argv[i];
+        const std::string value = argv[i + 1];
+
+        if (arg == "--participants") {
+            participants = std::stoul (value);
+        } else if (arg == "--clients") {
+            clients = std::stoul (value);
+        } else if (arg == "--seconds") {
+            seconds = std::stoi (value);
+        } else if (arg == "--watchers") {
+            watchers = std::stoul (value);
+        } else if (arg == "--op") {
+            op_name = value;
+        } else {
+            usage ();
+            return 1;
+        }
+    }
+
+    if (argc % 2 == 0 || participants == 0 || (op_name != "list" && op_name != "get" && op_name != "providers")) {
+        usage ();
+        return 1;
+    }
+
+    const std::vector<std::string> services = {"email", "propulsion", "storage", "compute"};
+
+    membership table (get_timestamp, [] (const std::string &, int, const std::string &) {}, 3600000, false);
+
+    std::vector<json> adverts;
+    for (std::size_t i = 0; i < participants; i++) {
+        json j = {};
+        j["id"] = "host-" + std::to_string (i);
+        j["address"] = "10.0." + std::to_string (i / 256) + "." + std::to_string (i % 256);
+        j["active"] = true;
+        j["architecture"] = "x86_64";
+        j["provides"] = {services[i % services.size ()], services[(i / services.size ()) % services.size ()]};
+
+        table.report_participant (j);
+        adverts.push_back (j);
+    }
+
+    const std::string path = "/tmp/hostmon-query-bench-" + std::to_string (getpid ()) + ".sock";
+    query_server server (table, path);
+    std::thread server_thread (&query_server::run, &server);
+
+    std::atomic<bool> running = true;
+    const auto phase = std::chrono::seconds (seconds);
+
+    // phase one: report_participant alone
+    std::uint64_t baseline = 0;
+    {
+        std::thread reporter ([&] { baseline = report_loop (table, adverts, running); });
+        std::this_thread::sleep_for (phase);
+        running = false;
+        reporter.join ();
+    }
+
+    // phase two: report_participant under query load
+    running = true;
+    std::uint64_t loaded = 0;
+    std::vector<std::vector<double>> latencies (clients);
+
+    std::thread reporter ([&] { loaded = report_loop (table, adverts, running); });
+    std::vector<std::thread> workers;
+
+    for (std::size_t c = 0; c < clients; c++) {
+        workers.emplace_back ([&, c] {
+            query_client client (path);
+            std::size_t n = c;
+
+            while (running.load (std::memory_order_relaxed)) {
+                const auto start = bench_clock::now ();
+
+                if (op_name == "list") {
+                    client.list_all ();
+                } else if (op_name == "get") {
+                    client.get_by_id ("host-" + std::to_string (n++ % participants));
+                } else {
+                    client.providers_of (services[n++ % services.size ()]);
+                }
+
+                latencies[c].push_back (std::chrono::duration<double, std::micro> (bench_clock::now () - start).count ());
+            }
+        });
+    }
+
+    std::this_thread::sleep_for (phase);
+    running = false;
+    reporter.join ();
+    for (auto &w: workers) {
+        w.join ();
+    }
+
+    const double fanout = watchers > 0 ? watch_fanout (table, path, watchers) : 0.0;
+
+    server.stop ();
+    server_thread.join ();
+
+    std::vector<double> all;
+    for (const auto &l: latencies) {
+        all.insert (all.end (), l.begin (), l.end ());
+    }
+    std::sort (all.begin (), all.end ());
+
+    auto percentile = [&all] (const double p) {
+        return all.empty () ? 0.0 : all[std::min (all.size () - 1, static_cast<std::size_t> (p * all.size ()))];
+    };
+
+    std::cout << std::fixed << std::setprecision (1)
+              << "participants:                  " << participants << "\n"
+              << "clients:                       " << clients << "\n"
+              << "operation:                     " << op_name << "\n"
+              << "queries/s:                     " << all.size () / static_cast<double> (seconds) << "\n"
+              << "latency p50 / p99 / p99.9 us:  " << percentile (0.5) << " / " << percentile (0.99)
+              << " / " << percentile (0.999) << "\n"
+              << "reports/s alone:               " << baseline / static_cast<double> (seconds) << "\n"
+              << "reports/s under query load:    " << loaded / static_cast<double> (seconds) << "\n";
+
+    if (watchers > 0) {
+        std::cout << "watchers woken by one change:  " << watchers << " in " << fanout << " us\n";
+    }
+
+    std::cout << std::flush;
+
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include "ratelimit.h"
+
+#include <algorithm>
+#include <iostream>
+
+bool token_bucket::take (const double rate, const double burst, const clock::time_point now, const double cost) {
+    const std::chrono::duration<double> elapsed = now - refilled;
+    if (elapsed.count () > 0) {
+        tokens = std::min (burst, tokens + elapsed.count () * rate);
+        refilled = now;
+    }
+
+    if (tokens < cost) {
+        return false;
+    }
+    tokens -= cost;
+    return true;
+}
+
+bool token_bucket::idle (const double rate, const double burst, const clock::time_point now) const {
+    const std::chrono::duration<double> elapsed = now - refilled;
+    return tokens + elapsed.count () * rate >= burst;
+}
+
+/**
+ * @brief Read ingest limits from the "ingest" object of config.json.
+ *
+ * Recognises "per_source_rate", "per_source_burst", "global_rate",
+ * "global_burst", "offender_drops", "max_sources" and "trusted_sources"; anything
+ * absent keeps its default. A null object gives the defaults.
+ */
+ingest_limits limits_from_configuration (const json &settings) {
+    ingest_limits limits;
+    if (!settings.is_object ()) {
+        return limits;
+    }
+
+    limits.per_source_rate = settings.value ("per_source_rate", limits.per_source_rate);
+    limits.per_source_burst = settings.value ("per_source_burst", limits.per_source_burst);
+    limits.global_rate = settings.value ("global_rate", limits.global_rate);
+    limits.global_burst = settings.value ("global_burst", limits.global_burst);
+    limits.offender_drops = settings.value ("offender_drops", limits.offender_drops);
+    limits.max_sources = settings.value ("max_sources", limits.max_sources);
+    limits.trusted_sources = settings.value ("trusted_sources", limits.trusted_sources);
+
+    return limits;
+}
+
+ingest_limiter::ingest_limiter (const ingest_limits limits)
+    : limits (limits),
+      overflow {token_bucket (limits.per_source_burst, clock::now ())},
+      global (limits.global_burst, clock::now ()) {
+}
+
+/**
+ * @brief Find or create the state of one sender. Called with limiter_mutex held.
+ *
+ * When the table is full, senders that have gone quiet are forgotten; if none
+ * have, the new sender is charged to the shared overflow bucket instead, so a
+ * flood of spoofed addresses cannot grow the table without bound.
+ */
+ingest_limiter::source_state &ingest_limiter::state_of (const std::string &source, const clock::time_point now) {
+    if (const auto it = sources.find (source); it != sources.end ()) {
+        return it->second;
+    }
+
+    if (sources.size () >= limits.max_sources) {
+        std::erase_if (sources, [&] (const auto &entry) {
+            const auto &state = entry.second;
+            return !state.offender && state.bucket.idle (limits.per_source_rate, limits.per_source_burst, now);
+        });
+    }
+
+    if (sources.size () >= limits.max_sources) {
+        return overflow;
+    }
+
+    return sources.emplace (source, source_state {token_bucket (limits.per_source_burst, now)}).first->second;
+}
+
+/**
+ * @brief Whether a sender is configured to relay for others. Called with limiter_mutex held.
+ */
+bool ingest_limiter::is_relay (const std::string &source) const {
+    return std::find (limits.trusted_sources.begin (), limits.trusted_sources.end (), source)
+           != limits.trusted_sources.end ();
+}
+
+/**
+ * @brief Count a datagram refused by a sender's own bucket, flagging the sender once it is noisy. Called with limiter_mutex held.
+ *
+ * @return false, for the caller to return.
+ */
+bool ingest_limiter::refuse (source_state &state, const std::string &sender) {
+    state.dropped++;
+    dropped_source++;
+
+    if (!state.offender && state.dropped >= limits.offender_drops) {
+        state.offender = true;
+        std::cerr << "Rate limiting noisy sender " << sender << ": "
+                  << state.dropped << " datagrams dropped\n";
+    }
+    return false;
+}
+
+/**
+ * @brief Charge one datagram from `source` against its own and the global budget.
+ *
+ * A relay's datagrams are charged to the global budget only here, and to
+ * their origin by admit_origin() once parsed.
+ *
+ * @param source The sender's address as reported by the transport.
+ * @param now The arrival time.
+ * @return true if the datagram should be processed, false if it should be dropped unparsed.
+ */
+bool ingest_limiter::admit (const std::string &source, const clock::time_point now) {
+    std::lock_guard lock (limiter_mutex);
+
+    const bool per_source = limits.per_source_rate > 0 && !is_relay (source);
+    auto &state = per_source ? state_of (source, now) : overflow;
+
+    if (per_source && !state.bucket.take (limits.per_source_rate, limits.per_source_burst, now)) {
+        return refuse (state, source);
+    }
+
+    if (limits.global_rate > 0 && !global.take (limits.global_rate, limits.global_burst, now)) {
+        dropped_global++;
+        return false;
+    }
+
+    state.accepted++;
+    accepted++;
+    return true;
+}
+
+/**
+ * @brief Charge a datagram we asked for, such as a sync reply, against the global budget only.
+ *
+ * A reply to our own request is as large as the difference it repairs, so
+ * its sender's bucket, sized for heartbeats, would cut it short and then
+ * starve that sender's heartbeats as well.
+ */
+bool ingest_limiter::admit_expected (const clock::time_point now) {
+    std::lock_guard lock (limiter_mutex);
+
+    if (limits.global_rate > 0 && !global.take (limits.global_rate, limits.global_burst, now)) {
+        dropped_global++;
+        return false;
+    }
+
+    accepted++;
+    return true;
+}
+
+/**
+ * @brief Charge a parsed datagram from a relay to the host it speaks for.
+ *
+ * Only configured relays are charged here: a datagram's own "bridges" field
+ * is not trusted, or any sender could claim to relay, rotate the origin it
+ * names and escape its per-source budget. Datagrams from anyone else were
+ * charged in full by admit() and pass unchanged.
+ *
+ * @param source The sender's address, as given to admit().
+ * @param origin The id the datagram speaks for.
+ * @return true if the datagram should be processed.
+ */
+bool ingest_limiter::admit_origin (const std::string &source, const std::string &origin,
+                                   const clock::time_point now) {
+    std::lock_guard lock (limiter_mutex);
+
+    if (limits.per_source_rate <= 0 || !is_relay (source)) {
+        return true;
+    }
+
+    const auto key = "origin " + origin;
+    auto &state = state_of (key, now);
+    if (!state.bucket.take (limits.per_source_rate, limits.per_source_burst, now)) {
+        return refuse (state, key);
+    }
+    return true;
+}
+
+/**
+ * @brief The senders flagged for exceeding their rate.
+ */
+std::vector<std::string> ingest_limiter::offenders () const {
+    std::lock_guard lock (limiter_mutex);
+
+    std::vector<std::string> flagged;
+    for (const auto &[source, state]: sources) {
+        if (state.offender) {
+            flagged.push_back (source);
+        }
+    }
+    std::sort (flagged.begin (), flagged.end ());
+    return flagged;
+}
+
+/**
+ * @brief Counters for the stats query: totals, per-offender drops and the tracked source count.
+ */
+json ingest_limiter::statistics () const {
+    std::lock_guard lock (limiter_mutex);
+
+    json offenders = json::object ();
+    for (const auto &[source, state]: sources) {
+        if (state.offender) {
+            offenders[source] = {{"accepted", state.accepted}, {"dropped", state.dropped}};
+        }
+    }
+
+    return {
+        {"accepted", accepted},
+        {"dropped_per_source", dropped_source},
+        {"dropped_global", dropped_global},
+        {"sources", sources.size ()},
+        {"relays", limits.trusted_sources.size ()},
+        {"offenders", offenders}
+    };
+}
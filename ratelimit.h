@@ -0,0 +1,112 @@
+#ifndef HOSTMON_RATELIMIT_H
+#define HOSTMON_RATELIMIT_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * @class token_bucket
+ * @brief Admits events at a sustained rate with bursts up to a fixed depth.
+ */
+class token_bucket {
+    using clock = std::chrono::steady_clock;
+
+    double tokens;
+    clock::time_point refilled;
+
+public:
+    token_bucket (double burst, clock::time_point now) : tokens (burst), refilled (now) {}
+
+    // refill for the time since the last call, then take `cost` tokens if there are that many
+    bool take (double rate, double burst, clock::time_point now, double cost = 1);
+
+    // true once the bucket has refilled to its full depth, i.e. its sender went quiet
+    [[nodiscard]] bool idle (double rate, double burst, clock::time_point now) const;
+};
+
+/**
+ * @brief Limits for ingest_limiter, in datagrams per second. A rate of 0 disables that limit.
+ */
+struct ingest_limits {
+    double per_source_rate = 20;
+    double per_source_burst = 40;
+    double global_rate = 5000;
+    double global_burst = 10000;
+
+    // a source is flagged as an offender once this many of its datagrams were dropped
+    std::uint64_t offender_drops = 100;
+    // the number of sources tracked at once; further sources share one bucket
+    std::size_t max_sources = 4096;
+
+    // senders that speak for many hosts, such as bridges; their datagrams are charged per origin
+    std::vector<std::string> trusted_sources;
+};
+
+ingest_limits limits_from_configuration (const json &settings);
+
+/**
+ * @class ingest_limiter
+ * @brief Decides whether a received datagram is worth parsing.
+ *
+ * Each sender address gets its own token bucket and everything admitted
+ * shares one global bucket, so a single host sending in a tight loop is cut
+ * down to its own rate while the cluster's advertisements keep flowing, and
+ * many senders together cannot push the receiver past the global budget.
+ * Datagrams refused by a sender's own bucket do not spend global tokens.
+ *
+ * A relay, such as a bridge or a tunnel peer, sends for a whole domain from
+ * one address, so its own bucket would starve every host behind it. Relays
+ * are the configured trusted sources and bridge tunnel peers only, never
+ * senders that merely claim to relay; before parsing they are charged to the
+ * global bucket only, and after parsing admit_origin() charges each datagram to a
+ * bucket of the host it speaks for, so every host behind a relay gets the
+ * budget it would have had on our own segment.
+ *
+ * The check costs one hash lookup and is meant to run before any parsing.
+ */
+class ingest_limiter {
+    using clock = std::chrono::steady_clock;
+
+    struct source_state {
+        token_bucket bucket;
+        std::uint64_t accepted = 0;
+        std::uint64_t dropped = 0;
+        bool offender = false;
+    };
+
+    ingest_limits limits;
+
+    mutable std::mutex limiter_mutex;
+    std::unordered_map<std::string, source_state> sources;
+    source_state overflow;
+    token_bucket global;
+
+    std::uint64_t accepted = 0;
+    std::uint64_t dropped_source = 0;
+    std::uint64_t dropped_global = 0;
+
+    source_state &state_of (const std::string &source, clock::time_point now);
+    [[nodiscard]] bool is_relay (const std::string &source) const;
+    bool refuse (source_state &state, const std::string &sender);
+
+public:
+    explicit ingest_limiter (ingest_limits limits = {});
+
+    [[nodiscard]] bool admit (const std::string &source, clock::time_point now = clock::now ());
+    [[nodiscard]] bool admit_expected (clock::time_point now = clock::now ());
+    [[nodiscard]] bool admit_origin (const std::string &source, const std::string &origin,
+                                     clock::time_point now = clock::now ());
+
+    [[nodiscard]] std::vector<std::string> offenders () const;
+    [[nodiscard]] json statistics () const;
+};
+
+#endif //HOSTMON_RATELIMIT_H
@@ -0,0 +1,194 @@
+#!/usr/bin/env bash
+#
+# Starts N hostmon processes, each in its own network namespace, bridged
+# together so multicast on 224.1.1.1 reaches every node, and measures how long
+# it takes until every node's participant table contains every other node:
+#
+#   cold start  - all N nodes started at once
+#   join        - one more node started into a converged cluster of N
+#   heal        - the upper half of the nodes is moved to a separate bridge
+#                 until both halves have expired each other, then moved back
+#
+# Convergence is computed from the "HH:MM:SS.mmm: id online|offline" lines each
+# node prints, so the numbers are not skewed by how often the harness polls.
+# An expiry held back as a suspected partition prints "id held offline" and
+# counts as a departure only once its "id offline" is released.
+#
+# usage: sudo scripts/cluster_harness.sh [-b path/to/hostmon] [-t timeout_s] N [N ...]
+#
+# requires root, iproute2 and a hostmon binary; results are printed as a table.
+
+set -euo pipefail
+
+HOSTMON=${HOSTMON:-build/hostmon}
+TIMEOUT=30
+PREFIX=hm
+WORK=$(mktemp -d /tmp/hostmon-harness.XXXXXX)
+
+while getopts "b:t:" opt; do
+    case $opt in
+        b) HOSTMON=$OPTARG ;;
+        t) TIMEOUT=$OPTARG ;;
+        *) echo "usage: $0 [-b hostmon] [-t timeout_s] N [N ...]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [[ $# -eq 0 ]]; then
+    echo "usage: $0 [-b hostmon] [-t timeout_s] N [N ...]" >&2
+    exit 1
+fi
+
+if [[ $EUID -ne 0 ]]; then
+    echo "$0 must run as root to create network namespaces" >&2
+    exit 1
+fi
+
+HOSTMON=$(realpath "$HOSTMON")
+PIDS=()
+NODES=0
+
+# milliseconds since midnight UTC, the same clock print_timestamp() uses
+now_ms () {
+    local ns
+    ns=$(date -u +%s%N)
+    echo $(( (ns / 1000000) % 86400000 ))
+}
+
+setup_network () {
+    local count=$1
+
+    for br in ${PREFIX}br0 ${PREFIX}br1; do
+        ip link add "$br" type bridge
+        ip link set "$br" type bridge mcast_snooping 0
+        ip link set "$br" up
+    done
+
+    for ((i = 0; i < count; i++)); do
+        local ns=${PREFIX}$i
+        ip netns add "$ns"
+        ip link add "${ns}-br" type veth peer name eth0 netns "$ns"
+        ip link set "${ns}-br" master ${PREFIX}br0 up
+        ip -n "$ns" link set lo up
+        ip -n "$ns" addr add "10.99.$((i / 250)).$((i % 250 + 1))/16" dev eth0
+        ip -n "$ns" link set eth0 up
+        ip -n "$ns" route add 224.0.0.0/4 dev eth0
+    done
+    NODES=$count
+}
+
+teardown () {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    PIDS=()
+
+    for ((i = 0; i < NODES; i++)); do
+        ip netns del "${PREFIX}$i" 2>/dev/null || true
+    done
+    ip link del ${PREFIX}br0 2>/dev/null || true
+    ip link del ${PREFIX}br1 2>/dev/null || true
+    NODES=0
+}
+
+trap 'teardown; rm -rf "$WORK"' EXIT
+
+# hostmon reads ../config.json, so each node runs from its own run/ directory
+start_node () {
+    local i=$1
+    local dir=$WORK/node$i
+
+    mkdir -p "$dir/run"
+    echo "{\"id\": \"node$i\", \"provides\": [], \"query_socket\": \"$dir/query.sock\"}" > "$dir/config.json"
+    : > "$dir/log"
+
+    (cd "$dir/run" && exec ip netns exec "${PREFIX}$i" "$HOSTMON" >> "$dir/log" 2>&1) &
+    PIDS+=($!)
+}
+
+# prints the time (ms since midnight) at which the node's table first held
+# `expected` participants at or after `since`, or nothing if it never did
+converged_at () {
+    local log=$1 expected=$2 since=$3
+
+    awk -v expected="$expected" -v since="$since" '
+        $3 == "online" || $3 == "offline" {
+            split(substr($1, 1, length($1) - 1), t, "[:.]")
+            ts = ((t[1] * 60 + t[2]) * 60 + t[3]) * 1000 + t[4]
+            if ($3 == "online" && !($2 in table)) { table[$2] = 1; count++ }
+            if ($3 == "offline" && ($2 in table)) { delete table[$2]; count-- }
+            if (ts >= since && count == expected) { print ts; exit }
+        }' "$log"
+}
+
+# waits until nodes [0, count) all hold `count` participants, prints elapsed ms
+measure () {
+    local count=$1 since=$2
+    local deadline=$((SECONDS + TIMEOUT))
+
+    while ((SECONDS < deadline)); do
+        local latest=0 done=1
+        for ((i = 0; i < count; i++)); do
+            local at
+            at=$(converged_at "$WORK/node$i/log" "$count" "$since")
+            if [[ -z $at ]]; then
+                done=0
+                break
+            fi
+            ((at > latest)) && latest=$at
+        done
+
+        if ((done)); then
+            echo $((latest - since))
+            return
+        fi
+        sleep 0.1
+    done
+
+    echo "timeout"
+}
+
+run_one () {
+    local n=$1
+
+    setup_network $((n + 1))
+
+    # cold start
+    local t0
+    t0=$(now_ms)
+    for ((i = 0; i < n; i++)); do
+        start_node "$i"
+    done
+    local cold
+    cold=$(measure "$n" "$t0")
+
+    # join
+    t0=$(now_ms)
+    start_node "$n"
+    local join
+    join=$(measure $((n + 1)) "$t0")
+
+    # partition, let both halves expire each other, then heal
+    local half=$(((n + 1) / 2))
+    for ((i = half; i <= n; i++)); do
+        ip link set "${PREFIX}$i-br" master ${PREFIX}br1
+    done
+    sleep 2
+
+    t0=$(now_ms)
+    for ((i = half; i <= n; i++)); do
+        ip link set "${PREFIX}$i-br" master ${PREFIX}br0
+    done
+    local heal
+    heal=$(measure $((n + 1)) "$t0")
+
+    teardown
+
+    printf "%8s %14s %10s %10s\n" "$n" "$cold" "$join" "$heal"
+}
+
+printf "%8s %14s %10s %10s\n" "N" "cold start ms" "join ms" "heal ms"
+for n in "$@"; do
+    run_one "$n"
+done
@@ -0,0 +1,137 @@
+#include "service_groups.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <arpa/inet.h>
+
+#include "utilities.h"
+
+/**
+ * @brief Read the service group mapping from the "service_groups" object of config.json.
+ *
+ * Recognises "base" and "count"; the mapping is on whenever the object is present.
+ *
+ * @throws std::runtime_error If "base" is not an IPv4 address, "count" is 0, or
+ *         the groups from "base" to "base" + "count" - 1 are not all multicast addresses.
+ */
+service_group_settings service_groups_from_configuration (const json &settings) {
+    service_group_settings result;
+    if (!settings.is_object ()) {
+        return result;
+    }
+
+    result.enabled = true;
+    result.base = settings.value ("base", result.base);
+    result.count = settings.value ("count", result.count);
+
+    in_addr address = {};
+    if (inet_pton (AF_INET, result.base.c_str (), &address) != 1 || result.count == 0) {
+        throw std::runtime_error ("Bad service_groups: base must be an IPv4 address and count at least 1");
+    }
+
+    // 224.0.0.0/4; computed wide so a count running past 255.255.255.255 is caught too
+    const std::uint64_t first = ntohl (address.s_addr);
+    const std::uint64_t last = first + result.count - 1;
+    if (first < 0xe0000000 || last > 0xefffffff) {
+        throw std::runtime_error ("Bad service_groups: base to base + count - 1 must all be multicast addresses");
+    }
+
+    return result;
+}
+
+/**
+ * @brief The multicast group a service's providers advertise on.
+ */
+std::string group_of_service (const service_group_settings &settings, const std::string &service) {
+    in_addr address = {};
+    inet_pton (AF_INET, settings.base.c_str (), &address);
+
+    const auto index = crc32 (service.data (), service.size ()) % settings.count;
+    address.s_addr = htonl (ntohl (address.s_addr) + index);
+
+    char text[INET_ADDRSTRLEN];
+    inet_ntop (AF_INET, &address, text, sizeof (text));
+    return text;
+}
+
+/**
+ * @brief The groups our heartbeats go to: those of the services we provide, or the common group when we provide none.
+ *
+ * @param provides The service entries as they appear in config.json.
+ */
+std::vector<std::string> sending_groups (const service_group_settings &settings, const json &provides,
+                                         const std::string &common) {
+    if (!settings.enabled) {
+        return {common};
+    }
+
+    std::vector<std::string> groups;
+    for (const auto &entry: provides) {
+        if (!entry.contains ("service") || !entry["service"].is_string ()) {
+            continue;
+        }
+        const auto group = group_of_service (settings, entry["service"].get<std::string> ());
+        if (std::find (groups.begin (), groups.end (), group) == groups.end ()) {
+            groups.push_back (group);
+        }
+    }
+
+    if (groups.empty ()) {
+        groups.push_back (common);
+    }
+    return groups;
+}
+
+/**
+ * @brief The groups we join: those of the services we consume, or the common group and every service group when we name none.
+ */
+std::vector<std::string> receiving_groups (const service_group_settings &settings,
+                                           const std::vector<std::string> &consumes, const std::string &common) {
+    if (!settings.enabled) {
+        return {common};
+    }
+
+    std::vector<std::string> groups;
+    const auto add = [&groups] (const std::string &group) {
+        if (std::find (groups.begin (), groups.end (), group) == groups.end ()) {
+            groups.push_back (group);
+        }
+    };
+
+    if (consumes.empty ()) {
+        add (common);
+
+        in_addr address = {};
+        inet_pton (AF_INET, settings.base.c_str (), &address);
+        for (std::uint32_t i = 0; i < settings.count; i++) {
+            in_addr group = {htonl (ntohl (address.s_addr) + i)};
+            char text[INET_ADDRSTRLEN];
+            inet_ntop (AF_INET, &group, text, sizeof (text));
+            add (text);
+        }
+        return groups;
+    }
+
+    for (const auto &service: consumes) {
+        add (group_of_service (settings, service));
+    }
+    return groups;
+}
+
+/**
+ * @brief Whether an advertisement provides at least one of the services.
+ */
+bool provides_any (const json &advertisement, const std::vector<std::string> &services) {
+    const auto it = advertisement.find ("provides");
+    if (it == advertisement.end () || !it->is_array ()) {
+        return false;
+    }
+
+    for (const auto &service: *it) {
+        if (service.is_string ()
+            && std::find (services.begin (), services.end (), service.get<std::string> ()) != services.end ()) {
+            return true;
+        }
+    }
+    return false;
+}
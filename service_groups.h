@@ -0,0 +1,37 @@
+#ifndef HOSTMON_SERVICE_GROUPS_H
+#define HOSTMON_SERVICE_GROUPS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * @brief How services map onto multicast groups. Disabled, every advertisement goes to the one group.
+ *
+ * A service's group is `base` plus the CRC-32 of its name modulo `count`, so
+ * every node maps a service to the same group without coordinating.
+ * Providers send on the groups of the services they provide and consumers
+ * join only the groups of the services they consume, so switches doing
+ * IGMP snooping keep other services' heartbeats off their ports.
+ */
+struct service_group_settings {
+    bool enabled = false;
+    std::string base = "239.192.0.0";
+    std::uint32_t count = 16;
+};
+
+service_group_settings service_groups_from_configuration (const json &settings);
+
+std::string group_of_service (const service_group_settings &settings, const std::string &service);
+
+std::vector<std::string> sending_groups (const service_group_settings &settings, const json &provides,
+                                         const std::string &common);
+std::vector<std::string> receiving_groups (const service_group_settings &settings,
+                                           const std::vector<std::string> &consumes, const std::string &common);
+
+bool provides_any (const json &advertisement, const std::vector<std::string> &services);
+
+#endif //HOSTMON_SERVICE_GROUPS_H
@@ -0,0 +1,160 @@
+#include "shm_table.h"
+
+#include <cerrno>
+#include <iostream>
+#include <stdexcept>
+
+/**
+ * @brief Copy a string into a fixed size field, truncating and NUL terminating it.
+ */
+static void copy_field (char *field, const std::size_t size, const std::string &value) {
+    const auto length = std::min (value.size (), size - 1);
+    memcpy (field, value.data (), length);
+    memset (field + length, 0, size - length);
+}
+
+/**
+ * @brief Create (or replace) the shared memory segment and fill it from the table.
+ *
+ * A segment left by an earlier run is unlinked, never truncated: readers may
+ * still have it mapped, and would fault on touching pages cut from under
+ * them. They keep the old segment until they reopen the name.
+ *
+ * @param table The membership table to mirror.
+ * @param name The shm_open() name of the segment, such as "/hostmon".
+ * @param capacity The number of participant slots in the segment.
+ * @throws std::runtime_error If the segment cannot be created or mapped.
+ */
+shm_publisher::shm_publisher (membership &table, std::string name, const std::uint32_t capacity)
+    : table (table), name (std::move (name)), capacity (capacity), length (hostmon_shm_size (capacity)) {
+
+    if (shm_unlink (this->name.c_str ()) < 0 && errno != ENOENT) {
+        throw std::runtime_error ("Cannot replace shared membership table " + this->name + ": " + strerror (errno));
+    }
+
+    const int fd = shm_open (this->name.c_str (), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        throw std::runtime_error ("Cannot create shared membership table " + this->name + ": " + strerror (errno));
+    }
+
+    if (ftruncate (fd, static_cast<off_t> (length)) < 0) {
+        close (fd);
+        throw std::runtime_error ("Cannot size shared membership table " + this->name + ": " + strerror (errno));
+    }
+
+    base = mmap (nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+
+    if (base == MAP_FAILED) {
+        throw std::runtime_error ("Cannot map shared membership table " + this->name + ": " + strerror (errno));
+    }
+
+    // the segment is zero filled by ftruncate, so every slot starts unused
+    auto *h = header ();
+    h->capacity = capacity;
+    h->record_size = sizeof (hostmon_shm_record);
+    h->layout = HOSTMON_SHM_LAYOUT;
+
+    for (std::uint32_t slot = capacity; slot-- > 0;) {
+        free_slots.push_back (slot);
+    }
+
+    // changes made while we fill from the snapshot wait on writer_mutex and
+    // are then applied, skipping the ones the snapshot already reflects
+    std::lock_guard lock (writer_mutex);
+    subscription = table.subscribe ([this] (const membership_change &change) {
+        std::lock_guard guard (writer_mutex);
+        apply (change);
+    });
+
+    const auto snapshot = table.snapshot ();
+    for (const auto &p: snapshot->participants) {
+        place (CHANGE_JOINED, *p);
+    }
+    published_version = snapshot->version;
+    h->version.store (published_version, std::memory_order_release);
+
+    // readers check the magic last
+    std::atomic_thread_fence (std::memory_order_release);
+    h->magic = HOSTMON_SHM_MAGIC;
+}
+
+shm_publisher::~shm_publisher () {
+    table.unsubscribe (subscription);
+    munmap (base, length);
+    shm_unlink (name.c_str ());
+}
+
+/**
+ * @brief Rewrite one slot under its sequence lock; a null participant frees it.
+ */
+void shm_publisher::write_record (const std::uint32_t slot, const participant *p) {
+    auto &r = records ()[slot];
+    const auto sequence = r.sequence.load (std::memory_order_relaxed);
+
+    r.sequence.store (sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence (std::memory_order_release);
+
+    if (p == nullptr) {
+        r.flags = 0;
+    } else {
+        r.flags = HOSTMON_SHM_IN_USE | (p->is_active () ? HOSTMON_SHM_ACTIVE : 0);
+        r.first_seen = p->get_first_seen ();
+        copy_field (r.id, sizeof (r.id), p->get_id ());
+        copy_field (r.address, sizeof (r.address), p->get_address ());
+        copy_field (r.architecture, sizeof (r.architecture), p->get_architecture ());
+
+        const auto provides = p->get_provides ();
+        r.service_count = std::min (provides.size (), HOSTMON_SHM_SERVICES);
+        for (std::uint32_t i = 0; i < r.service_count; i++) {
+            copy_field (r.services[i], sizeof (r.services[i]), provides[i]);
+        }
+    }
+
+    r.sequence.store (sequence + 2, std::memory_order_release);
+    header ()->generation.fetch_add (1, std::memory_order_release);
+}
+
+/**
+ * @brief Reflect one membership change in the segment. Called with writer_mutex held.
+ */
+void shm_publisher::apply (const membership_change &change) {
+    if (change.version <= published_version) {
+        return;
+    }
+
+    place (change.kind, *change.subject);
+
+    published_version = change.version;
+    header ()->version.store (published_version, std::memory_order_release);
+}
+
+/**
+ * @brief Add, rewrite or free the slot of one participant.
+ */
+void shm_publisher::place (const ChangeKind kind, const participant &p) {
+    const auto id = p.get_id ();
+    const auto it = slots.find (id);
+
+    if (kind == CHANGE_LEFT) {
+        if (it != slots.end ()) {
+            write_record (it->second, nullptr);
+            free_slots.push_back (it->second);
+            slots.erase (it);
+        }
+    } else if (it != slots.end ()) {
+        write_record (it->second, &p);
+    } else if (!free_slots.empty ()) {
+        const auto slot = free_slots.back ();
+        free_slots.pop_back ();
+        slots[id] = slot;
+
+        if (slot >= header ()->high_water.load (std::memory_order_relaxed)) {
+            header ()->high_water.store (slot + 1, std::memory_order_release);
+        }
+        write_record (slot, &p);
+    } else if (!overflowed) {
+        overflowed = true;
+        std::cerr << "Shared membership table " << name << " is full at " << capacity << " participants\n";
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef HOSTMON_SHM_TABLE_H
+#define HOSTMON_SHM_TABLE_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "hostmon_shm.h"
+#include "monitor.h"
+
+/**
+ * @class shm_publisher
+ * @brief Mirrors a membership table into a shared memory segment.
+ *
+ * Local readers map the segment with hostmon_shm_reader (hostmon_shm.h) and
+ * read it with no system calls. Each participant occupies one fixed slot
+ * from join to leave; freed slots are reused. Participants beyond the
+ * segment's capacity are left out and reported once.
+ */
+class shm_publisher {
+    membership &table;
+    std::string name;
+    std::uint32_t capacity;
+
+    void *base;
+    std::size_t length;
+
+    std::mutex writer_mutex;
+    std::map<std::string, std::uint32_t> slots;
+    std::vector<std::uint32_t> free_slots;
+    std::uint64_t published_version = 0;
+    bool overflowed = false;
+    int subscription;
+
+    hostmon_shm_header *header () {
+        return static_cast<hostmon_shm_header *> (base);
+    }
+
+    hostmon_shm_record *records () {
+        return reinterpret_cast<hostmon_shm_record *> (header () + 1);
+    }
+
+    void write_record (std::uint32_t slot, const participant *p);
+    void apply (const membership_change &change);
+    void place (ChangeKind kind, const participant &p);
+
+public:
+    shm_publisher (membership &table, std::string name, std::uint32_t capacity);
+    ~shm_publisher ();
+
+    shm_publisher (const shm_publisher &) = delete;
+    shm_publisher &operator= (const shm_publisher &) = delete;
+};
+
+#endif //HOSTMON_SHM_TABLE_H
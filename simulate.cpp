@@ -0,0 +1,149 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+#include "simulator.h"
+
+/**
+ * @brief Print the command line options understood by hostmon-sim.
+ */
+void usage () {
+    std::cerr << "usage: hostmon-sim [options]\n"
+              << "  --nodes N              simulated cluster size (100)\n"
+              << "  --duration MS          virtual run time (10000)\n"
+              << "  --heartbeat MS         advertisement interval (500)\n"
+              << "  --expiry MS            participant expiry age (600)\n"
+              << "  --expiry-tick MS       expiry scan interval (250)\n"
+              << "  --faults FILE          network fault configuration, as in config.json\n"
+              << "  --loss P               per packet loss probability (0)\n"
+              << "  --burst-enter P        probability a link enters a loss burst (0)\n"
+              << "  --burst-exit P         probability a link leaves a loss burst (1)\n"
+              << "  --delay MS             one way delay (0)\n"
+              << "  --jitter MS            delay spread (0)\n"
+              << "  --distribution NAME    constant, uniform, normal or exponential\n"
+              << "  --duplicate P          probability a packet is duplicated (0)\n"
+              << "  --reorder P            probability a packet is held back (0)\n"
+              << "  --reorder-delay MS     how long a held back packet is delayed (0)\n"
+              << "  --partition START:END  split the cluster between these times\n"
+              << "  --partition-fraction F share of nodes on the first side (0.5)\n"
+              << "  --malformed P          probability a heartbeat is followed by a malformed one (0)\n"
+              << "  --seed N               random seed (1)\n";
+}
+
+/**
+ * @file simulate.cpp
+ * @brief Runs a simulated cluster on a virtual clock and prints what it observed.
+ */
+int main (const int argc, char *argv[]) {
+    simulation_settings settings;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+
+            if (i + 1 >= argc) {
+                usage ();
+                return 1;
+            }
+            const std::string value = argv[++i];
+
+            if (arg == "--nodes") {
+                settings.nodes = std::stoul (value);
+            } else if (arg == "--duration") {
+                settings.duration_ms = std::stoull (value);
+            } else if (arg == "--heartbeat") {
+                settings.heartbeat_ms = std::stoull (value);
+            } else if (arg == "--expiry") {
+                settings.expiry_ms = std::stoull (value);
+            } else if (arg == "--expiry-tick") {
+                settings.expiry_tick_ms = std::stoull (value);
+            } else if (arg == "--faults") {
+                std::ifstream f (value);
+                settings.network.update (json::parse (f));
+            } else if (arg == "--loss") {
+                settings.network["loss"] = std::stod (value);
+            } else if (arg == "--burst-enter") {
+                settings.network["burst_enter"] = std::stod (value);
+            } else if (arg == "--burst-exit") {
+                settings.network["burst_exit"] = std::stod (value);
+            } else if (arg == "--delay") {
+                settings.network["delay_ms"] = std::stod (value);
+            } else if (arg == "--jitter") {
+                settings.network["jitter_ms"] = std::stod (value);
+            } else if (arg == "--distribution") {
+                settings.network["distribution"] = value;
+            } else if (arg == "--duplicate") {
+                settings.network["duplicate"] = std::stod (value);
+            } else if (arg == "--reorder") {
+                settings.network["reorder"] = std::stod (value);
+            } else if (arg == "--reorder-delay") {
+                settings.network["reorder_delay_ms"] = std::stod (value);
+            } else if (arg == "--partition") {
+                const auto colon = value.find (':');
+                if (colon == std::string::npos) {
+                    throw std::invalid_argument ("partition must be START:END");
+                }
+                settings.partition_start_ms = std::stoull (value.substr (0, colon));
+                settings.partition_end_ms = std::stoull (value.substr (colon + 1));
+            } else if (arg == "--partition-fraction") {
+                settings.partition_fraction = std::stod (value);
+            } else if (arg == "--malformed") {
+                settings.malformed = std::stod (value);
+            } else if (arg == "--seed") {
+                settings.seed = std::stoul (value);
+            } else {
+                usage ();
+                return 1;
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what () << "\n";
+        usage ();
+        return 1;
+    }
+
+    if (settings.nodes == 0 || settings.heartbeat_ms == 0) {
+        usage ();
+        return 1;
+    }
+
+    simulation_results results;
+    try {
+        simulator sim (settings);
+        results = sim.run ();
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what () << "\n";
+        return 1;
+    }
+
+    auto print_time = [] (const std::optional<std::uint64_t> &t) {
+        return t ? std::to_string (*t) + " ms" : std::string ("not reached");
+    };
+
+    std::cout << "nodes:               " << settings.nodes << "\n"
+              << "virtual duration:    " << settings.duration_ms << " ms\n"
+              << "convergence:         " << print_time (results.convergence_ms) << "\n";
+
+    if (settings.partition_end_ms > settings.partition_start_ms) {
+        std::cout << "heal convergence:    " << print_time (results.heal_convergence_ms) << "\n";
+    }
+
+    std::cout << "online events:       " << results.online_events << "\n"
+              << "offline events:      " << results.offline_events << "\n"
+              << "  across partition:  " << results.partition_offlines << "\n"
+              << "  false positives:   " << results.false_offlines << "\n"
+              << "packets sent:        " << results.packets_sent << "\n"
+              << "packets delivered:   " << results.packets_delivered << "\n"
+              << "packets dropped:     " << results.packets_dropped << "\n";
+
+    if (settings.malformed > 0) {
+        std::cout << "malformed delivered: " << results.malformed_delivered << "\n"
+                  << "  accepted:          " << results.malformed_accepted << "\n";
+    }
+
+    std::cout << "events processed:    " << results.events << std::endl;
+
+    // a table that took a malformed advertisement fails the run, so scripts can use it as a check
+    return results.malformed_accepted == 0 ? 0 : 2;
+}
@@ -0,0 +1,244 @@
+#include "simulator.h"
+
+#include <cmath>
+#include <string>
+
+/**
+ * @brief The network fault configuration, seeded from the run's seed unless it has its own.
+ */
+static json seeded_network (const simulation_settings &settings) {
+    json network = settings.network;
+    if (!network.contains ("seed")) {
+        network["seed"] = settings.seed;
+    }
+    return network;
+}
+
+/**
+ * @brief Build a simulated cluster.
+ *
+ * Every node gets its own membership table wired to the simulator's virtual
+ * clock, and an advertisement shaped like the one create_advertisement()
+ * builds for a real host.
+ *
+ * @param settings The cluster size, timers and network model to simulate.
+ */
+simulator::simulator (const simulation_settings &settings)
+    : settings (settings), network (seeded_network (settings)), rng (settings.seed) {
+
+    nodes.resize (settings.nodes);
+
+    for (std::size_t i = 0; i < settings.nodes; i++) {
+        const std::string address = "10." + std::to_string ((i >> 16) & 0xff) + "."
+                                    + std::to_string ((i >> 8) & 0xff) + "."
+                                    + std::to_string (i & 0xff);
+
+        json j = {};
+        j["id"] = "node-" + std::to_string (i);
+        j["address"] = address;
+        j["active"] = true;
+        j["provides"] = json::array ();
+        j["operating_system"] = "Linux";
+        j["release"] = "simulated";
+        j["architecture"] = "x86_64";
+
+        nodes[i].address = address;
+        nodes[i].advertisement = j.dump ();
+        nodes[i].table = std::make_unique<membership> (
+            [this] { return now; },
+            [this, i] (const std::string &addr, const int op, const std::string &) { transition (i, addr, op); },
+            settings.expiry_ms,
+            false);
+        nodes[i].table->set_publishing (false);
+        // the simulator counts transitions itself; per-node histories would cost O(n^2) memory
+        nodes[i].table->set_history_limits ({.max_participants = 0});
+        // partition scenarios count the offline events a partition causes, so nothing is held
+        nodes[i].table->set_partition_settings ({.threshold = 0});
+
+        address_index[address] = i;
+    }
+}
+
+void simulator::schedule (const std::uint64_t time, const event_kind kind, const std::size_t node_index,
+                          const std::size_t source, std::shared_ptr<const json> payload, const bool malformed) {
+    queue.push (event {time, sequence++, kind, node_index, source, std::move (payload), malformed});
+}
+
+bool simulator::partition_active () const {
+    return settings.partition_end_ms > settings.partition_start_ms
+           && now >= settings.partition_start_ms && now < settings.partition_end_ms;
+}
+
+bool simulator::partitioned (const std::size_t a, const std::size_t b) const {
+    if (!partition_active ()) {
+        return false;
+    }
+
+    const auto boundary = static_cast<std::size_t> (settings.partition_fraction * static_cast<double> (settings.nodes));
+    return (a < boundary) != (b < boundary);
+}
+
+/**
+ * @brief Send one node's advertisement to every node, itself included.
+ *
+ * The advertisement is parsed once per send, as the receive path would, and the
+ * parsed packet is shared between all deliveries.
+ */
+void simulator::heartbeat (const std::size_t node_index) {
+    const auto payload = std::make_shared<const json> (json::parse (nodes[node_index].advertisement));
+
+    for (std::size_t dst = 0; dst < nodes.size (); dst++) {
+        results.packets_sent++;
+
+        // multicast loopback to ourselves never touches the wire
+        if (dst == node_index) {
+            schedule (now, EVENT_DELIVER, dst, node_index, payload);
+            continue;
+        }
+
+        const auto copies = network.apply (nodes[node_index].address);
+        if (copies.empty ()) {
+            results.packets_dropped++;
+            continue;
+        }
+
+        for (const double delay: copies) {
+            schedule (now + static_cast<std::uint64_t> (std::llround (delay)), EVENT_DELIVER, dst, node_index, payload);
+        }
+    }
+
+    if (settings.malformed > 0 && std::bernoulli_distribution (settings.malformed) (rng)) {
+        send_malformed (node_index);
+    }
+
+    schedule (now + settings.heartbeat_ms, EVENT_HEARTBEAT, node_index);
+}
+
+/**
+ * @brief Send one malformed advertisement from a node to every node, over the same network.
+ *
+ * The payloads cycle through the shapes a truncated, foreign or hostile
+ * datagram can take once parsed: missing fields, fields of the wrong type,
+ * and documents that are not objects at all.
+ */
+void simulator::send_malformed (const std::size_t node_index) {
+    static const std::vector<json> shapes = {
+        json::object (),
+        {{"id", "node-" + std::to_string (node_index)}},
+        {{"id", 5}, {"address", "10.0.0.1"}, {"architecture", "x86_64"}},
+        {{"id", "rogue"}, {"address", nullptr}, {"architecture", "x86_64"}},
+        {{"id", "rogue"}, {"address", "10.0.0.1"}, {"architecture", json::array ()}},
+        json::array ({"id", "address"}),
+        "node",
+        nullptr
+    };
+
+    const auto payload = std::make_shared<const json> (shapes[next_malformed++ % shapes.size ()]);
+
+    for (std::size_t dst = 0; dst < nodes.size (); dst++) {
+        results.packets_sent++;
+
+        for (const double delay: dst == node_index ? std::vector<double> {0.0} : network.apply (nodes[node_index].address)) {
+            schedule (now + static_cast<std::uint64_t> (std::llround (delay)), EVENT_DELIVER, dst, node_index, payload, true);
+        }
+    }
+}
+
+void simulator::deliver (const event &e) {
+    // the partition is checked on arrival, so packets in flight when it starts are lost too
+    if (partitioned (e.source, e.node)) {
+        results.packets_dropped++;
+        return;
+    }
+
+    results.packets_delivered++;
+    const auto status = nodes[e.node].table->report_participant (*e.payload);
+
+    if (e.malformed) {
+        results.malformed_delivered++;
+        if (status != PARTICIPANT_IGNORED) {
+            results.malformed_accepted++;
+        }
+    }
+}
+
+/**
+ * @brief Account for an online/offline transition seen by one node.
+ */
+void simulator::transition (const std::size_t observer, const std::string &address, const int op) {
+    auto &n = nodes[observer];
+    const auto subject = address_index.at (address);
+
+    if (op == UPDATE_ONLINE) {
+        results.online_events++;
+        if (++n.known == nodes.size ()) {
+            full_nodes++;
+        }
+        return;
+    }
+
+    results.offline_events++;
+    if (n.known-- == nodes.size ()) {
+        full_nodes--;
+    }
+
+    if (partitioned (observer, subject)) {
+        results.partition_offlines++;
+    } else {
+        results.false_offlines++;
+    }
+}
+
+/**
+ * @brief Run the simulation to completion.
+ *
+ * Nodes start at random offsets within one heartbeat interval, like a cluster
+ * being cold started, and the run ends when the virtual clock passes the
+ * configured duration.
+ *
+ * @return The convergence times, transition counts and traffic totals observed.
+ */
+simulation_results simulator::run () {
+    std::uniform_int_distribution<std::uint64_t> offset (0, settings.heartbeat_ms - 1);
+
+    for (std::size_t i = 0; i < nodes.size (); i++) {
+        const auto start = offset (rng);
+        schedule (start, EVENT_HEARTBEAT, i);
+        schedule (start + settings.expiry_tick_ms, EVENT_EXPIRY, i);
+    }
+
+    while (!queue.empty () && queue.top ().time <= settings.duration_ms) {
+        const event e = queue.top ();
+        queue.pop ();
+
+        now = e.time;
+        results.events++;
+
+        switch (e.kind) {
+            case EVENT_HEARTBEAT:
+                heartbeat (e.node);
+                break;
+
+            case EVENT_EXPIRY:
+                nodes[e.node].table->expire_participants ();
+                schedule (now + settings.expiry_tick_ms, EVENT_EXPIRY, e.node);
+                break;
+
+            case EVENT_DELIVER:
+                deliver (e);
+                break;
+        }
+
+        if (full_nodes == nodes.size ()) {
+            if (!results.convergence_ms) {
+                results.convergence_ms = now;
+            }
+            if (!partition_active () && settings.partition_end_ms > settings.partition_start_ms
+                && now >= settings.partition_end_ms && !results.heal_convergence_ms) {
+                results.heal_convergence_ms = now - settings.partition_end_ms;
+            }
+        }
+    }
+
+    return results;
+}
@@ -0,0 +1,144 @@
+#ifndef HOSTMON_SIMULATOR_H
+#define HOSTMON_SIMULATOR_H
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#include "faults.h"
+#include "monitor.h"
+
+using json = nlohmann::json;
+
+/**
+ * @brief Knobs for a simulated cluster.
+ *
+ * All times are in virtual milliseconds. The network is described by the same
+ * fault configuration fault_transport uses (see fault_model), judged per
+ * sending node address, so loss bursts are correlated per sender. While a
+ * partition is in effect the first `partition_fraction` of the nodes cannot
+ * hear the rest and vice versa. With probability `malformed` a heartbeat is
+ * followed by a malformed advertisement from the same node, which every
+ * table must turn away.
+ */
+struct simulation_settings {
+    std::size_t nodes = 100;
+    std::uint64_t duration_ms = 10000;
+
+    std::uint64_t heartbeat_ms = 500;
+    std::uint64_t expiry_ms = 600;
+    std::uint64_t expiry_tick_ms = 250;
+
+    json network = json::object ();
+
+    std::uint64_t partition_start_ms = 0;
+    std::uint64_t partition_end_ms = 0;
+    double partition_fraction = 0.5;
+
+    double malformed = 0.0;
+
+    std::uint32_t seed = 1;
+};
+
+/**
+ * @brief What a simulation run observed.
+ *
+ * A false offline is an offline transition for a node that was alive and
+ * reachable from the observer at the time; offlines across an active
+ * partition are expected and counted separately.
+ */
+struct simulation_results {
+    std::optional<std::uint64_t> convergence_ms;
+    std::optional<std::uint64_t> heal_convergence_ms;
+
+    std::uint64_t online_events = 0;
+    std::uint64_t offline_events = 0;
+    std::uint64_t partition_offlines = 0;
+    std::uint64_t false_offlines = 0;
+
+    std::uint64_t packets_sent = 0;
+    std::uint64_t packets_delivered = 0;
+    std::uint64_t packets_dropped = 0;
+
+    std::uint64_t malformed_delivered = 0;
+    // malformed advertisements a table did not answer with PARTICIPANT_IGNORED; always 0 when correct
+    std::uint64_t malformed_accepted = 0;
+
+    std::uint64_t events = 0;
+};
+
+/**
+ * @class simulator
+ * @brief Runs many membership engines in one process against a virtual clock.
+ *
+ * Each simulated node owns a real membership table; advertisements travel over
+ * an in-memory network and are fed through membership::report_participant(),
+ * and expiry runs through membership::expire_participants(), so the real
+ * detection logic is exercised without sockets or wall clock time.
+ */
+class simulator {
+
+    enum event_kind {
+        EVENT_HEARTBEAT,
+        EVENT_EXPIRY,
+        EVENT_DELIVER
+    };
+
+    struct event {
+        std::uint64_t time;
+        std::uint64_t sequence;
+        event_kind kind;
+        std::size_t node;
+        std::size_t source;
+        std::shared_ptr<const json> payload;
+        bool malformed = false;
+
+        bool operator> (const event &other) const {
+            return time != other.time ? time > other.time : sequence > other.sequence;
+        }
+    };
+
+    struct node {
+        std::unique_ptr<membership> table;
+        std::string address;
+        std::string advertisement;
+        std::size_t known = 0;
+    };
+
+    simulation_settings settings;
+    simulation_results results;
+
+    std::uint64_t now = 0;
+    std::uint64_t sequence = 0;
+    std::size_t full_nodes = 0;
+    std::size_t next_malformed = 0;
+
+    std::vector<node> nodes;
+    std::unordered_map<std::string, std::size_t> address_index;
+    fault_model network;
+    std::priority_queue<event, std::vector<event>, std::greater<>> queue;
+    std::mt19937_64 rng;
+
+    void schedule (std::uint64_t time, event_kind kind, std::size_t node_index,
+                   std::size_t source = 0, std::shared_ptr<const json> payload = nullptr, bool malformed = false);
+
+    void heartbeat (std::size_t node_index);
+    void send_malformed (std::size_t node_index);
+    void deliver (const event &e);
+    void transition (std::size_t observer, const std::string &address, int op);
+
+    [[nodiscard]] bool partitioned (std::size_t a, std::size_t b) const;
+    [[nodiscard]] bool partition_active () const;
+
+public:
+    explicit simulator (const simulation_settings &settings);
+
+    simulation_results run ();
+};
+
+#endif //HOSTMON_SIMULATOR_H
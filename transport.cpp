@@ -0,0 +1,371 @@
+#include "transport.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "utilities.h"
+
+/**
+ * @brief Wrap an open socket, sending to the given address.
+ *
+ * The transport takes ownership of the socket and closes it when destroyed.
+ */
+udp_transport::udp_transport (const int sock, const char *ip, const unsigned short port) : sock (sock) {
+    memset (&destination, 0, sizeof (destination));
+    destination.sin_family = AF_INET;
+    destination.sin_addr.s_addr = inet_addr (ip);
+    destination.sin_port = htons (port);
+}
+
+udp_transport::~udp_transport () {
+    close (sock);
+}
+
+ssize_t udp_transport::send (const std::string &message) {
+    return sendto (sock, message.c_str (), message.size (), 0,
+                   reinterpret_cast<sockaddr *>(&destination), sizeof (destination));
+}
+
+ssize_t udp_transport::send_to (const std::string &message, const std::string &address, const unsigned short port) {
+    sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_port = htons (port);
+    if (inet_pton (AF_INET, address.c_str (), &to.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return sendto (sock, message.c_str (), message.size (), 0, reinterpret_cast<sockaddr *>(&to), sizeof (to));
+}
+
+ssize_t udp_transport::receive (char *buffer, const std::size_t size, std::string &source) {
+    sockaddr_in src_addr = {};
+    iovec data = {buffer, size};
+    alignas (cmsghdr) char control[CMSG_SPACE (sizeof (std::uint32_t)) + CMSG_SPACE (sizeof (timespec))];
+    msghdr message = {};
+
+    const auto attempt = [&] (const int flags) {
+        message = {};
+        message.msg_name = &src_addr;
+        message.msg_namelen = sizeof (src_addr);
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        if (counting_drops || timestamping) {
+            message.msg_control = control;
+            message.msg_controllen = sizeof (control);
+        }
+        return recvmsg (sock, &message, flags);
+    };
+
+    ssize_t received = -1;
+    if (spin.count () > 0) {
+        const auto until = std::chrono::steady_clock::now () + spin;
+        do {
+            received = attempt (MSG_DONTWAIT);
+        } while (received < 0 && errno == EAGAIN && std::chrono::steady_clock::now () < until);
+    }
+    if (spin.count () <= 0 || (received < 0 && errno == EAGAIN)) {
+        received = attempt (0);
+    }
+
+    if (received >= 0) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop (AF_INET, &src_addr.sin_addr, ip, INET_ADDRSTRLEN);
+        source = ip;
+
+        for (auto *c = CMSG_FIRSTHDR (&message); c != nullptr; c = CMSG_NXTHDR (&message, c)) {
+            if (c->cmsg_level != SOL_SOCKET) {
+                continue;
+            }
+            if (c->cmsg_type == SO_RXQ_OVFL) {
+                memcpy (&drops, CMSG_DATA (c), sizeof (drops));
+            } else if (c->cmsg_type == SCM_TIMESTAMPNS) {
+                timespec ts = {};
+                memcpy (&ts, CMSG_DATA (c), sizeof (ts));
+                arrival = static_cast<std::uint64_t> (ts.tv_sec) * 1000000000 + ts.tv_nsec;
+            }
+        }
+    }
+
+    return received;
+}
+
+/**
+ * @brief Join another multicast group, so a socket listening on the port receives it too.
+ *
+ * @return false when the kernel refuses the membership, for instance past net.ipv4.igmp_max_memberships.
+ */
+bool udp_transport::join (const char *group_ip) {
+    ip_mreq mreq = {};
+    mreq.imr_multiaddr.s_addr = inet_addr (group_ip);
+    mreq.imr_interface.s_addr = htonl (INADDR_ANY);
+
+    return setsockopt (sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof (mreq)) == 0;
+}
+
+/**
+ * @brief Have the kernel report, with each datagram, how many it has dropped on this socket.
+ *
+ * The count arrives only with datagrams received after a drop, so it is as
+ * current as the last datagram received.
+ *
+ * @return false when the kernel does not support SO_RXQ_OVFL.
+ */
+bool udp_transport::count_drops () {
+    const int on = 1;
+    counting_drops = setsockopt (sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof (on)) == 0;
+    return counting_drops;
+}
+
+/**
+ * @brief Have the kernel stamp each datagram with the time it arrived, for last_arrival().
+ *
+ * @return false when the kernel refuses SO_TIMESTAMPNS.
+ */
+bool udp_transport::timestamp_arrivals () {
+    const int on = 1;
+    timestamping = setsockopt (sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof (on)) == 0;
+    return timestamping;
+}
+
+/**
+ * @brief Let blocking receives busy poll the device queue for up to `microseconds` first.
+ *
+ * @return false when the kernel refuses SO_BUSY_POLL, usually for want of CAP_NET_ADMIN.
+ */
+bool udp_transport::busy_poll (const int microseconds) {
+    return setsockopt (sock, SOL_SOCKET, SO_BUSY_POLL, &microseconds, sizeof (microseconds)) == 0;
+}
+
+/**
+ * @brief Create a transport on a multicast group.
+ *
+ * @param group_ip The IP address of the multicast group.
+ * @param group_port The port of the multicast group.
+ * @param listen Whether to bind the port so the group's datagrams can be received.
+ * @throws std::runtime_error If the socket cannot be created, joined or bound.
+ */
+std::unique_ptr<udp_transport> udp_transport::multicast (const char *group_ip, const unsigned short group_port,
+                                                         const bool listen) {
+    const int sock = new_multicast_socket (group_ip);
+
+    if (listen) {
+        sockaddr_in group_addr = {};
+        memset (&group_addr, 0, sizeof (group_addr));
+        group_addr.sin_family = AF_INET;
+        group_addr.sin_addr.s_addr = htonl (INADDR_ANY);
+        group_addr.sin_port = htons (group_port);
+
+        if (bind (sock, reinterpret_cast<sockaddr *>(&group_addr), sizeof (group_addr)) < 0) {
+            close (sock);
+            throw std::runtime_error ("Binding datagram socket error");
+        }
+
+        // bound to any address, the socket would otherwise also get other groups joined on the same port
+        constexpr int off = 0;
+        setsockopt (sock, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof (off));
+    }
+
+    return std::make_unique<udp_transport> (sock, group_ip, group_port);
+}
+
+/**
+ * @brief Create a transport sending to a single address.
+ *
+ * @throws std::runtime_error If the socket cannot be created.
+ */
+std::unique_ptr<udp_transport> udp_transport::unicast (const char *ip, const unsigned short port) {
+    const int sock = socket (AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        throw std::runtime_error ("Failed to create socket");
+    }
+
+    return std::make_unique<udp_transport> (sock, ip, port);
+}
+
+/**
+ * @brief Create a transport that receives on a local port and replies with send_to().
+ *
+ * @throws std::runtime_error If the socket cannot be created or bound.
+ */
+std::unique_ptr<udp_transport> udp_transport::bound (const unsigned short port) {
+    const int sock = socket (AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        throw std::runtime_error ("Failed to create socket");
+    }
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_ANY);
+    addr.sin_port = htons (port);
+
+    if (bind (sock, reinterpret_cast<sockaddr *>(&addr), sizeof (addr)) < 0) {
+        close (sock);
+        throw std::runtime_error ("Binding datagram socket error");
+    }
+
+    return std::make_unique<udp_transport> (sock, "127.0.0.1", port);
+}
+
+/**
+ * @brief Wrap a transport with the faults described by a fault_model configuration.
+ *
+ * @param inner The transport actually carrying the datagrams.
+ * @param settings The fault configuration, see fault_model.
+ * @param destination The peer address outgoing datagrams are judged against.
+ */
+fault_transport::fault_transport (std::unique_ptr<transport> inner, const json &settings, std::string destination)
+    : inner (std::move (inner)), model (settings), destination (std::move (destination)),
+      sender (&fault_transport::send_loop, this) {
+}
+
+fault_transport::~fault_transport () {
+    {
+        std::lock_guard lock (held_mutex);
+        stopping = true;
+    }
+    held_changed.notify_all ();
+    sender.join ();
+}
+
+ssize_t fault_transport::send (const std::string &message) {
+    const auto now = clock::now ();
+
+    for (const double delay: model.apply (destination)) {
+        if (delay <= 0.0) {
+            if (const ssize_t sent = inner->send (message); sent < 0) {
+                return sent;
+            }
+            continue;
+        }
+
+        {
+            std::lock_guard lock (held_mutex);
+            outgoing.push (held {now + std::chrono::microseconds (std::llround (delay * 1000.0)),
+                                 outgoing_sequence++, message, {}});
+        }
+        held_changed.notify_one ();
+    }
+
+    // a lost datagram looks sent to the caller, as it would on a real network
+    return static_cast<ssize_t> (message.size ());
+}
+
+ssize_t fault_transport::send_to (const std::string &message, const std::string &address, const unsigned short port) {
+    const auto now = clock::now ();
+
+    for (const double delay: model.apply (address)) {
+        if (delay <= 0.0) {
+            if (const ssize_t sent = inner->send_to (message, address, port); sent < 0) {
+                return sent;
+            }
+            continue;
+        }
+
+        {
+            std::lock_guard lock (held_mutex);
+            outgoing.push (held {now + std::chrono::microseconds (std::llround (delay * 1000.0)),
+                                 outgoing_sequence++, message, address, port});
+        }
+        held_changed.notify_one ();
+    }
+
+    return static_cast<ssize_t> (message.size ());
+}
+
+/**
+ * @brief Release delayed outgoing datagrams as they fall due.
+ */
+void fault_transport::send_loop () {
+    std::unique_lock lock (held_mutex);
+
+    while (!stopping) {
+        if (outgoing.empty ()) {
+            held_changed.wait (lock);
+            continue;
+        }
+
+        if (const auto due = outgoing.top ().due; clock::now () < due) {
+            held_changed.wait_until (lock, due);
+            continue;
+        }
+
+        const held next = outgoing.top ();
+        outgoing.pop ();
+
+        lock.unlock ();
+        const ssize_t sent = next.port == 0 ? inner->send (next.message)
+                                            : inner->send_to (next.message, next.source, next.port);
+        if (sent < 0) {
+            perror ("Sending delayed datagram error");
+        }
+        lock.lock ();
+    }
+}
+
+ssize_t fault_transport::receive (char *buffer, const std::size_t size, std::string &source) {
+    while (true) {
+        const auto now = clock::now ();
+
+        if (!incoming.empty () && incoming.top ().due <= now) {
+            const held &h = incoming.top ();
+            const std::size_t length = std::min (size, h.message.size ());
+
+            memcpy (buffer, h.message.data (), length);
+            source = h.source;
+            incoming.pop ();
+
+            return static_cast<ssize_t> (length);
+        }
+
+        if (const int fd = inner->descriptor (); fd >= 0 && !incoming.empty ()) {
+            const auto wait = std::chrono::ceil<std::chrono::milliseconds> (incoming.top ().due - now);
+
+            pollfd pfd = {fd, POLLIN, 0};
+            const int ready = poll (&pfd, 1, static_cast<int> (wait.count ()));
+            if (ready < 0 && errno != EINTR) {
+                return -1;
+            }
+            if (ready <= 0) {
+                continue;
+            }
+        }
+
+        std::string from;
+        const ssize_t received = inner->receive (buffer, size, from);
+        if (received < 0) {
+            return received;
+        }
+
+        const auto arrived = clock::now ();
+        for (const double delay: model.apply (from)) {
+            incoming.push (held {arrived + std::chrono::microseconds (std::llround (delay * 1000.0)),
+                                 incoming_sequence++, std::string (buffer, received), from});
+        }
+    }
+}
+
+/**
+ * @brief Wrap a transport with fault injection when the settings ask for it.
+ *
+ * Without settings (null), or when every profile is transparent, the transport
+ * is returned unchanged.
+ *
+ * @param inner The transport to wrap.
+ * @param destination The peer address outgoing datagrams are judged against.
+ * @param settings A fault_model configuration, usually the "faults" section of config.json.
+ */
+std::unique_ptr<transport> with_faults (std::unique_ptr<transport> inner, const std::string &destination,
+                                        const json &settings) {
+    if (settings.is_null () || fault_model (settings).is_transparent ()) {
+        return inner;
+    }
+
+    return std::make_unique<fault_transport> (std::move (inner), settings, destination);
+}
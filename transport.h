@@ -0,0 +1,184 @@
+#ifndef HOSTMON_TRANSPORT_H
+#define HOSTMON_TRANSPORT_H
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+
+#include "faults.h"
+
+/**
+ * @class transport
+ * @brief A datagram channel used for advertisements and update notifications.
+ *
+ * Mirrors the socket calls it replaces: both operations return the number of
+ * bytes handled, or a negative value with errno set on failure.
+ */
+class transport {
+public:
+    virtual ~transport () = default;
+
+    // send one datagram to the transport's destination
+    virtual ssize_t send (const std::string &message) = 0;
+
+    // send one datagram to another address; transports without one fail with EDESTADDRREQ
+    virtual ssize_t send_to (const std::string &, const std::string &, unsigned short) {
+        errno = EDESTADDRREQ;
+        return -1;
+    }
+
+    // block for one datagram, storing the sender's address in source
+    virtual ssize_t receive (char *buffer, std::size_t size, std::string &source) = 0;
+
+    // the socket behind the transport, or -1 when there is none to poll
+    [[nodiscard]] virtual int descriptor () const {
+        return -1;
+    }
+
+    // datagrams the kernel dropped before we could receive them, as far as the transport can tell
+    [[nodiscard]] virtual std::uint64_t kernel_drops () const {
+        return 0;
+    }
+
+    // when the kernel received the last datagram, in ns since the epoch; 0 when unknown
+    [[nodiscard]] virtual std::uint64_t last_arrival () const {
+        return 0;
+    }
+};
+
+/**
+ * @class udp_transport
+ * @brief A transport over a plain UDP socket.
+ */
+class udp_transport : public transport {
+    int sock;
+    sockaddr_in destination;
+
+    // SO_RXQ_OVFL is on, so receive() reads the drop count from each datagram's control data
+    bool counting_drops = false;
+    std::uint32_t drops = 0;
+
+    // SO_TIMESTAMPNS is on, so receive() reads each datagram's arrival time likewise
+    bool timestamping = false;
+    std::uint64_t arrival = 0;
+
+    // how long receive() polls without blocking before it sleeps in the kernel
+    std::chrono::microseconds spin {0};
+
+public:
+    udp_transport (int sock, const char *ip, unsigned short port);
+    ~udp_transport () override;
+
+    udp_transport (const udp_transport &) = delete;
+    udp_transport &operator= (const udp_transport &) = delete;
+
+    ssize_t send (const std::string &message) override;
+    ssize_t send_to (const std::string &message, const std::string &address, unsigned short port) override;
+    ssize_t receive (char *buffer, std::size_t size, std::string &source) override;
+
+    [[nodiscard]] int descriptor () const override {
+        return sock;
+    }
+
+    bool join (const char *group_ip);
+    bool count_drops ();
+    bool timestamp_arrivals ();
+    bool busy_poll (int microseconds);
+
+    void set_spin (const std::chrono::microseconds new_spin) {
+        spin = new_spin;
+    }
+
+    [[nodiscard]] std::uint64_t kernel_drops () const override {
+        return drops;
+    }
+
+    [[nodiscard]] std::uint64_t last_arrival () const override {
+        return arrival;
+    }
+
+    static std::unique_ptr<udp_transport> multicast (const char *group_ip, unsigned short group_port, bool listen);
+    static std::unique_ptr<udp_transport> unicast (const char *ip, unsigned short port);
+    static std::unique_ptr<udp_transport> bound (unsigned short port);
+};
+
+/**
+ * @class fault_transport
+ * @brief Decorates a transport with loss, delay, duplication and reordering.
+ *
+ * Outgoing datagrams are judged per destination and incoming ones per sender
+ * by a fault_model. Delayed sends are released by a worker thread; delayed
+ * receives are held until due and handed out by later receive() calls, which
+ * poll the inner transport only until the next held datagram is due. Reordering
+ * falls out of the sampled delays.
+ */
+class fault_transport : public transport {
+    using clock = std::chrono::steady_clock;
+
+    struct held {
+        clock::time_point due;
+        std::uint64_t sequence;
+        std::string message;
+        // the sender of a held receive, or the address of a held send_to()
+        std::string source;
+        // the port of a held send_to(); 0 for a send() to the inner destination
+        unsigned short port = 0;
+
+        bool operator> (const held &other) const {
+            return due != other.due ? due > other.due : sequence > other.sequence;
+        }
+    };
+
+    using held_queue = std::priority_queue<held, std::vector<held>, std::greater<>>;
+
+    std::unique_ptr<transport> inner;
+    fault_model model;
+    std::string destination;
+
+    // only touched by the receiving thread
+    held_queue incoming;
+    std::uint64_t incoming_sequence = 0;
+
+    std::mutex held_mutex;
+    std::condition_variable held_changed;
+    held_queue outgoing;
+    std::uint64_t outgoing_sequence = 0;
+    bool stopping = false;
+
+    std::thread sender;
+
+    void send_loop ();
+
+public:
+    fault_transport (std::unique_ptr<transport> inner, const json &settings, std::string destination);
+    ~fault_transport () override;
+
+    ssize_t send (const std::string &message) override;
+    ssize_t send_to (const std::string &message, const std::string &address, unsigned short port) override;
+    ssize_t receive (char *buffer, std::size_t size, std::string &source) override;
+
+    [[nodiscard]] int descriptor () const override {
+        return inner->descriptor ();
+    }
+
+    [[nodiscard]] std::uint64_t kernel_drops () const override {
+        return inner->kernel_drops ();
+    }
+
+    [[nodiscard]] std::uint64_t last_arrival () const override {
+        return inner->last_arrival ();
+    }
+};
+
+std::unique_ptr<transport> with_faults (std::unique_ptr<transport> inner, const std::string &destination,
+                                        const json &settings);
+
+#endif //HOSTMON_TRANSPORT_H
@@ -1,6 +1,7 @@
 
 #include "utilities.h"
 
+#include <array>
 #include <cstring>
 #include <ifaddrs.h>
 #include <iostream>
@@ -107,4 +108,25 @@ int new_multicast_socket (const char *group_ip) {
     return sock;
 }
 
+static constexpr std::array<std::uint32_t, 256> crc_table = [] {
+    std::array<std::uint32_t, 256> table {};
+    for (std::uint32_t i = 0; i < 256; i++) {
+        std::uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    return table;
+} ();
 
+/**
+ * @brief The CRC-32 (as used by zlib) of a block of memory.
+ */
+std::uint32_t crc32 (const char *data, const std::size_t length) {
+    std::uint32_t c = 0xffffffffu;
+    for (std::size_t i = 0; i < length; i++) {
+        c = crc_table[(c ^ static_cast<unsigned char> (data[i])) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffffu;
+}
@@ -5,6 +5,8 @@
 #ifndef UTILITIES_H
 #define UTILITIES_H
 
+#include <cstddef>
+#include <cstdint>
 #include <mutex>
 #include <string>
 #include <sys/utsname.h>
@@ -13,6 +15,7 @@
 std::string get_host_name ();
 std::string get_interface_address ();
 int new_multicast_socket (const char *group_ip);
+std::uint32_t crc32 (const char *data, std::size_t length);
 
 /**
  * @class system_info
@@ -0,0 +1,167 @@
+#include "warm.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "query.h"
+#include "utilities.h"
+
+static constexpr char warm_magic[4] = {'H', 'M', 'W', 'S'};
+
+/**
+ * @brief Read warm restart settings from the "warm_restart" object of config.json.
+ *
+ * Recognises "path" (no warm restart when absent), "interval_ms" and "max_age_s".
+ */
+warm_settings warm_from_configuration (const json &settings) {
+    warm_settings result;
+    if (!settings.is_object ()) {
+        return result;
+    }
+
+    result.path = settings.value ("path", "");
+    result.interval = std::chrono::milliseconds (settings.value ("interval_ms", result.interval.count ()));
+    result.max_age = std::chrono::seconds (settings.value ("max_age_s", result.max_age.count ()));
+
+    return result;
+}
+
+/**
+ * @brief Write a snapshot to the warm restart file, replacing it atomically.
+ *
+ * The new file is written through a mapping beside the old one, synced and
+ * renamed over it, so a crash at any point leaves either file intact.
+ *
+ * @throws std::runtime_error If the file cannot be written.
+ */
+void save_warm_snapshot (const std::string &path, const membership_snapshot &snapshot, const std::uint64_t now) {
+    std::string records;
+    for (const auto &p: snapshot.participants) {
+        append_participant_record (records, *p);
+        append_participant_details (records, *p);
+    }
+
+    warm_header header = {};
+    memcpy (header.magic, warm_magic, sizeof (header.magic));
+    header.layout = warm_layout;
+    header.saved_at = now;
+    header.version = snapshot.version;
+    header.count = snapshot.participants.size ();
+    header.checksum = crc32 (records.data (), records.size ());
+    header.records_length = records.size ();
+
+    const auto temporary = path + ".tmp";
+    const std::size_t length = sizeof (header) + records.size ();
+
+    const int fd = open (temporary.c_str (), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error ("Cannot create warm restart file " + temporary + ": " + strerror (errno));
+    }
+
+    if (ftruncate (fd, static_cast<off_t> (length)) < 0) {
+        close (fd);
+        throw std::runtime_error ("Cannot size warm restart file " + temporary + ": " + strerror (errno));
+    }
+
+    void *mapped = mmap (nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close (fd);
+        throw std::runtime_error ("Cannot map warm restart file " + temporary + ": " + strerror (errno));
+    }
+
+    memcpy (mapped, &header, sizeof (header));
+    memcpy (static_cast<char *> (mapped) + sizeof (header), records.data (), records.size ());
+
+    const bool synced = msync (mapped, length, MS_SYNC) == 0;
+    munmap (mapped, length);
+    close (fd);
+
+    if (!synced || rename (temporary.c_str (), path.c_str ()) < 0) {
+        throw std::runtime_error ("Cannot replace warm restart file " + path + ": " + strerror (errno));
+    }
+}
+
+/**
+ * @brief Record that the saved snapshot is still current as of `now`.
+ *
+ * @return false when there is no file to update.
+ */
+bool touch_warm_snapshot (const std::string &path, const std::uint64_t now) {
+    const int fd = open (path.c_str (), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    const bool written = pwrite (fd, &now, sizeof (now), offsetof (warm_header, saved_at)) == sizeof (now);
+    close (fd);
+    return written;
+}
+
+/**
+ * @brief Read the participants from a warm restart file.
+ *
+ * @param path The file written by save_warm_snapshot().
+ * @param now The current time in milliseconds.
+ * @param max_age How old the file may be before it no longer describes the cluster.
+ * @return The participants, or nothing if the file is missing, too old, or fails its checksum.
+ */
+std::optional<std::vector<participant>> load_warm_snapshot (const std::string &path, const std::uint64_t now,
+                                                             const std::chrono::milliseconds max_age) {
+    const int fd = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+
+    struct stat info = {};
+    if (fstat (fd, &info) < 0 || static_cast<std::size_t> (info.st_size) < sizeof (warm_header)) {
+        close (fd);
+        return std::nullopt;
+    }
+
+    const std::size_t length = info.st_size;
+    void *mapped = mmap (nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (mapped == MAP_FAILED) {
+        return std::nullopt;
+    }
+
+    const auto *base = static_cast<const char *> (mapped);
+    warm_header header;
+    memcpy (&header, base, sizeof (header));
+
+    std::optional<std::vector<participant>> result;
+
+    const bool valid = memcmp (header.magic, warm_magic, sizeof (warm_magic)) == 0
+                       && header.layout == warm_layout
+                       && header.records_length == length - sizeof (header)
+                       && header.saved_at <= now
+                       && now - header.saved_at <= static_cast<std::uint64_t> (max_age.count ())
+                       && crc32 (base + sizeof (header), header.records_length) == header.checksum;
+
+    if (valid) {
+        const std::string_view records (base + sizeof (header), header.records_length);
+        std::size_t offset = 0;
+
+        try {
+            std::vector<participant> participants;
+            participants.reserve (header.count);
+            for (std::uint32_t i = 0; i < header.count; i++) {
+                auto p = extract_participant_record (records, offset);
+                extract_participant_details (records, offset, p);
+                participants.push_back (std::move (p));
+            }
+            result = std::move (participants);
+        } catch (const std::runtime_error &) {
+            result.reset ();
+        }
+    }
+
+    munmap (mapped, length);
+    return result;
+}
@@ -0,0 +1,60 @@
+#ifndef HOSTMON_WARM_H
+#define HOSTMON_WARM_H
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "monitor.h"
+
+/*
+ * The warm restart file: a checksummed copy of the published membership
+ * snapshot, in host byte order.
+ *
+ * [4 byte magic "HMWS"][u32 layout][u64 saved at ms][u64 version]
+ * [u32 participant count][u32 CRC-32 of the records][u64 records length]
+ * then one participant record (as in the query protocol), followed by its
+ * details (see append_participant_details()), per participant
+ *
+ * The details carry what the descriptor hash covers beyond the record, so a
+ * restored participant's first advertisement matches it and is not taken
+ * for a change.
+ *
+ * The file is replaced atomically with rename() whenever the membership
+ * changes; in between only "saved at" is rewritten, so a quiet cluster costs
+ * one small write per interval.
+ */
+
+constexpr std::uint32_t warm_layout = 3;
+
+struct warm_header {
+    char magic[4];
+    std::uint32_t layout;
+    std::uint64_t saved_at;
+    std::uint64_t version;
+    std::uint32_t count;
+    std::uint32_t checksum;
+    std::uint64_t records_length;
+};
+
+/**
+ * @brief Where the warm restart file lives and how it is kept.
+ */
+struct warm_settings {
+    // empty for no warm restart
+    std::string path;
+    std::chrono::milliseconds interval {1000};
+    // a file saved longer ago than this is ignored at startup
+    std::chrono::seconds max_age {300};
+};
+
+warm_settings warm_from_configuration (const json &settings);
+
+void save_warm_snapshot (const std::string &path, const membership_snapshot &snapshot, std::uint64_t now);
+bool touch_warm_snapshot (const std::string &path, std::uint64_t now);
+std::optional<std::vector<participant>> load_warm_snapshot (const std::string &path, std::uint64_t now,
+                                                             std::chrono::milliseconds max_age);
+
+#endif //HOSTMON_WARM_H
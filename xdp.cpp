@@ -0,0 +1,453 @@
+#include "xdp.h"
+
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+
+/**
+ * @brief Read AF_XDP settings from the "xdp" object of config.json.
+ *
+ * Recognises "interface" (no AF_XDP when absent), "queue" and "frames".
+ */
+xdp_settings xdp_from_configuration (const json &settings) {
+    xdp_settings result;
+    if (!settings.is_object ()) {
+        return result;
+    }
+
+    result.interface = settings.value ("interface", "");
+    result.queue = settings.value ("queue", result.queue);
+    result.frames = settings.value ("frames", result.frames);
+
+    return result;
+}
+
+static long bpf (const int command, bpf_attr &attr) {
+    return syscall (__NR_bpf, command, &attr, sizeof (attr));
+}
+
+// the few instruction forms the steering program needs
+
+static bpf_insn move_register (const std::uint8_t dst, const std::uint8_t src) {
+    return {BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0};
+}
+
+static bpf_insn move_immediate (const std::uint8_t dst, const std::int32_t imm) {
+    return {BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm};
+}
+
+static bpf_insn alu_immediate (const std::uint8_t op, const std::uint8_t dst, const std::int32_t imm) {
+    return {static_cast<std::uint8_t> (BPF_ALU64 | op | BPF_K), dst, 0, 0, imm};
+}
+
+static bpf_insn load (const std::uint8_t size, const std::uint8_t dst, const std::uint8_t src, const std::int16_t off) {
+    return {static_cast<std::uint8_t> (BPF_LDX | size | BPF_MEM), dst, src, off, 0};
+}
+
+static bpf_insn jump_register (const std::uint8_t op, const std::uint8_t dst, const std::uint8_t src) {
+    return {static_cast<std::uint8_t> (BPF_JMP | op | BPF_X), dst, src, 0, 0};
+}
+
+static bpf_insn jump_immediate (const std::uint8_t op, const std::uint8_t dst, const std::int32_t imm) {
+    return {static_cast<std::uint8_t> (BPF_JMP | op | BPF_K), dst, 0, 0, imm};
+}
+
+/**
+ * @brief Create the socket, its UMEM and rings, and steer the discovery port into it.
+ *
+ * @param inner The socket transport to keep receiving on; taken only when setup succeeds.
+ * @param settings The interface and queue to attach to.
+ * @param port The discovery port.
+ * @param timeout_ms How long receive() waits before failing with EAGAIN.
+ * @throws std::runtime_error If AF_XDP cannot be set up; inner is then left as it was.
+ */
+xdp_transport::xdp_transport (std::unique_ptr<transport> &inner, const xdp_settings &settings,
+                              const unsigned short port, const int timeout_ms)
+    : timeout_ms (timeout_ms) {
+    const auto fail = [this] (const std::string &what) {
+        const std::string reason = what + ": " + strerror (errno);
+        release ();
+        throw std::runtime_error (reason);
+    };
+
+    const unsigned int ifindex = if_nametoindex (settings.interface.c_str ());
+    if (ifindex == 0) {
+        fail ("No interface " + settings.interface);
+    }
+    if (!std::has_single_bit (settings.frames)) {
+        errno = EINVAL;
+        fail ("AF_XDP frame count must be a power of two");
+    }
+
+    umem_length = static_cast<std::size_t> (settings.frames) * frame_size;
+    umem = mmap (nullptr, umem_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (umem == MAP_FAILED) {
+        umem = nullptr;
+        fail ("Cannot allocate AF_XDP UMEM");
+    }
+
+    xsk = socket (AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (xsk < 0) {
+        fail ("Cannot create AF_XDP socket");
+    }
+
+    xdp_umem_reg registration = {};
+    registration.addr = reinterpret_cast<std::uint64_t> (umem);
+    registration.len = umem_length;
+    registration.chunk_size = frame_size;
+    if (setsockopt (xsk, SOL_XDP, XDP_UMEM_REG, &registration, sizeof (registration)) < 0) {
+        fail ("Cannot register AF_XDP UMEM");
+    }
+
+    const std::uint32_t entries = settings.frames;
+    if (setsockopt (xsk, SOL_XDP, XDP_UMEM_FILL_RING, &entries, sizeof (entries)) < 0
+        || setsockopt (xsk, SOL_XDP, XDP_UMEM_COMPLETION_RING, &entries, sizeof (entries)) < 0
+        || setsockopt (xsk, SOL_XDP, XDP_RX_RING, &entries, sizeof (entries)) < 0) {
+        fail ("Cannot size AF_XDP rings");
+    }
+
+    xdp_mmap_offsets offsets = {};
+    socklen_t offsets_length = sizeof (offsets);
+    if (getsockopt (xsk, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsets_length) < 0) {
+        fail ("Cannot read AF_XDP ring offsets");
+    }
+
+    try {
+        map_ring (rx, XDP_PGOFF_RX_RING, offsets.rx, entries, sizeof (xdp_desc));
+        map_ring (fill, XDP_UMEM_PGOFF_FILL_RING, offsets.fr, entries, sizeof (std::uint64_t));
+        map_ring (completion, XDP_UMEM_PGOFF_COMPLETION_RING, offsets.cr, entries, sizeof (std::uint64_t));
+    } catch (const std::runtime_error &e) {
+        fail (e.what ());
+    }
+
+    // every frame starts out in the fill ring, ready for the kernel
+    auto *addresses = static_cast<std::uint64_t *> (fill.descriptors);
+    for (std::uint32_t i = 0; i < entries; i++) {
+        addresses[i] = static_cast<std::uint64_t> (i) * frame_size;
+    }
+    std::atomic_ref (*fill.producer).store (entries, std::memory_order_release);
+
+    // generic XDP hands over copies, so copy mode
+    sockaddr_xdp address = {};
+    address.sxdp_family = AF_XDP;
+    address.sxdp_ifindex = ifindex;
+    address.sxdp_queue_id = settings.queue;
+    address.sxdp_flags = XDP_COPY;
+    if (bind (xsk, reinterpret_cast<sockaddr *> (&address), sizeof (address)) < 0) {
+        fail ("Cannot bind AF_XDP socket to " + settings.interface);
+    }
+
+    try {
+        load_program (ifindex, settings.queue, port, settings.queue + 1);
+    } catch (const std::runtime_error &e) {
+        fail (e.what ());
+    }
+
+    events = epoll_create1 (EPOLL_CLOEXEC);
+    if (events < 0) {
+        fail ("Cannot create epoll descriptor");
+    }
+
+    epoll_event ring_event = {.events = EPOLLIN, .data = {.fd = xsk}};
+    epoll_event socket_event = {.events = EPOLLIN, .data = {.fd = inner->descriptor ()}};
+    if (epoll_ctl (events, EPOLL_CTL_ADD, xsk, &ring_event) < 0
+        || epoll_ctl (events, EPOLL_CTL_ADD, inner->descriptor (), &socket_event) < 0) {
+        fail ("Cannot watch AF_XDP and socket descriptors");
+    }
+
+    fallback = std::move (inner);
+}
+
+xdp_transport::~xdp_transport () {
+    release ();
+}
+
+/**
+ * @brief Detach the program and free everything set up so far.
+ */
+void xdp_transport::release () {
+    // closing the link detaches the program
+    for (int *fd: {&link_fd, &program_fd, &map_fd, &events}) {
+        if (*fd >= 0) {
+            close (*fd);
+            *fd = -1;
+        }
+    }
+
+    for (ring *r: {&rx, &fill, &completion}) {
+        if (r->mapped != nullptr) {
+            munmap (r->mapped, r->mapped_length);
+            *r = {};
+        }
+    }
+
+    if (xsk >= 0) {
+        close (xsk);
+        xsk = -1;
+    }
+
+    if (umem != nullptr) {
+        munmap (umem, umem_length);
+        umem = nullptr;
+    }
+}
+
+/**
+ * @brief Map one of the socket's rings.
+ *
+ * @throws std::runtime_error If the ring cannot be mapped.
+ */
+void xdp_transport::map_ring (ring &r, const std::uint64_t offset, const xdp_ring_offset &offsets,
+                              const std::uint32_t entries, const std::size_t descriptor_size) {
+    const std::size_t length = offsets.desc + entries * descriptor_size;
+
+    void *mapped = mmap (nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk,
+                         static_cast<off_t> (offset));
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error ("Cannot map AF_XDP ring");
+    }
+
+    auto *base = static_cast<char *> (mapped);
+    r.mapped = mapped;
+    r.mapped_length = length;
+    r.producer = reinterpret_cast<std::uint32_t *> (base + offsets.producer);
+    r.consumer = reinterpret_cast<std::uint32_t *> (base + offsets.consumer);
+    r.descriptors = base + offsets.desc;
+    r.mask = entries - 1;
+}
+
+/**
+ * @brief Load the steering program, point its map at our socket and attach it in generic mode.
+ *
+ * The program redirects an IPv4 datagram without options or fragmentation,
+ * whose UDP destination is `port`, to the socket registered for the queue it
+ * arrived on; when no socket is registered there the redirect falls back to
+ * XDP_PASS, as does everything else.
+ *
+ * @throws std::runtime_error If the map, program or link cannot be created.
+ */
+void xdp_transport::load_program (const unsigned int ifindex, const std::uint32_t queue, const unsigned short port,
+                                  const std::uint32_t entries) {
+    bpf_attr attr = {};
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof (std::uint32_t);
+    attr.value_size = sizeof (std::uint32_t);
+    attr.max_entries = entries;
+    strncpy (attr.map_name, "hostmon_xsks", sizeof (attr.map_name) - 1);
+
+    map_fd = static_cast<int> (bpf (BPF_MAP_CREATE, attr));
+    if (map_fd < 0) {
+        throw std::runtime_error (std::string ("Cannot create XSKMAP: ") + strerror (errno));
+    }
+
+    // the frame's bytes as loaded by a little or big endian machine alike
+    const std::int32_t ipv4 = htons (ETH_P_IP);
+    const std::int32_t fragment_bits = htons (0x3fff);
+    const std::int32_t destination_port = htons (port);
+
+    constexpr std::int16_t headers = ETH_HLEN + 20 + 8;
+
+    std::vector<bpf_insn> program = {
+        move_register (BPF_REG_6, BPF_REG_1),
+        load (BPF_W, BPF_REG_2, BPF_REG_1, offsetof (xdp_md, data)),
+        load (BPF_W, BPF_REG_3, BPF_REG_1, offsetof (xdp_md, data_end)),
+        move_register (BPF_REG_4, BPF_REG_2),
+        alu_immediate (BPF_ADD, BPF_REG_4, headers),
+        jump_register (BPF_JGT, BPF_REG_4, BPF_REG_3),
+        load (BPF_H, BPF_REG_5, BPF_REG_2, 12),
+        jump_immediate (BPF_JNE, BPF_REG_5, ipv4),
+        load (BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN),
+        jump_immediate (BPF_JNE, BPF_REG_5, 0x45),
+        load (BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + 9),
+        jump_immediate (BPF_JNE, BPF_REG_5, IPPROTO_UDP),
+        load (BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + 6),
+        alu_immediate (BPF_AND, BPF_REG_5, fragment_bits),
+        jump_immediate (BPF_JNE, BPF_REG_5, 0),
+        load (BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + 20 + 2),
+        jump_immediate (BPF_JNE, BPF_REG_5, destination_port),
+        load (BPF_W, BPF_REG_2, BPF_REG_6, offsetof (xdp_md, rx_queue_index)),
+        {BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd},
+        {0, 0, 0, 0, 0},
+        move_immediate (BPF_REG_3, XDP_PASS),
+        {BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map},
+        {BPF_JMP | BPF_EXIT, 0, 0, 0, 0}
+    };
+
+    // every conditional jump so far goes to the XDP_PASS exit appended here
+    const auto pass = static_cast<std::int16_t> (program.size ());
+    for (std::size_t i = 0; i < program.size (); i++) {
+        const auto op = BPF_OP (program[i].code);
+        if (BPF_CLASS (program[i].code) == BPF_JMP && op != BPF_CALL && op != BPF_EXIT) {
+            program[i].off = static_cast<std::int16_t> (pass - static_cast<std::int16_t> (i) - 1);
+        }
+    }
+    program.push_back (move_immediate (BPF_REG_0, XDP_PASS));
+    program.push_back ({BPF_JMP | BPF_EXIT, 0, 0, 0, 0});
+
+    static constexpr char license[] = "GPL";
+    std::vector<char> log (16384);
+
+    attr = {};
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = reinterpret_cast<std::uint64_t> (program.data ());
+    attr.insn_cnt = program.size ();
+    attr.license = reinterpret_cast<std::uint64_t> (license);
+    attr.log_buf = reinterpret_cast<std::uint64_t> (log.data ());
+    attr.log_size = log.size ();
+    attr.log_level = 1;
+    attr.expected_attach_type = BPF_XDP;
+    strncpy (attr.prog_name, "hostmon_steer", sizeof (attr.prog_name) - 1);
+
+    program_fd = static_cast<int> (bpf (BPF_PROG_LOAD, attr));
+    if (program_fd < 0) {
+        throw std::runtime_error (std::string ("Cannot load XDP program: ") + strerror (errno) + "\n" + log.data ());
+    }
+
+    attr = {};
+    attr.map_fd = map_fd;
+    attr.key = reinterpret_cast<std::uint64_t> (&queue);
+    attr.value = reinterpret_cast<std::uint64_t> (&xsk);
+    if (bpf (BPF_MAP_UPDATE_ELEM, attr) < 0) {
+        throw std::runtime_error (std::string ("Cannot register AF_XDP socket in XSKMAP: ") + strerror (errno));
+    }
+
+    attr = {};
+    attr.link_create.prog_fd = program_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+
+    link_fd = static_cast<int> (bpf (BPF_LINK_CREATE, attr));
+    if (link_fd < 0) {
+        throw std::runtime_error (std::string ("Cannot attach XDP program: ") + strerror (errno));
+    }
+}
+
+/**
+ * @brief Take the next datagram from the RX ring, returning its frame to the fill ring.
+ *
+ * @return The payload length, or -1 with errno EAGAIN when the ring is empty.
+ */
+ssize_t xdp_transport::take (char *buffer, const std::size_t size, std::string &source) {
+    std::atomic_ref rx_consumer (*rx.consumer);
+    std::atomic_ref fill_producer (*fill.producer);
+
+    while (true) {
+        const auto consumed = rx_consumer.load (std::memory_order_relaxed);
+        if (consumed == std::atomic_ref (*rx.producer).load (std::memory_order_acquire)) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        const auto &d = static_cast<const xdp_desc *> (rx.descriptors)[consumed & rx.mask];
+        const auto *frame = static_cast<const unsigned char *> (umem) + d.addr;
+
+        // the program only passes on frames with these headers, so only their lengths need checking
+        ssize_t length = -1;
+        constexpr std::size_t payload = ETH_HLEN + 20 + 8;
+        if (d.len >= payload) {
+            const std::size_t udp_length = frame[ETH_HLEN + 24] << 8 | frame[ETH_HLEN + 25];
+            if (udp_length >= 8 && udp_length - 8 <= d.len - payload) {
+                length = static_cast<ssize_t> (std::min (size, udp_length - 8));
+                memcpy (buffer, frame + payload, length);
+
+                char ip[INET_ADDRSTRLEN];
+                inet_ntop (AF_INET, frame + ETH_HLEN + 12, ip, INET_ADDRSTRLEN);
+                source = ip;
+            }
+        }
+
+        const auto filled = fill_producer.load (std::memory_order_relaxed);
+        static_cast<std::uint64_t *> (fill.descriptors)[filled & fill.mask] = d.addr - d.addr % frame_size;
+        fill_producer.store (filled + 1, std::memory_order_release);
+        rx_consumer.store (consumed + 1, std::memory_order_release);
+
+        if (length >= 0) {
+            redirected++;
+            return length;
+        }
+    }
+}
+
+ssize_t xdp_transport::send (const std::string &) {
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+/**
+ * @brief Block for one datagram from the ring or, failing that, the socket.
+ *
+ * @return The payload length, or -1 with errno EAGAIN after timeout_ms with nothing received.
+ */
+ssize_t xdp_transport::receive (char *buffer, const std::size_t size, std::string &source) {
+    while (true) {
+        if (const ssize_t length = take (buffer, size, source); length >= 0) {
+            return length;
+        }
+
+        epoll_event ready[2];
+        const int count = epoll_wait (events, ready, 2, timeout_ms);
+        if (count < 0) {
+            return -1;
+        }
+        if (count == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (ready[i].data.fd != xsk) {
+                return fallback->receive (buffer, size, source);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Drops on the socket plus datagrams the ring had no room or no free frame for.
+ */
+std::uint64_t xdp_transport::kernel_drops () const {
+    xdp_statistics statistics = {};
+    socklen_t length = sizeof (statistics);
+    if (getsockopt (xsk, SOL_XDP, XDP_STATISTICS, &statistics, &length) < 0) {
+        return fallback->kernel_drops ();
+    }
+
+    return fallback->kernel_drops () + statistics.rx_dropped + statistics.rx_ring_full
+           + statistics.rx_fill_ring_empty_descs;
+}
+
+/**
+ * @brief Put an AF_XDP receive path in front of a socket transport when the settings ask for it.
+ *
+ * If AF_XDP cannot be set up (an old kernel, no CAP_NET_ADMIN or CAP_BPF, an
+ * unknown interface) the reason is printed and the socket transport is
+ * returned unchanged.
+ */
+std::unique_ptr<transport> with_xdp (std::unique_ptr<transport> inner, const xdp_settings &settings,
+                                     const unsigned short port, const int timeout_ms) {
+    if (settings.interface.empty ()) {
+        return inner;
+    }
+
+    try {
+        return std::make_unique<xdp_transport> (inner, settings, port, timeout_ms);
+    } catch (const std::runtime_error &e) {
+        std::cerr << "AF_XDP unavailable, receiving on the socket: " << e.what () << "\n";
+        return inner;
+    }
+}
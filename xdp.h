@@ -0,0 +1,107 @@
+#ifndef HOSTMON_XDP_H
+#define HOSTMON_XDP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <linux/if_xdp.h>
+#include <nlohmann/json.hpp>
+
+#include "transport.h"
+
+using json = nlohmann::json;
+
+/**
+ * @brief Where the AF_XDP receive path attaches. An empty interface turns it off.
+ */
+struct xdp_settings {
+    std::string interface;
+    std::uint32_t queue = 0;
+    // UMEM frames of frame_size bytes; also the size of each ring
+    std::uint32_t frames = 2048;
+};
+
+xdp_settings xdp_from_configuration (const json &settings);
+
+/**
+ * @class xdp_transport
+ * @brief A receive-only transport that takes discovery datagrams straight from an AF_XDP socket.
+ *
+ * An XDP program, attached in generic (SKB) mode so it works on any driver,
+ * redirects unfragmented IPv4 UDP datagrams for the discovery port arriving
+ * on one queue of the interface into a UMEM ring read by this process; any
+ * other traffic, and these datagrams on other queues, continues up the stack.
+ *
+ * The socket transport it is given keeps the group joined and still receives
+ * what the program passes on, including our own advertisements looped back
+ * locally, which never reach the interface's XDP hook. receive() reads the
+ * ring first and otherwise waits on both, through an epoll descriptor that
+ * also stands for the transport in descriptor() so a fault_transport around
+ * it can still poll.
+ *
+ * The program and its map are loaded with the bpf() system call, no libbpf,
+ * and attached through a BPF link so they go away with the process.
+ */
+class xdp_transport : public transport {
+    static constexpr std::size_t frame_size = 2048;
+
+    struct ring {
+        std::uint32_t *producer = nullptr;
+        std::uint32_t *consumer = nullptr;
+        void *descriptors = nullptr;
+        std::uint32_t mask = 0;
+        void *mapped = nullptr;
+        std::size_t mapped_length = 0;
+    };
+
+    std::unique_ptr<transport> fallback;
+    int timeout_ms;
+
+    int events = -1;
+    int xsk = -1;
+    int map_fd = -1;
+    int program_fd = -1;
+    int link_fd = -1;
+
+    void *umem = nullptr;
+    std::size_t umem_length = 0;
+    ring rx;
+    ring fill;
+    ring completion;
+
+    std::uint64_t redirected = 0;
+
+    void map_ring (ring &r, std::uint64_t offset, const xdp_ring_offset &offsets, std::uint32_t entries,
+                   std::size_t descriptor_size);
+    void load_program (unsigned int ifindex, std::uint32_t queue, unsigned short port, std::uint32_t entries);
+    ssize_t take (char *buffer, std::size_t size, std::string &source);
+
+    void release ();
+
+public:
+    xdp_transport (std::unique_ptr<transport> &inner, const xdp_settings &settings, unsigned short port,
+                   int timeout_ms);
+    ~xdp_transport () override;
+
+    xdp_transport (const xdp_transport &) = delete;
+    xdp_transport &operator= (const xdp_transport &) = delete;
+
+    ssize_t send (const std::string &message) override;
+    ssize_t receive (char *buffer, std::size_t size, std::string &source) override;
+
+    [[nodiscard]] int descriptor () const override {
+        return events;
+    }
+
+    [[nodiscard]] std::uint64_t kernel_drops () const override;
+
+    [[nodiscard]] std::uint64_t get_redirected () const {
+        return redirected;
+    }
+};
+
+std::unique_ptr<transport> with_xdp (std::unique_ptr<transport> inner, const xdp_settings &settings,
+                                     unsigned short port, int timeout_ms);
+
+#endif //HOSTMON_XDP_H
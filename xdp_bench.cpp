@@ -0,0 +1,166 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+
+#include "transport.h"
+#include "xdp.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+/**
+ * @brief Print the command line options understood by hostmon-xdp-bench.
+ */
+void usage () {
+    std::cerr << "usage: hostmon-xdp-bench [options]\n"
+              << "  --port N          UDP port to receive on or flood (50000)\n"
+              << "  --seconds N       length of the run (5)\n"
+              << "  --interface NAME  receive through AF_XDP on this interface; the socket alone without it\n"
+              << "  --queue N         the interface queue to attach to (0)\n"
+              << "  --flood ADDRESS   send advertisement-sized datagrams to ADDRESS instead of receiving\n"
+              << "  --senders N       flooding threads (1)\n";
+}
+
+static double thread_cpu_seconds () {
+    timespec ts = {};
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<double> (ts.tv_sec) + static_cast<double> (ts.tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Send datagrams as fast as one socket per thread allows.
+ */
+int flood (const std::string &address, const unsigned short port, const int seconds, const int senders) {
+    // about the size of a real advertisement
+    const std::string payload (420, 'x');
+    std::atomic<std::uint64_t> sent = 0;
+
+    std::vector<std::thread> threads;
+    const auto until = bench_clock::now () + std::chrono::seconds (seconds);
+
+    for (int i = 0; i < senders; i++) {
+        threads.emplace_back ([&] {
+            const auto channel = udp_transport::unicast (address.c_str (), port);
+            std::uint64_t count = 0;
+            while (bench_clock::now () < until) {
+                for (int burst = 0; burst < 64; burst++) {
+                    if (channel->send (payload) >= 0) {
+                        count++;
+                    }
+                }
+            }
+            sent += count;
+        });
+    }
+
+    for (auto &t: threads) {
+        t.join ();
+    }
+
+    std::cout << "sent " << sent << " datagrams, " << sent / seconds << "/s\n";
+    return 0;
+}
+
+/**
+ * @file xdp_bench.cpp
+ * @brief Measures how many datagrams one core receives through the socket or through AF_XDP.
+ *
+ * Run the receiver on one host (or network namespace) and --flood from
+ * another at its address. The receiver is the engine's receive path without
+ * the parsing: one thread calling transport::receive(). Packets per core
+ * second divides what it received by the CPU time of that thread alone, so
+ * the socket path is charged for the kernel's UDP stack and the AF_XDP path
+ * only for the copy out of the ring; generic mode still runs the driver and
+ * XDP hook in softirq, which neither figure includes.
+ */
+int main (const int argc, char *argv[]) {
+    unsigned short port = 50000;
+    int seconds = 5;
+    int senders = 1;
+    std::string target;
+    xdp_settings settings;
+
+    try {
+        for (int i = 1; i + 1 < argc; i += 2) {
+            const std::string arg = argv[i];
+            const std::string value = argv[i + 1];
+
+            if (arg == "--port") {
+                port = static_cast<unsigned short> (std::stoul (value));
+            } else if (arg == "--seconds") {
+                seconds = std::stoi (value);
+            } else if (arg == "--interface") {
+                settings.interface = value;
+            } else if (arg == "--queue") {
+                settings.queue = std::stoul (value);
+            } else if (arg == "--flood") {
+                target = value;
+            } else if (arg == "--senders") {
+                senders = std::stoi (value);
+            } else {
+                usage ();
+                return 1;
+            }
+        }
+        if (argc % 2 == 0) {
+            usage ();
+            return 1;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Bad option value: " << e.what () << "\n";
+        return 1;
+    }
+
+    if (!target.empty ()) {
+        return flood (target, port, seconds, senders);
+    }
+
+    std::unique_ptr<transport> socket = udp_transport::bound (port);
+    int buffer_size = 4 * 1024 * 1024;
+    setsockopt (socket->descriptor (), SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof (buffer_size));
+    timeval tv = {0, 100000};
+    setsockopt (socket->descriptor (), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    auto channel = with_xdp (std::move (socket), settings, port, 100);
+    const auto *fast = dynamic_cast<const xdp_transport *> (channel.get ());
+
+    std::cout << "receiving on port " << port << " through " << (fast ? "AF_XDP" : "the socket") << "\n";
+
+    char buffer[2048];
+    std::string source;
+    std::uint64_t received = 0;
+
+    // the clock starts with the first datagram, so the flood can be started at leisure
+    while (channel->receive (buffer, sizeof (buffer), source) < 0) {
+    }
+    received++;
+
+    const auto started = bench_clock::now ();
+    const double cpu_started = thread_cpu_seconds ();
+    const auto until = started + std::chrono::seconds (seconds);
+
+    while (bench_clock::now () < until) {
+        if (channel->receive (buffer, sizeof (buffer), source) >= 0) {
+            received++;
+        }
+    }
+
+    const std::chrono::duration<double> elapsed = bench_clock::now () - started;
+    const double cpu = thread_cpu_seconds () - cpu_started;
+
+    std::cout << std::fixed << std::setprecision (0)
+              << "received " << received << " datagrams, " << received / elapsed.count () << "/s\n"
+              << std::setprecision (2) << "receiving thread used " << cpu << " CPU seconds, "
+              << std::setprecision (0) << (cpu > 0 ? received / cpu : 0) << " datagrams per core second\n";
+    if (fast) {
+        std::cout << fast->get_redirected () << " came through the AF_XDP ring\n";
+    }
+
+    return 0;
+}